@@ -0,0 +1,181 @@
+// Allocation cost on an empty vs a 95%-full image.
+// Compares the original linear FAT scan with the free-cluster bitmap + next-fit rotor,
+// then measures allocations/sec with several threads: one lock around a single
+// next-fit rotor versus the lock-free allocator with per-thread allocation groups.
+#define _DEFAULT_SOURCE
+#include "bench_util.h"
+#include "../src/alloc.h"
+#include <pthread.h>
+#include <string.h>
+
+#define CHAIN_LENGTH 64     // Clusters allocated per simulated fs_write
+#define ROUNDS 2000         // Simulated writes per measurement
+#define MT_CHAIN_LENGTH 16  // Clusters each thread holds before freeing them again
+#define MT_ALLOCATIONS 400000 // Allocations per measurement, split between the threads
+#define MT_FILL 50          // Percentage of the data area used during the threaded runs
+#define CLUSTER_COUNT FS_DEFAULT_CLUSTER_COUNT
+#define DATA_CLUSTER_START 10 // Where the data area of the default geometry starts
+
+static uint16_t fat[CLUSTER_COUNT];
+
+// Marks 'percent' of the data area as used, scattered pseudo-randomly.
+static void fill_fat(int percent) {
+    memset(fat, 0, sizeof(fat));
+    for (uint32_t i = 0; i < DATA_CLUSTER_START; ++i) {
+        fat[i] = FAT_ENTRY_RESERVED;
+    }
+    uint32_t data_clusters = CLUSTER_COUNT - DATA_CLUSTER_START;
+    uint32_t to_fill = data_clusters * percent / 100;
+    srand(42);
+    while (to_fill > 0) {
+        uint32_t c = DATA_CLUSTER_START + (uint32_t)rand() % data_clusters;
+        if (fat[c] == FAT_ENTRY_FREE) {
+            fat[c] = FAT_ENTRY_EOF;
+            to_fill--;
+        }
+    }
+}
+
+// The allocator as it was: scan the FAT from the start of the data area every time.
+static uint16_t linear_find_free() {
+    for (uint16_t i = DATA_CLUSTER_START; i < CLUSTER_COUNT; ++i) {
+        if (fat[i] == FAT_ENTRY_FREE) return i;
+    }
+    return 0;
+}
+
+static double bench_linear() {
+    uint16_t chain[CHAIN_LENGTH];
+    double start = now_seconds();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < CHAIN_LENGTH; ++i) {
+            chain[i] = linear_find_free();
+            fat[chain[i]] = FAT_ENTRY_EOF;
+        }
+        for (int i = 0; i < CHAIN_LENGTH; ++i) fat[chain[i]] = FAT_ENTRY_FREE;
+    }
+    return now_seconds() - start;
+}
+
+static double bench_bitmap(alloc_bitmap_t* bitmap) {
+    uint32_t chain[CHAIN_LENGTH];
+    double start = now_seconds();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < CHAIN_LENGTH; ++i) {
+            chain[i] = alloc_claim(bitmap);
+        }
+        for (int i = 0; i < CHAIN_LENGTH; ++i) alloc_mark_free(bitmap, chain[i]);
+    }
+    return now_seconds() - start;
+}
+
+// The threaded allocator before allocation groups: one next-fit rotor over one bitmap,
+// with every allocation and release serialized by a single lock.
+static struct {
+    pthread_mutex_t lock;
+    uint64_t words[CLUSTER_COUNT / 64];
+    uint32_t rotor;
+} g_locked = { PTHREAD_MUTEX_INITIALIZER, {0}, DATA_CLUSTER_START };
+
+static uint32_t locked_claim() {
+    pthread_mutex_lock(&g_locked.lock);
+    uint32_t word_index = g_locked.rotor / 64;
+    uint64_t word = g_locked.words[word_index] & (~(uint64_t)0 << (g_locked.rotor % 64));
+    uint32_t cluster_index = 0;
+    for (uint32_t n = 0; n <= CLUSTER_COUNT / 64; ++n) {
+        if (word != 0) {
+            cluster_index = word_index * 64 + (uint32_t)__builtin_ctzll(word);
+            g_locked.words[word_index] &= ~((uint64_t)1 << (cluster_index % 64));
+            g_locked.rotor = (cluster_index + 1 < CLUSTER_COUNT) ? cluster_index + 1 : DATA_CLUSTER_START;
+            break;
+        }
+        word_index = (word_index + 1) % (CLUSTER_COUNT / 64);
+        word = g_locked.words[word_index];
+    }
+    pthread_mutex_unlock(&g_locked.lock);
+    return cluster_index;
+}
+
+static void locked_release(uint32_t cluster_index) {
+    pthread_mutex_lock(&g_locked.lock);
+    g_locked.words[cluster_index / 64] |= (uint64_t)1 << (cluster_index % 64);
+    pthread_mutex_unlock(&g_locked.lock);
+}
+
+typedef struct {
+    alloc_bitmap_t* bitmap; // NULL selects the locked allocator
+    uint32_t rounds;
+} mt_worker_t;
+
+static void* mt_worker(void* arg) {
+    mt_worker_t* w = (mt_worker_t*)arg;
+    uint32_t chain[MT_CHAIN_LENGTH];
+    for (uint32_t r = 0; r < w->rounds; ++r) {
+        for (int i = 0; i < MT_CHAIN_LENGTH; ++i) {
+            chain[i] = (w->bitmap != NULL) ? alloc_claim(w->bitmap) : locked_claim();
+        }
+        for (int i = 0; i < MT_CHAIN_LENGTH; ++i) {
+            if (w->bitmap != NULL) alloc_mark_free(w->bitmap, chain[i]);
+            else locked_release(chain[i]);
+        }
+    }
+    return NULL;
+}
+
+// Returns allocations per second.
+static double bench_threads(alloc_bitmap_t* bitmap, int thread_count) {
+    pthread_t threads[16];
+    mt_worker_t workers[16];
+    double start = now_seconds();
+    for (int t = 0; t < thread_count; ++t) {
+        workers[t].bitmap = bitmap;
+        workers[t].rounds = MT_ALLOCATIONS / MT_CHAIN_LENGTH / (uint32_t)thread_count;
+        pthread_create(&threads[t], NULL, mt_worker, &workers[t]);
+    }
+    for (int t = 0; t < thread_count; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    return (double)workers[0].rounds * MT_CHAIN_LENGTH * thread_count / elapsed;
+}
+
+static void bench_concurrency() {
+    const int thread_counts[] = {1, 4, 16};
+    fill_fat(MT_FILL);
+
+    alloc_bitmap_t bitmap;
+    if (alloc_init(&bitmap, CLUSTER_COUNT, DATA_CLUSTER_START) != 0) return;
+    alloc_rebuild(&bitmap, fat);
+    memcpy(g_locked.words, bitmap.words, sizeof(g_locked.words));
+
+    printf("\n%-8s  %-16s  %-16s  %s\n", "Threads", "Locked Mallocs/s", "Groups Mallocs/s", "Speedup");
+    for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++i) {
+        double locked = bench_threads(NULL, thread_counts[i]);
+        double grouped = bench_threads(&bitmap, thread_counts[i]);
+        printf("%-8d  %-16.1f  %-16.1f  %.1fx\n", thread_counts[i], locked / 1e6, grouped / 1e6, grouped / locked);
+    }
+    alloc_destroy(&bitmap);
+}
+
+int main() {
+    const int fill_levels[] = {0, 95};
+    uint64_t allocations = (uint64_t)ROUNDS * CHAIN_LENGTH;
+
+    printf("%-6s  %-14s  %-14s  %s\n", "Fill", "Linear ns/op", "Bitmap ns/op", "Speedup");
+    for (size_t i = 0; i < sizeof(fill_levels) / sizeof(fill_levels[0]); ++i) {
+        fill_fat(fill_levels[i]);
+        double linear = bench_linear();
+
+        alloc_bitmap_t bitmap;
+        if (alloc_init(&bitmap, CLUSTER_COUNT, DATA_CLUSTER_START) != 0) return 1;
+        alloc_rebuild(&bitmap, fat);
+        double bitmap_time = bench_bitmap(&bitmap);
+        alloc_destroy(&bitmap);
+
+        printf("%3d%%    %-14.1f  %-14.1f  %.1fx\n", fill_levels[i],
+               linear * 1e9 / allocations, bitmap_time * 1e9 / allocations, linear / bitmap_time);
+    }
+
+    bench_concurrency();
+    return 0;
+}
@@ -0,0 +1,107 @@
+// Latency of find_entry_by_path and fs_read on each block device backend:
+// the partition file (with and without a useful cluster cache), mmap, a RAM disk,
+// and a RAM disk behind a latency wrapper that models a slow disk. The file and RAM
+// backends are also measured with the dentry cache off, to show what it saves.
+#define _DEFAULT_SOURCE
+#include "bench_util.h"
+#include <string.h>
+
+#define LOOKUP_ROUNDS 200000
+#define READ_ROUNDS 20000
+#define SLOW_ROUNDS 200          // Rounds on the slow disk, where every miss sleeps
+#define SLOW_DISK_US 50
+#define FILE_SIZE (32 * 1024)
+#define DEEP_PATH "/d1/d2/d3/d4/target.txt"
+
+static int build_image(fat_volume_t* vol) {
+    if (fs_format(vol, NULL) != 0 || fs_load_fat(vol) != 0) return -1;
+
+    const char* dirs[] = {"/d1", "/d1/d2", "/d1/d2/d3", "/d1/d2/d3/d4"};
+    char path[64];
+    for (int d = 0; d < 4; ++d) {
+        fs_mkdir(vol, dirs[d]);
+        for (int f = 0; f < 20; ++f) { // Neighbours make each directory scan realistic
+            snprintf(path, sizeof(path), "%s/f%02d", dirs[d], f);
+            fs_create(vol, path);
+        }
+    }
+    fs_create(vol, DEEP_PATH);
+
+    static char content[FILE_SIZE + 1];
+    memset(content, 'x', FILE_SIZE);
+    fs_create(vol, "/data.bin");
+    if (fs_write(vol, "/data.bin", content) != 0) return -1;
+    return fs_sync(vol);
+}
+
+static void measure(fat_volume_t* vol, const char* label, int lookup_rounds, int read_rounds) {
+    path_search_result_t result;
+    double start = now_seconds();
+    for (int i = 0; i < lookup_rounds; ++i) {
+        find_entry_by_path(vol, DEEP_PATH, &result);
+    }
+    double lookup = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < read_rounds; ++i) {
+        fs_read(vol, "/data.bin");
+    }
+    double read = now_seconds() - start;
+
+    quiet(false);
+    printf("%-18s  %-18.1f  %.1f\n", label, lookup * 1e9 / lookup_rounds, read * 1e6 / read_rounds);
+    quiet(true);
+}
+
+int main() {
+    char dir[] = BENCH_DIR_TEMPLATE;
+    if (enter_bench_dir(dir) != 0) return 1;
+
+    quiet(true);
+    fat_volume_t* vol = fs_open_volume(PARTITION_NAME);
+    if (vol == NULL || build_image(vol) != 0) {
+        quiet(false);
+        fprintf(stderr, "Error building the benchmark image.\n");
+        return 1;
+    }
+    quiet(false);
+
+    printf("%-18s  %-18s  %s\n", "Backend", "Lookup ns/op", "Read 32KB us/op");
+    quiet(true);
+
+    fs_set_cache_size(vol, 1);
+    measure(vol, "file, 1 slot", LOOKUP_ROUNDS, READ_ROUNDS);
+    fs_set_cache_size(vol, CACHE_DEFAULT_CLUSTERS);
+    measure(vol, "file, cached", LOOKUP_ROUNDS, READ_ROUNDS);
+    fs_set_dentry_cache(vol, false);
+    measure(vol, "file, no dcache", LOOKUP_ROUNDS, READ_ROUNDS);
+    fs_set_dentry_cache(vol, true);
+
+    fs_set_backend(vol, FS_BACKEND_MMAP);
+    measure(vol, "mmap", LOOKUP_ROUNDS, READ_ROUNDS);
+    fs_close_volume(vol);
+
+    // Volumes attached to a device don't own it; close the device after the volume
+    block_dev_t* ram = bdev_open_ram(FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT);
+    vol = (ram != NULL) ? fs_attach_volume(ram) : NULL;
+    if (vol == NULL || build_image(vol) != 0) return 1;
+    measure(vol, "ram", LOOKUP_ROUNDS, READ_ROUNDS);
+    fs_set_dentry_cache(vol, false);
+    measure(vol, "ram, no dcache", LOOKUP_ROUNDS, READ_ROUNDS);
+    fs_close_volume(vol);
+    bdev_close(ram);
+
+    bdev_latency_t latency = { SLOW_DISK_US, SLOW_DISK_US, SLOW_DISK_US };
+    block_dev_t* slow = bdev_open_latency(bdev_open_ram(FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT), latency);
+    vol = (slow != NULL) ? fs_attach_volume(slow) : NULL;
+    if (vol == NULL || build_image(vol) != 0) return 1;
+    fs_set_cache_size(vol, 1);
+    measure(vol, "slow disk, 1 slot", SLOW_ROUNDS, SLOW_ROUNDS);
+    fs_set_cache_size(vol, CACHE_DEFAULT_CLUSTERS);
+    measure(vol, "slow disk, cached", SLOW_ROUNDS, SLOW_ROUNDS);
+    fs_close_volume(vol);
+    bdev_close(slow);
+    quiet(false);
+    leave_bench_dir(dir);
+    return 0;
+}
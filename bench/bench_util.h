@@ -0,0 +1,63 @@
+// Helpers shared by the benchmarks: a monotonic clock, silencing the fs_* messages, and a
+// temporary working directory for the partition file. Define _DEFAULT_SOURCE before
+// including it.
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include "../src/fat_fs.h"
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Template of the directory enter_bench_dir() creates
+#define BENCH_DIR_TEMPLATE "/tmp/fat_bench_XXXXXX"
+
+static inline double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The fs_* functions report to stdout; silence them while measuring.
+static inline void quiet(bool on) {
+    static int saved_stdout = -1;
+    fflush(stdout);
+    if (on) {
+        saved_stdout = dup(STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    } else {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+}
+
+// Creates a directory from 'dir', a copy of BENCH_DIR_TEMPLATE, and makes it the working
+// directory, so that PARTITION_NAME lands there. Returns 0, or -1 after reporting the error
+// (and removing the directory if it was created).
+static inline int enter_bench_dir(char* dir) {
+    if (mkdtemp(dir) == NULL) {
+        perror("Error creating benchmark directory");
+        return -1;
+    }
+    if (chdir(dir) != 0) {
+        perror("Error entering benchmark directory");
+        rmdir(dir);
+        return -1;
+    }
+    return 0;
+}
+
+// Removes the partition file and the directory entered by enter_bench_dir().
+static inline void leave_bench_dir(const char* dir) {
+    unlink(PARTITION_NAME);
+    if (chdir("/") != 0) {
+        perror("Error leaving benchmark directory");
+        return;
+    }
+    rmdir(dir);
+}
+
+#endif
@@ -0,0 +1,145 @@
+// Lookup latency in one large directory, scanning its cluster chain versus using the
+// in-memory directory index, for 32 up to 100k entries. Also reports how many
+// directory clusters each lookup reads and how long the first lookup takes to build the index.
+// The dentry cache is off, or repeated paths would be answered without either.
+#define _DEFAULT_SOURCE
+#include "bench_util.h"
+#include <string.h>
+
+#define SCAN_ENTRY_BUDGET 20000000   // Entries compared per scan measurement (bounds its run time)
+#define INDEX_ROUNDS 200000
+#define PATH_POOL 1024               // Random paths picked before timing starts
+
+static char g_paths[PATH_POOL][32];
+static fs_geometry_t g_geometry; // Of the image build_image() formats
+
+static uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Directory cluster number 'i' of the root directory's chain.
+static uint16_t root_chain_cluster(uint32_t i) {
+    return (i == 0) ? (uint16_t)g_geometry.root_dir_cluster : (uint16_t)(g_geometry.data_cluster_start + i - 1);
+}
+
+// Formats the image, then writes a root directory of 'entries' files straight to the device.
+// Creating 100k files one by one wouldn't fit: each would need a cluster of its own, so here
+// all files share a single (empty) data cluster.
+static int build_image(uint32_t entries) {
+    fat_volume_t* vol = fs_open_volume(PARTITION_NAME);
+    if (vol == NULL || fs_format(vol, NULL) != 0) return -1;
+    fs_get_geometry(vol, &g_geometry);
+    fs_close_volume(vol);
+
+    uint32_t cluster_size = g_geometry.cluster_size;
+    uint32_t entries_per_cluster = cluster_size / DIR_ENTRY_SIZE;
+    block_dev_t* dev = bdev_open_file(PARTITION_NAME, cluster_size, g_geometry.cluster_count, false);
+    if (dev == NULL) return -1;
+
+    // The FAT clusters are read and written back one at a time
+    uint16_t* fat = malloc((size_t)g_geometry.fat_clusters * cluster_size);
+    if (fat == NULL) return -1;
+    for (uint32_t i = 0; i < g_geometry.fat_clusters; ++i) {
+        void* buffer = (uint8_t*)fat + (size_t)i * cluster_size;
+        if (bdev_readv(dev, FAT_CLUSTER_START + i, 1, &buffer) != 0) return -1;
+    }
+
+    uint32_t dir_clusters = (entries + entries_per_cluster - 1) / entries_per_cluster;
+    uint16_t shared_cluster = root_chain_cluster(dir_clusters);
+    if (shared_cluster >= g_geometry.journal_start) return -1;
+    fat[shared_cluster] = FAT_ENTRY_EOF;
+
+    for (uint32_t c = 0; c < dir_clusters; ++c) {
+        uint16_t cluster = root_chain_cluster(c);
+        fat[cluster] = (c + 1 < dir_clusters) ? root_chain_cluster(c + 1) : FAT_ENTRY_EOF;
+
+        union data_cluster dir;
+        memset(&dir, 0, cluster_size);
+        for (uint32_t e = 0; e < entries_per_cluster && c * entries_per_cluster + e < entries; ++e) {
+            snprintf((char*)dir.dir[e].filename, sizeof(dir.dir[e].filename), "f%06u", c * entries_per_cluster + e);
+            dir.dir[e].attributes = ATTR_ARCHIVE;
+            dir.dir[e].first_block = shared_cluster;
+        }
+        const void* buffer = &dir;
+        if (bdev_writev(dev, cluster, 1, &buffer) != 0) return -1;
+    }
+
+    for (uint32_t i = 0; i < g_geometry.fat_clusters; ++i) {
+        const void* buffer = (const uint8_t*)fat + (size_t)i * cluster_size;
+        if (bdev_writev(dev, FAT_CLUSTER_START + i, 1, &buffer) != 0) return -1;
+    }
+    free(fat);
+    int status = bdev_flush(dev);
+    bdev_close(dev);
+    return status;
+}
+
+// Runs 'rounds' random lookups. Returns ns per lookup and sets the directory clusters read per lookup.
+static double measure(fat_volume_t* vol, int rounds, double* clusters_per_lookup) {
+    cache_stats_t before, after;
+    path_search_result_t result;
+    fs_get_cache_stats(vol, &before);
+    double start = now_seconds();
+    for (int i = 0; i < rounds; ++i) {
+        find_entry_by_path(vol, g_paths[i % PATH_POOL], &result);
+    }
+    double elapsed = now_seconds() - start;
+    fs_get_cache_stats(vol, &after);
+    *clusters_per_lookup = (double)((after.hits + after.misses) - (before.hits + before.misses)) / rounds;
+    return elapsed * 1e9 / rounds;
+}
+
+int main() {
+    char dir[] = BENCH_DIR_TEMPLATE;
+    if (enter_bench_dir(dir) != 0) return 1;
+
+    printf("Random lookups of existing names in the root directory (file backend, default cache, no dentry cache)\n");
+    printf("%-8s  %-12s  %-12s  %-14s  %-14s  %s\n", "Entries", "Scan ns/op", "Index ns/op",
+           "Scan clusters", "Index clusters", "Index build us");
+
+    const uint32_t sizes[] = {32, 1000, 10000, 100000};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        uint32_t entries = sizes[s];
+        quiet(true);
+        fat_volume_t* vol = NULL;
+        if (build_image(entries) == 0) vol = fs_open_volume(PARTITION_NAME);
+        if (vol == NULL || fs_load_fat(vol) != 0) {
+            quiet(false);
+            fprintf(stderr, "Error building the benchmark image.\n");
+            return 1;
+        }
+        fs_set_dentry_cache(vol, false);
+
+        uint32_t seed = 2463534242u;
+        for (int i = 0; i < PATH_POOL; ++i) {
+            snprintf(g_paths[i], sizeof(g_paths[0]), "/f%06u", next_random(&seed) % entries);
+        }
+
+        // Scanning reads on average half of the chain; keep its total work bounded
+        int scan_rounds = SCAN_ENTRY_BUDGET / (int)entries;
+        if (scan_rounds < 20) scan_rounds = 20;
+        double scan_clusters, index_clusters;
+        fs_set_dir_index(vol, false);
+        double scan_ns = measure(vol, scan_rounds, &scan_clusters);
+
+        fs_set_dir_index(vol, true);
+        path_search_result_t result;
+        double start = now_seconds();
+        find_entry_by_path(vol, g_paths[0], &result); // Builds the index
+        double build_us = (now_seconds() - start) * 1e6;
+        double index_ns = measure(vol, INDEX_ROUNDS, &index_clusters);
+        fs_close_volume(vol);
+
+        quiet(false);
+        printf("%-8u  %-12.0f  %-12.0f  %-14.1f  %-14.1f  %.0f\n", entries, scan_ns, index_ns,
+               scan_clusters, index_clusters, build_us);
+    }
+
+    leave_bench_dir(dir);
+    return 0;
+}
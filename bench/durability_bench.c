@@ -0,0 +1,125 @@
+// Throughput of a create/write/append mix at each durability level, with 1 and 4 threads
+// each working in its own directory. Runs on the partition file (real fdatasync) and on a
+// RAM disk with added latency, where a flush costs FLUSH_LATENCY_US.
+#define _DEFAULT_SOURCE
+#include "bench_util.h"
+#include <pthread.h>
+#include <string.h>
+
+#define OPS_PER_THREAD 600
+#define MAX_THREADS 4
+#define FILES_PER_THREAD 16
+#define WRITE_SIZE 3000          // Bytes per write: three clusters
+#define APPEND_SIZE 200
+#define READ_LATENCY_US 20
+#define WRITE_LATENCY_US 20
+#define FLUSH_LATENCY_US 200
+
+static char g_write_data[WRITE_SIZE + 1];
+static char g_append_data[APPEND_SIZE + 1];
+
+typedef struct {
+    fat_volume_t* vol;
+    int id;
+} worker_t;
+
+static int build_image(fat_volume_t* vol) {
+    if (fs_format(vol, NULL) != 0 || fs_load_fat(vol) != 0) return -1;
+    char path[32];
+    for (int t = 0; t < MAX_THREADS; ++t) {
+        snprintf(path, sizeof(path), "/t%d", t);
+        if (fs_mkdir(vol, path) != 0) return -1;
+    }
+    return fs_sync(vol);
+}
+
+// Each file is created, written, then appended to a few times.
+static void* worker(void* arg) {
+    worker_t* w = (worker_t*)arg;
+    char path[32];
+    for (int i = 0; i < OPS_PER_THREAD; ++i) {
+        int step = i % 6;
+        snprintf(path, sizeof(path), "/t%d/f%d", w->id, (i / 6) % FILES_PER_THREAD);
+        if (step == 0) {
+            if (i / 6 >= FILES_PER_THREAD) fs_unlink(w->vol, path);
+            fs_create(w->vol, path);
+        } else if (step == 1) {
+            fs_write(w->vol, path, g_write_data);
+        } else {
+            fs_append(w->vol, path, g_append_data);
+        }
+    }
+    return NULL;
+}
+
+// Returns the throughput in operations per second.
+static double run(fat_volume_t* vol, int thread_count) {
+    pthread_t threads[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+
+    double start = now_seconds();
+    for (int t = 0; t < thread_count; ++t) {
+        workers[t].vol = vol;
+        workers[t].id = t;
+        pthread_create(&threads[t], NULL, worker, &workers[t]);
+    }
+    for (int t = 0; t < thread_count; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    return (double)thread_count * OPS_PER_THREAD / elapsed;
+}
+
+// Opens a fresh volume: the partition file, or a slow RAM disk (returned in 'device').
+static fat_volume_t* open_volume(bool slow_disk, block_dev_t** device) {
+    *device = NULL;
+    if (!slow_disk) {
+        return fs_open_volume(PARTITION_NAME);
+    }
+    bdev_latency_t latency = { READ_LATENCY_US, WRITE_LATENCY_US, FLUSH_LATENCY_US };
+    block_dev_t* ram = bdev_open_ram(FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT);
+    *device = (ram != NULL) ? bdev_open_latency(ram, latency) : NULL;
+    return (*device != NULL) ? fs_attach_volume(*device) : NULL;
+}
+
+int main() {
+    char dir[] = BENCH_DIR_TEMPLATE;
+    if (enter_bench_dir(dir) != 0) return 1;
+    memset(g_write_data, 'w', WRITE_SIZE);
+    memset(g_append_data, 'a', APPEND_SIZE);
+
+    printf("create + write %d B + 4 appends of %d B per file, %d operations per thread\n",
+           WRITE_SIZE, APPEND_SIZE, OPS_PER_THREAD);
+    printf("%-10s  %-10s  %-7s  %s\n", "Disk", "Durability", "Threads", "Kops/s");
+    quiet(true);
+
+    const char* disks[] = {"file", "slow disk"};
+    const char* levels[] = {"none", "commit", "strict"};
+    const fs_durability_t values[] = {FS_DURABILITY_NONE, FS_DURABILITY_COMMIT, FS_DURABILITY_STRICT};
+    const int thread_counts[] = {1, MAX_THREADS};
+    for (int d = 0; d < 2; ++d) {
+        for (int l = 0; l < 3; ++l) {
+            for (int t = 0; t < 2; ++t) {
+                block_dev_t* dev = NULL;
+                fat_volume_t* vol = open_volume(d == 1, &dev);
+                if (vol == NULL || build_image(vol) != 0) {
+                    quiet(false);
+                    fprintf(stderr, "Error building the benchmark image.\n");
+                    return 1;
+                }
+                fs_set_durability(vol, values[l]);
+                double ops = run(vol, thread_counts[t]);
+
+                quiet(false);
+                printf("%-10s  %-10s  %-7d  %.2f\n", disks[d], levels[l], thread_counts[t], ops / 1e3);
+                quiet(true);
+                fs_close_volume(vol);
+                if (dev != NULL) bdev_close(dev);
+            }
+        }
+    }
+
+    quiet(false);
+    leave_bench_dir(dir);
+    return 0;
+}
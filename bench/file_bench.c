@@ -0,0 +1,121 @@
+// Growing a file with many small appends, by path (fs_append resolves the path and walks
+// the whole FAT chain to find the last cluster every time) and through a handle (fs_pwrite
+// at the end of the file, which finds the last cluster in the handle's extent map). Also
+// times small reads through a handle, sequential and backwards, and reading the whole file
+// with fs_read (to stdout), fs_read_buf (into a buffer) and fs_read_stream (zero-copy chunks).
+// Finally, rewrites a config-sized file over and over with fs_write.
+#define _DEFAULT_SOURCE
+#include "bench_util.h"
+#include <string.h>
+
+#define CHUNK 256
+#define FILE_SIZE (1024 * 1024)
+#define APPENDS (FILE_SIZE / CHUNK)
+#define DEEP_PATH "/d1/d2/d3/d4/log.txt"
+#define WHOLE_READS 200
+#define CONFIG_PATH "/d1/app.conf"
+#define CONFIG_SIZE 4000
+#define REWRITES 20000
+
+static int build_image(fat_volume_t* vol) {
+    if (fs_format(vol, NULL) != 0 || fs_load_fat(vol) != 0) return -1;
+    const char* dirs[] = {"/d1", "/d1/d2", "/d1/d2/d3", "/d1/d2/d3/d4"};
+    for (int d = 0; d < 4; ++d) {
+        if (fs_mkdir(vol, dirs[d]) != 0) return -1;
+    }
+    return fs_create(vol, DEEP_PATH);
+}
+
+// fs_sink_t that only looks at each chunk, as a consumer parsing the data in place would.
+static int count_chunk(void* context, const void* data, uint32_t length) {
+    *(uint64_t*)context += ((const uint8_t*)data)[length - 1];
+    return 0;
+}
+
+static void report(const char* label, double seconds, int ops) {
+    quiet(false);
+    printf("%-26s  %.2f\n", label, seconds * 1e6 / ops);
+    quiet(true);
+}
+
+int main() {
+    static char chunk[CHUNK + 1];
+    memset(chunk, 'x', CHUNK);
+    char buffer[CHUNK];
+
+    printf("%d appends of %d bytes (a %d KB file), %d reads of %d bytes, then whole-file reads (RAM disk)\n",
+           APPENDS, CHUNK, FILE_SIZE / 1024, APPENDS, CHUNK);
+    printf("%-26s  %s\n", "Operation", "us/op");
+    quiet(true);
+
+    block_dev_t* ram = bdev_open_ram(FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT);
+    fat_volume_t* vol = (ram != NULL) ? fs_attach_volume(ram) : NULL;
+    if (vol == NULL || build_image(vol) != 0) {
+        quiet(false);
+        fprintf(stderr, "Error building the benchmark image.\n");
+        return 1;
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < APPENDS; ++i) {
+        fs_append(vol, DEEP_PATH, chunk);
+    }
+    report("fs_append (path)", now_seconds() - start, APPENDS);
+
+    fs_write(vol, DEEP_PATH, "");
+    int handle = fs_open(vol, DEEP_PATH);
+    if (handle < 0) return 1;
+    start = now_seconds();
+    for (int i = 0; i < APPENDS; ++i) {
+        fs_pwrite(vol, handle, chunk, CHUNK, (uint32_t)i * CHUNK);
+    }
+    report("fs_pwrite at end (handle)", now_seconds() - start, APPENDS);
+
+    start = now_seconds();
+    for (int i = 0; i < APPENDS; ++i) {
+        fs_pread(vol, handle, buffer, CHUNK, (uint32_t)i * CHUNK);
+    }
+    report("fs_pread sequential", now_seconds() - start, APPENDS);
+
+    start = now_seconds();
+    for (int i = APPENDS - 1; i >= 0; --i) {
+        fs_pread(vol, handle, buffer, CHUNK, (uint32_t)i * CHUNK);
+    }
+    report("fs_pread backwards", now_seconds() - start, APPENDS);
+
+    fs_close(vol, handle);
+
+    start = now_seconds();
+    for (int i = 0; i < WHOLE_READS; ++i) {
+        fs_read(vol, DEEP_PATH);
+    }
+    report("fs_read 1 MB (stdout)", now_seconds() - start, WHOLE_READS);
+
+    static uint8_t whole[FILE_SIZE];
+    start = now_seconds();
+    for (int i = 0; i < WHOLE_READS; ++i) {
+        fs_read_buf(vol, DEEP_PATH, 0, FILE_SIZE, whole);
+    }
+    report("fs_read_buf 1 MB", now_seconds() - start, WHOLE_READS);
+
+    uint64_t checksum = 0;
+    start = now_seconds();
+    for (int i = 0; i < WHOLE_READS; ++i) {
+        fs_read_stream(vol, DEEP_PATH, 0, FILE_SIZE, count_chunk, &checksum);
+    }
+    report("fs_read_stream 1 MB", now_seconds() - start, WHOLE_READS);
+
+    static char config[CONFIG_SIZE + 1];
+    memset(config, 'c', CONFIG_SIZE);
+    fs_create(vol, CONFIG_PATH);
+    start = now_seconds();
+    for (int i = 0; i < REWRITES; ++i) {
+        config[i % CONFIG_SIZE] = (char)('a' + i % 26);
+        fs_write(vol, CONFIG_PATH, config);
+    }
+    report("fs_write 4 KB rewrite", now_seconds() - start, REWRITES);
+
+    fs_close_volume(vol);
+    bdev_close(ram);
+    return 0;
+}
@@ -0,0 +1,95 @@
+// Sequential and metadata throughput for each cluster size from 512 B to 64 KB, on a RAM
+// disk holding an image of about IMAGE_BYTES (fewer bytes at 512 B, where the 16-bit FAT
+// runs out of clusters first). Writes and reads back one large file with fs_write_buf and
+// fs_read_buf, then creates and removes many small files in one directory.
+#define _DEFAULT_SOURCE
+#include "bench_util.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE_BYTES (32u * 1024 * 1024)
+#define FILE_SIZE (16u * 1024 * 1024)
+#define PASSES 4                 // Writes and reads of the large file per cluster size
+#define META_FILES 400           // Each takes a cluster: 400 fit the 64 KB image too
+#define SMALL_SIZE 100           // Bytes written to each small file
+
+static char g_small[SMALL_SIZE + 1];
+
+// Creates, writes and removes META_FILES files in /m. Returns the operations per second.
+static double metadata_ops(fat_volume_t* vol) {
+    char path[32];
+    double start = now_seconds();
+    for (int i = 0; i < META_FILES; ++i) {
+        snprintf(path, sizeof(path), "/m/f%d", i);
+        fs_create(vol, path);
+        fs_write(vol, path, g_small);
+    }
+    for (int i = 0; i < META_FILES; ++i) {
+        snprintf(path, sizeof(path), "/m/f%d", i);
+        fs_unlink(vol, path);
+    }
+    return 3.0 * META_FILES / (now_seconds() - start);
+}
+
+int main() {
+    uint8_t* data = malloc(FILE_SIZE);
+    uint8_t* back = malloc(FILE_SIZE);
+    if (data == NULL || back == NULL) return 1;
+    for (uint32_t i = 0; i < FILE_SIZE; ++i) {
+        data[i] = (uint8_t)(i * 31 + i / 4096);
+    }
+    memset(g_small, 's', SMALL_SIZE);
+
+    printf("%u MB file written and read %d times, then create + write + unlink of %d files (RAM disk)\n",
+           FILE_SIZE / (1024 * 1024), PASSES, META_FILES);
+    printf("%-8s  %-8s  %-8s  %-10s  %-10s  %s\n", "Cluster", "Clusters", "Image MB", "Write MB/s", "Read MB/s",
+           "Meta Kops/s");
+    quiet(true);
+
+    for (uint32_t cluster_size = FS_MIN_CLUSTER_SIZE; cluster_size <= FS_MAX_CLUSTER_SIZE; cluster_size *= 2) {
+        fs_geometry_t geometry = {0};
+        geometry.cluster_size = cluster_size;
+        geometry.cluster_count = IMAGE_BYTES / cluster_size;
+        if (geometry.cluster_count > FS_MAX_CLUSTER_COUNT) geometry.cluster_count = FS_MAX_CLUSTER_COUNT;
+
+        block_dev_t* ram = bdev_open_ram(cluster_size, geometry.cluster_count);
+        fat_volume_t* vol = (ram != NULL) ? fs_attach_volume(ram) : NULL;
+        if (vol == NULL || fs_format(vol, &geometry) != 0 || fs_load_fat(vol) != 0 ||
+            fs_create(vol, "/big") != 0 || fs_mkdir(vol, "/m") != 0) {
+            quiet(false);
+            fprintf(stderr, "Error building the benchmark image.\n");
+            return 1;
+        }
+
+        double start = now_seconds();
+        for (int p = 0; p < PASSES; ++p) {
+            data[p] ^= 1;
+            if (fs_write_buf(vol, "/big", data, FILE_SIZE) != 0) break;
+        }
+        double write_seconds = now_seconds() - start;
+
+        start = now_seconds();
+        for (int p = 0; p < PASSES; ++p) {
+            if (fs_read_buf(vol, "/big", 0, FILE_SIZE, back) != FILE_SIZE) break;
+        }
+        double read_seconds = now_seconds() - start;
+        bool intact = (memcmp(data, back, FILE_SIZE) == 0);
+
+        fs_unlink(vol, "/big");
+        double meta = metadata_ops(vol);
+
+        quiet(false);
+        double megabytes = (double)PASSES * FILE_SIZE / (1024 * 1024);
+        printf("%-8u  %-8u  %-8.1f  %-10.1f  %-10.1f  %.2f%s\n", cluster_size, geometry.cluster_count,
+               (double)cluster_size * geometry.cluster_count / (1024 * 1024), megabytes / write_seconds,
+               megabytes / read_seconds, meta / 1e3, intact ? "" : "  (read back differs!)");
+        quiet(true);
+        fs_close_volume(vol);
+        bdev_close(ram);
+    }
+
+    quiet(false);
+    free(data);
+    free(back);
+    return 0;
+}
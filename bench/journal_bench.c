@@ -0,0 +1,164 @@
+// Metadata operations that must survive a crash, on a slow disk (a RAM disk with added
+// latency, flushes being the expensive part). Each thread creates, writes and removes files
+// in its own directory. Without the journal every operation has to be followed by fs_sync,
+// which writes each dirty cluster home and flushes; with the journal an operation is durable
+// once its record is flushed, and operations finishing together share one record.
+// Prints the throughput and the operations per journal commit for each thread count.
+// Then a bulk load (creating and writing many files from one thread), one commit per
+// operation vs in batches of fs_batch_begin()/fs_batch_commit().
+#define _DEFAULT_SOURCE
+#include "bench_util.h"
+#include <pthread.h>
+#include <string.h>
+
+#define OPS_PER_THREAD 300
+#define MAX_THREADS 16
+#define FILES_PER_THREAD 8
+#define READ_LATENCY_US 20
+#define WRITE_LATENCY_US 20
+#define FLUSH_LATENCY_US 200
+#define BULK_FILES 1000
+#define BULK_BATCH 100           // Files per batch
+
+typedef struct {
+    fat_volume_t* vol;
+    int id;
+    bool sync_each;            // fs_sync after every operation (no journal)
+} worker_t;
+
+// Formats the device and, for 'journaled' false, erases the boot block so that the image
+// is loaded like one formatted before the journal existed.
+static fat_volume_t* build_image(bool journaled, block_dev_t** device) {
+    bdev_latency_t latency = { READ_LATENCY_US, WRITE_LATENCY_US, FLUSH_LATENCY_US };
+    block_dev_t* ram = bdev_open_ram(FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT);
+    block_dev_t* dev = (ram != NULL) ? bdev_open_latency(ram, latency) : NULL;
+    fat_volume_t* vol = (dev != NULL) ? fs_attach_volume(dev) : NULL;
+    *device = dev;
+    if (vol == NULL || fs_format(vol, NULL) != 0) return NULL;
+    if (!journaled) {
+        static uint8_t zeros[FS_DEFAULT_CLUSTER_SIZE];
+        const void* buffers[1] = { zeros };
+        if (bdev_writev(dev, BOOT_BLOCK_CLUSTER, 1, buffers) != 0) return NULL;
+    }
+    if (fs_load_fat(vol) != 0) return NULL;
+
+    char path[32];
+    for (int t = 0; t < MAX_THREADS; ++t) {
+        snprintf(path, sizeof(path), "/t%d", t);
+        if (fs_mkdir(vol, path) != 0) return NULL;
+    }
+    return (fs_sync(vol) == 0) ? vol : NULL;
+}
+
+static void* worker(void* arg) {
+    worker_t* w = (worker_t*)arg;
+    char path[32];
+    for (int i = 0; i < OPS_PER_THREAD; ++i) {
+        snprintf(path, sizeof(path), "/t%d/f%d", w->id, (i / 3) % FILES_PER_THREAD);
+        switch (i % 3) {
+            case 0: fs_create(w->vol, path); break;
+            case 1: fs_write(w->vol, path, "a few bytes of configuration"); break;
+            default: fs_unlink(w->vol, path); break;
+        }
+        if (w->sync_each) fs_sync(w->vol);
+    }
+    return NULL;
+}
+
+// Returns the throughput in operations per second.
+static double run(fat_volume_t* vol, int thread_count, bool sync_each) {
+    pthread_t threads[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+
+    double start = now_seconds();
+    for (int t = 0; t < thread_count; ++t) {
+        workers[t].vol = vol;
+        workers[t].id = t;
+        workers[t].sync_each = sync_each;
+        pthread_create(&threads[t], NULL, worker, &workers[t]);
+    }
+    for (int t = 0; t < thread_count; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    return (double)thread_count * OPS_PER_THREAD / elapsed;
+}
+
+// Creates and writes BULK_FILES files in /t0, 'batch' files per batch (0 = no batches).
+// Returns the elapsed time in seconds.
+static double bulk_load(fat_volume_t* vol, int batch) {
+    char path[32];
+    double start = now_seconds();
+    for (int i = 0; i < BULK_FILES; ++i) {
+        if (batch > 0 && i % batch == 0) fs_batch_begin(vol);
+        snprintf(path, sizeof(path), "/t0/f%d", i);
+        fs_create(vol, path);
+        fs_write(vol, path, "a few bytes of configuration");
+        if (batch > 0 && (i % batch == batch - 1 || i == BULK_FILES - 1)) fs_batch_commit(vol);
+    }
+    return now_seconds() - start;
+}
+
+int main() {
+    printf("create/write/unlink, %d per thread; disk latency: read %d us, write %d us, flush %d us\n",
+           OPS_PER_THREAD, READ_LATENCY_US, WRITE_LATENCY_US, FLUSH_LATENCY_US);
+    printf("%-16s  %-7s  %-10s  %s\n", "Mode", "Threads", "Kops/s", "Ops/commit");
+    quiet(true);
+
+    const int thread_counts[] = {1, 4, 16};
+    for (int mode = 0; mode < 2; ++mode) {
+        bool journaled = (mode == 1);
+        for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++i) {
+            block_dev_t* dev = NULL;
+            fat_volume_t* vol = build_image(journaled, &dev);
+            if (vol == NULL) {
+                quiet(false);
+                fprintf(stderr, "Error building the benchmark image.\n");
+                return 1;
+            }
+            journal_stats_t before, after;
+            fs_get_journal_stats(vol, &before);
+            double ops = run(vol, thread_counts[i], !journaled);
+            fs_get_journal_stats(vol, &after);
+
+            quiet(false);
+            if (journaled) {
+                uint64_t commits = after.commits - before.commits;
+                printf("%-16s  %-7d  %-10.2f  %.1f\n", "journal", thread_counts[i], ops / 1e3,
+                       (commits > 0) ? (double)(after.operations - before.operations) / commits : 0.0);
+            } else {
+                printf("%-16s  %-7d  %-10.2f  -\n", "fs_sync each op", thread_counts[i], ops / 1e3);
+            }
+            quiet(true);
+            fs_close_volume(vol);
+            bdev_close(dev);
+        }
+    }
+
+    quiet(false);
+    printf("\nBulk load: %d files created and written\n", BULK_FILES);
+    printf("%-16s  %-10s  %-8s  %s\n", "Mode", "ms", "Commits", "Clusters logged");
+    quiet(true);
+    const int batches[] = {0, BULK_BATCH};
+    for (int i = 0; i < 2; ++i) {
+        block_dev_t* dev = NULL;
+        fat_volume_t* vol = build_image(true, &dev);
+        if (vol == NULL) return 1;
+        journal_stats_t before, after;
+        fs_get_journal_stats(vol, &before);
+        double seconds = bulk_load(vol, batches[i]);
+        fs_get_journal_stats(vol, &after);
+
+        quiet(false);
+        char label[32];
+        if (batches[i] == 0) snprintf(label, sizeof(label), "per operation");
+        else snprintf(label, sizeof(label), "batches of %d", batches[i]);
+        printf("%-16s  %-10.1f  %-8llu  %llu\n", label, seconds * 1e3,
+               (unsigned long long)(after.commits - before.commits), (unsigned long long)(after.clusters - before.clusters));
+        quiet(true);
+        fs_close_volume(vol);
+        bdev_close(dev);
+    }
+    quiet(false);
+    return 0;
+}
@@ -0,0 +1,73 @@
+// Host disk space taken by the partition file (st_blocks, not its size) after formatting,
+// after filling it with files and after removing them again, with the file and mmap
+// backends. Removing a file punches its clusters out of the partition file, so the space
+// goes back to the host. Also times fs_unlink, which now includes the discards.
+#define _DEFAULT_SOURCE
+#include "bench_util.h"
+#include <string.h>
+#include <sys/stat.h>
+
+#define FILE_COUNT 1000
+#define FILE_SIZE 3000           // Bytes per file: three clusters
+
+static char g_data[FILE_SIZE + 1];
+
+// Bytes the host has allocated to the partition file, in KB.
+static long long allocated_kb() {
+    struct stat st;
+    if (stat(PARTITION_NAME, &st) != 0) return -1;
+    return (long long)st.st_blocks * 512 / 1024;
+}
+
+int main() {
+    char dir[] = BENCH_DIR_TEMPLATE;
+    if (enter_bench_dir(dir) != 0) return 1;
+    memset(g_data, 's', FILE_SIZE);
+
+    printf("%d files of %d B in a %d KB partition file; host KB allocated\n",
+           FILE_COUNT, FILE_SIZE, FS_DEFAULT_CLUSTER_SIZE * FS_DEFAULT_CLUSTER_COUNT / 1024);
+    printf("%-8s  %-10s  %-10s  %-10s  %s\n", "Backend", "Formatted", "Filled", "Emptied", "Unlink us/op");
+    quiet(true);
+
+    const char* names[] = {"file", "mmap"};
+    const fs_backend_t backends[] = {FS_BACKEND_FILE, FS_BACKEND_MMAP};
+    for (int b = 0; b < 2; ++b) {
+        unlink(PARTITION_NAME);
+        fat_volume_t* vol = fs_open_volume(PARTITION_NAME);
+        if (vol == NULL || fs_format(vol, NULL) != 0 || fs_load_fat(vol) != 0 ||
+            fs_set_backend(vol, backends[b]) != 0 || fs_sync(vol) != 0) {
+            quiet(false);
+            fprintf(stderr, "Error building the benchmark image.\n");
+            return 1;
+        }
+        long long formatted = allocated_kb();
+
+        char path[32];
+        for (int i = 0; i < FILE_COUNT; ++i) {
+            snprintf(path, sizeof(path), "/f%d", i);
+            fs_create(vol, path);
+            fs_write(vol, path, g_data);
+        }
+        fs_sync(vol);
+        long long filled = allocated_kb();
+
+        double start = now_seconds();
+        for (int i = 0; i < FILE_COUNT; ++i) {
+            snprintf(path, sizeof(path), "/f%d", i);
+            fs_unlink(vol, path);
+        }
+        fs_sync(vol);
+        double elapsed = now_seconds() - start;
+        long long emptied = allocated_kb();
+
+        quiet(false);
+        printf("%-8s  %-10lld  %-10lld  %-10lld  %.2f\n", names[b], formatted, filled, emptied,
+               elapsed * 1e6 / FILE_COUNT);
+        quiet(true);
+        fs_close_volume(vol);
+    }
+
+    quiet(false);
+    leave_bench_dir(dir);
+    return 0;
+}
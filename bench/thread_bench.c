@@ -0,0 +1,138 @@
+// Read-mostly stress test: several threads share one volume and run a mix of path
+// lookups, file reads and a few writes, each thread writing only to its own directory.
+// Prints the throughput for each thread count on the file and RAM backends.
+#define _DEFAULT_SOURCE
+#include "bench_util.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPS_PER_THREAD 20000
+#define MAX_THREADS 16
+#define DIR_COUNT 8
+#define FILES_PER_DIR 16
+#define PATH_COUNT (DIR_COUNT * FILES_PER_DIR)
+#define WRITE_PERCENT 2          // fs_write to the thread's own file
+#define READ_PERCENT 18          // fs_read of a shared file; the rest are find_entry_by_path
+
+static char g_paths[PATH_COUNT][32];
+
+typedef struct {
+    fat_volume_t* vol;
+    int id;
+    uint32_t seed;
+} worker_t;
+
+// xorshift32: rand() isn't thread-safe.
+static uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int build_image(fat_volume_t* vol) {
+    if (fs_format(vol, NULL) != 0 || fs_load_fat(vol) != 0) return -1;
+
+    char path[32];
+    for (int d = 0; d < DIR_COUNT; ++d) {
+        snprintf(path, sizeof(path), "/d%d", d);
+        fs_mkdir(vol, path);
+        for (int f = 0; f < FILES_PER_DIR; ++f) {
+            snprintf(g_paths[d * FILES_PER_DIR + f], sizeof(g_paths[0]), "/d%d/f%02d", d, f);
+            fs_create(vol, g_paths[d * FILES_PER_DIR + f]);
+            if (fs_write(vol, g_paths[d * FILES_PER_DIR + f], "shared file contents, read by every thread") != 0) return -1;
+        }
+    }
+    for (int t = 0; t < MAX_THREADS; ++t) {
+        snprintf(path, sizeof(path), "/w%d", t);
+        fs_mkdir(vol, path);
+        snprintf(path, sizeof(path), "/w%d/own", t);
+        fs_create(vol, path);
+    }
+    return fs_sync(vol);
+}
+
+static void* worker(void* arg) {
+    worker_t* w = (worker_t*)arg;
+    char own[32];
+    snprintf(own, sizeof(own), "/w%d/own", w->id);
+
+    path_search_result_t result;
+    for (int i = 0; i < OPS_PER_THREAD; ++i) {
+        uint32_t r = next_random(&w->seed);
+        uint32_t dice = r % 100;
+        const char* path = g_paths[(r >> 8) % PATH_COUNT];
+        if (dice < WRITE_PERCENT) {
+            fs_write(w->vol, own, "private file contents");
+        } else if (dice < WRITE_PERCENT + READ_PERCENT) {
+            fs_read(w->vol, path);
+        } else {
+            find_entry_by_path(w->vol, path, &result);
+        }
+    }
+    return NULL;
+}
+
+// Returns the throughput in operations per second.
+static double run(fat_volume_t* vol, int thread_count) {
+    pthread_t threads[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+
+    double start = now_seconds();
+    for (int t = 0; t < thread_count; ++t) {
+        workers[t].vol = vol;
+        workers[t].id = t;
+        workers[t].seed = 2463534242u + (uint32_t)t * 7919u;
+        pthread_create(&threads[t], NULL, worker, &workers[t]);
+    }
+    for (int t = 0; t < thread_count; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    return (double)thread_count * OPS_PER_THREAD / elapsed;
+}
+
+static void measure(fat_volume_t* vol, const char* label) {
+    const int thread_counts[] = {1, 2, 4, 8, 16};
+    double base = 0;
+    for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++i) {
+        double ops = run(vol, thread_counts[i]);
+        if (i == 0) base = ops;
+        quiet(false);
+        printf("%-8s  %-7d  %-10.0f  %.2fx\n", label, thread_counts[i], ops / 1e3, ops / base);
+        quiet(true);
+    }
+}
+
+int main() {
+    char dir[] = BENCH_DIR_TEMPLATE;
+    if (enter_bench_dir(dir) != 0) return 1;
+
+    printf("%d%% writes, %d%% reads, %d%% lookups; %ld CPUs online\n",
+           WRITE_PERCENT, READ_PERCENT, 100 - WRITE_PERCENT - READ_PERCENT, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s  %-7s  %-10s  %s\n", "Backend", "Threads", "Kops/s", "Speedup");
+    quiet(true);
+
+    fat_volume_t* vol = fs_open_volume(PARTITION_NAME);
+    if (vol == NULL || build_image(vol) != 0) {
+        quiet(false);
+        fprintf(stderr, "Error building the benchmark image.\n");
+        return 1;
+    }
+    measure(vol, "file");
+    fs_close_volume(vol);
+
+    block_dev_t* ram = bdev_open_ram(FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT);
+    vol = (ram != NULL) ? fs_attach_volume(ram) : NULL;
+    if (vol == NULL || build_image(vol) != 0) return 1;
+    measure(vol, "ram");
+    fs_close_volume(vol);
+    bdev_close(ram);
+
+    quiet(false);
+    leave_bench_dir(dir);
+    return 0;
+}
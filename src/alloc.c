@@ -0,0 +1,274 @@
+#include "alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BITS_PER_WORD 64
+
+// Every thread gets a home group the first time it allocates, round-robin.
+// Stealing from another group makes that group the thread's new home.
+static uint32_t g_next_home = 0;
+static __thread uint32_t t_home_group = UINT32_MAX;
+
+static uint64_t load_word(const alloc_bitmap_t* bitmap, uint32_t word_index) {
+    return __atomic_load_n(&bitmap->words[word_index], __ATOMIC_ACQUIRE);
+}
+
+int alloc_init(alloc_bitmap_t* bitmap, uint32_t cluster_count, uint32_t first_data) {
+    memset(bitmap, 0, sizeof(alloc_bitmap_t));
+    bitmap->word_count = (cluster_count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    bitmap->words = calloc(bitmap->word_count, sizeof(uint64_t)); // All clusters start as used
+    bitmap->group_count = (cluster_count + ALLOC_GROUP_CLUSTERS - 1) / ALLOC_GROUP_CLUSTERS;
+    bitmap->groups = calloc(bitmap->group_count, sizeof(alloc_group_t));
+    if (bitmap->words == NULL || bitmap->groups == NULL) {
+        fprintf(stderr, "Error: Could not allocate the free-cluster bitmap.\n");
+        alloc_destroy(bitmap);
+        return -1;
+    }
+
+    bitmap->cluster_count = cluster_count;
+    bitmap->first_data = first_data;
+    for (uint32_t g = 0; g < bitmap->group_count; ++g) {
+        alloc_group_t* group = &bitmap->groups[g];
+        group->first_cluster = g * ALLOC_GROUP_CLUSTERS;
+        group->end_cluster = group->first_cluster + ALLOC_GROUP_CLUSTERS;
+        if (group->end_cluster > cluster_count) group->end_cluster = cluster_count;
+        group->rotor = group->first_cluster;
+    }
+    return 0;
+}
+
+void alloc_destroy(alloc_bitmap_t* bitmap) {
+    free(bitmap->words);
+    free(bitmap->groups);
+    memset(bitmap, 0, sizeof(alloc_bitmap_t));
+}
+
+void alloc_rebuild(alloc_bitmap_t* bitmap, const uint16_t* fat) {
+    memset(bitmap->words, 0, bitmap->word_count * sizeof(uint64_t));
+    for (uint32_t i = bitmap->first_data; i < bitmap->cluster_count; ++i) {
+        if (fat[i] == 0x0000) {
+            bitmap->words[i / BITS_PER_WORD] |= (uint64_t)1 << (i % BITS_PER_WORD);
+        }
+    }
+    for (uint32_t g = 0; g < bitmap->group_count; ++g) {
+        bitmap->groups[g].rotor = bitmap->groups[g].first_cluster;
+    }
+}
+
+void alloc_mark_used(alloc_bitmap_t* bitmap, uint32_t cluster_index) {
+    uint64_t mask = (uint64_t)1 << (cluster_index % BITS_PER_WORD);
+    __atomic_fetch_and(&bitmap->words[cluster_index / BITS_PER_WORD], ~mask, __ATOMIC_ACQ_REL);
+}
+
+void alloc_mark_free(alloc_bitmap_t* bitmap, uint32_t cluster_index) {
+    if (cluster_index < bitmap->first_data || cluster_index >= bitmap->cluster_count) {
+        return; // System clusters are never allocatable
+    }
+    uint64_t mask = (uint64_t)1 << (cluster_index % BITS_PER_WORD);
+    __atomic_fetch_or(&bitmap->words[cluster_index / BITS_PER_WORD], mask, __ATOMIC_ACQ_REL);
+}
+
+uint32_t alloc_free_clusters(const alloc_bitmap_t* bitmap) {
+    uint32_t free_clusters = 0;
+    for (uint32_t i = 0; i < bitmap->word_count; ++i) {
+        free_clusters += (uint32_t)__builtin_popcountll(load_word(bitmap, i));
+    }
+    return free_clusters;
+}
+
+// Returns the first free cluster in [from, end), or 'end' if there is none.
+static uint32_t next_free(const alloc_bitmap_t* bitmap, uint32_t from, uint32_t end) {
+    while (from < end) {
+        uint32_t word_index = from / BITS_PER_WORD;
+        uint64_t word = load_word(bitmap, word_index) & (~(uint64_t)0 << (from % BITS_PER_WORD));
+        if (word != 0) {
+            uint32_t found = word_index * BITS_PER_WORD + (uint32_t)__builtin_ctzll(word);
+            return (found < end) ? found : end;
+        }
+        from = (word_index + 1) * BITS_PER_WORD;
+    }
+    return end;
+}
+
+// Returns how many clusters from 'from' on are free, without going past 'end'.
+static uint32_t free_run_length(const alloc_bitmap_t* bitmap, uint32_t from, uint32_t end) {
+    uint32_t position = from;
+    while (position < end) {
+        uint32_t word_index = position / BITS_PER_WORD;
+        uint64_t used = ~load_word(bitmap, word_index) >> (position % BITS_PER_WORD);
+        if (used != 0) {
+            position += (uint32_t)__builtin_ctzll(used);
+            break;
+        }
+        position = (word_index + 1) * BITS_PER_WORD;
+    }
+    return ((position < end) ? position : end) - from;
+}
+
+// Claims up to 'count' clusters starting at 'start', one compare-and-swap per bitmap word.
+// Stops at the first cluster that is already used (another thread may have just taken it).
+// Returns the number of clusters claimed, 0 if 'start' itself was taken.
+static uint32_t claim_from(alloc_bitmap_t* bitmap, uint32_t start, uint32_t count) {
+    uint32_t claimed = 0;
+    while (claimed < count) {
+        uint32_t position = start + claimed;
+        uint32_t word_index = position / BITS_PER_WORD;
+        uint32_t bit = position % BITS_PER_WORD;
+        uint32_t span = BITS_PER_WORD - bit;
+        if (span > count - claimed) span = count - claimed;
+        uint64_t span_mask = ((span == BITS_PER_WORD) ? ~(uint64_t)0 : (((uint64_t)1 << span) - 1)) << bit;
+
+        uint64_t word = load_word(bitmap, word_index);
+        uint64_t mask;
+        while (1) {
+            // Only the free clusters that directly follow 'position' can be part of the run
+            uint64_t used = ~word & span_mask;
+            mask = (used == 0) ? span_mask : span_mask & ((((uint64_t)1) << __builtin_ctzll(used)) - 1);
+            if (mask == 0) break;
+            if (__atomic_compare_exchange_n(&bitmap->words[word_index], &word, word & ~mask,
+                                            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            // The failed exchange reloaded 'word'; try again with its current contents
+        }
+        if (mask == 0) break;
+
+        uint32_t taken = (uint32_t)__builtin_popcountll(mask);
+        claimed += taken;
+        if (taken < span) break; // The run ends inside this word
+    }
+    return claimed;
+}
+
+// Claims the first free cluster in [from, end). Returns 'end' if there is none.
+static uint32_t claim_first_free(alloc_bitmap_t* bitmap, uint32_t from, uint32_t end) {
+    while (from < end) {
+        uint32_t word_index = from / BITS_PER_WORD;
+        uint64_t window = ~(uint64_t)0 << (from % BITS_PER_WORD);
+        uint64_t word = load_word(bitmap, word_index);
+        while ((word & window) != 0) {
+            uint32_t bit = (uint32_t)__builtin_ctzll(word & window);
+            uint32_t found = word_index * BITS_PER_WORD + bit;
+            if (found >= end) {
+                return end;
+            }
+            if (__atomic_compare_exchange_n(&bitmap->words[word_index], &word, word & ~((uint64_t)1 << bit),
+                                            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return found;
+            }
+            // The failed exchange reloaded 'word'; another thread may have taken this cluster
+        }
+        from = (word_index + 1) * BITS_PER_WORD;
+    }
+    return end;
+}
+
+static uint32_t home_group(const alloc_bitmap_t* bitmap) {
+    if (t_home_group == UINT32_MAX) {
+        t_home_group = __atomic_fetch_add(&g_next_home, 1, __ATOMIC_RELAXED);
+    }
+    if (t_home_group >= bitmap->group_count) {
+        t_home_group %= bitmap->group_count; // Only divides on a thread's first allocation
+    }
+    return t_home_group;
+}
+
+// Next-fit inside one group: the first free cluster at or after the rotor, wrapping once.
+static uint32_t claim_in_group(alloc_bitmap_t* bitmap, alloc_group_t* group) {
+    uint32_t low = (group->first_cluster > bitmap->first_data) ? group->first_cluster : bitmap->first_data;
+    if (low >= group->end_cluster) return 0;
+    uint32_t rotor = __atomic_load_n(&group->rotor, __ATOMIC_RELAXED);
+    if (rotor < low || rotor >= group->end_cluster) rotor = low;
+
+    // Pass 0 searches [rotor, end), pass 1 wraps around to [low, rotor)
+    for (int pass = 0; pass < 2; ++pass) {
+        uint32_t end = (pass == 0) ? group->end_cluster : rotor;
+        uint32_t cluster_index = claim_first_free(bitmap, (pass == 0) ? rotor : low, end);
+        if (cluster_index < end) {
+            __atomic_store_n(&group->rotor, cluster_index + 1, __ATOMIC_RELAXED);
+            return cluster_index;
+        }
+    }
+    return 0;
+}
+
+uint32_t alloc_claim(alloc_bitmap_t* bitmap) {
+    uint32_t home = home_group(bitmap);
+    for (uint32_t n = 0; n < bitmap->group_count; ++n) {
+        uint32_t g = home + n;
+        if (g >= bitmap->group_count) g -= bitmap->group_count;
+        uint32_t cluster_index = claim_in_group(bitmap, &bitmap->groups[g]);
+        if (cluster_index != 0) {
+            if (n > 0) t_home_group = g; // Keep allocating where there was room
+            return cluster_index;
+        }
+    }
+    return 0; // Invalid cluster index indicates no space
+}
+
+// Best fit inside one group (see alloc_claim_run). The runs are measured on a snapshot of
+// the bitmap; if another thread claims the chosen run first, the group is searched again.
+static uint32_t claim_run_in_group(alloc_bitmap_t* bitmap, alloc_group_t* group, uint32_t wanted, uint32_t* run_length) {
+    uint32_t low = (group->first_cluster > bitmap->first_data) ? group->first_cluster : bitmap->first_data;
+    while (1) {
+        uint32_t best_start = 0, best_length = 0;       // Smallest run that is large enough
+        uint32_t largest_start = 0, largest_length = 0; // Fallback when no run is large enough
+        uint32_t position = low;
+        while ((position = next_free(bitmap, position, group->end_cluster)) < group->end_cluster) {
+            uint32_t length = free_run_length(bitmap, position, group->end_cluster);
+            if (length == 0) { // Taken since next_free() saw it
+                position++;
+                continue;
+            }
+            if (length >= wanted && (best_length == 0 || length < best_length)) {
+                best_start = position;
+                best_length = length;
+                if (length == wanted) break; // Can't do better than an exact fit
+            }
+            if (length > largest_length) {
+                largest_start = position;
+                largest_length = length;
+            }
+            position += length;
+        }
+
+        uint32_t start = (best_length > 0) ? best_start : largest_start;
+        uint32_t length = (best_length > 0) ? wanted : largest_length;
+        if (length == 0) {
+            return 0; // The group is full
+        }
+        uint32_t claimed = claim_from(bitmap, start, length);
+        if (claimed > 0) {
+            *run_length = claimed;
+            return start;
+        }
+    }
+}
+
+uint32_t alloc_claim_run(alloc_bitmap_t* bitmap, uint32_t wanted, uint32_t* run_length) {
+    *run_length = 0;
+    if (wanted == 0) {
+        return 0;
+    }
+
+    uint32_t home = home_group(bitmap);
+    for (uint32_t n = 0; n < bitmap->group_count; ++n) {
+        uint32_t g = home + n;
+        if (g >= bitmap->group_count) g -= bitmap->group_count;
+        uint32_t start = claim_run_in_group(bitmap, &bitmap->groups[g], wanted, run_length);
+        if (start != 0) {
+            if (n > 0) t_home_group = g; // Keep allocating where there was room
+            return start;
+        }
+    }
+    return 0; // Invalid cluster index indicates no space
+}
+
+uint32_t alloc_claim_at(alloc_bitmap_t* bitmap, uint32_t start, uint32_t count) {
+    if (start < bitmap->first_data || start >= bitmap->cluster_count) {
+        return 0;
+    }
+    if (count > bitmap->cluster_count - start) count = bitmap->cluster_count - start;
+    return claim_from(bitmap, start, count);
+}
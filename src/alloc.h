@@ -0,0 +1,109 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// --- Allocator Constants ---
+#define ALLOC_GROUP_CLUSTERS 512   // Clusters per allocation group (a multiple of 64)
+
+// --- Data Structures ---
+
+// A slice of the bitmap that threads allocate from independently.
+typedef struct {
+    uint32_t first_cluster;    // First cluster of the group
+    uint32_t end_cluster;      // One past the last cluster of the group
+    uint32_t rotor;            // Next-fit position inside the group (a hint, updated without locking)
+} alloc_group_t;
+
+// In-memory free-space bitmap kept alongside the FAT.
+// One bit per cluster, set = free, so a free cluster is found with a single
+// count-trailing-zeros on a 64-bit word instead of testing FAT entries one by one.
+// Clusters are claimed with a compare-and-swap on their word, so any number of threads
+// can allocate and free at the same time without a lock. Each thread allocates from
+// its own group and only moves to (steals from) another group when its own is full.
+typedef struct {
+    uint64_t* words;           // Bitmap, 64 clusters per word, only changed with atomic operations
+    uint32_t word_count;       // Number of words in 'words'
+    uint32_t cluster_count;    // Number of clusters covered by the bitmap
+    uint32_t first_data;       // Lowest cluster that may ever be allocated
+    alloc_group_t* groups;     // Allocation groups, in cluster order
+    uint32_t group_count;      // Number of groups
+} alloc_bitmap_t;
+
+/**
+ * @brief Allocates a bitmap with every cluster marked as used.
+ * @param bitmap The bitmap to initialize.
+ * @param cluster_count Number of clusters on the disk.
+ * @param first_data First cluster of the data area (clusters below it are never handed out).
+ * @return 0 on success, -1 on error.
+ */
+int alloc_init(alloc_bitmap_t* bitmap, uint32_t cluster_count, uint32_t first_data);
+
+/**
+ * @brief Releases the memory of a bitmap.
+ * @param bitmap The bitmap to destroy.
+ */
+void alloc_destroy(alloc_bitmap_t* bitmap);
+
+/**
+ * @brief Rebuilds the bitmap from a FAT and resets the group rotors.
+ * Not thread-safe: no other thread may use the bitmap meanwhile.
+ * @param bitmap The bitmap to rebuild.
+ * @param fat The FAT (cluster_count entries). Entries equal to 0x0000 are free.
+ */
+void alloc_rebuild(alloc_bitmap_t* bitmap, const uint16_t* fat);
+
+/**
+ * @brief Marks a cluster as allocated.
+ * @param bitmap The bitmap to update.
+ * @param cluster_index The cluster that is now in use.
+ */
+void alloc_mark_used(alloc_bitmap_t* bitmap, uint32_t cluster_index);
+
+/**
+ * @brief Marks a cluster as free. Clusters outside the data area are ignored.
+ * @param bitmap The bitmap to update.
+ * @param cluster_index The cluster that was released.
+ */
+void alloc_mark_free(alloc_bitmap_t* bitmap, uint32_t cluster_index);
+
+/**
+ * @brief Counts the free clusters (one popcount per word). Not kept as a counter,
+ * so that claiming and releasing a cluster stay a single atomic operation each.
+ * @param bitmap The bitmap to query.
+ */
+uint32_t alloc_free_clusters(const alloc_bitmap_t* bitmap);
+
+/**
+ * @brief Claims one free cluster: next-fit inside the calling thread's group,
+ * stealing from the other groups when it is full. The cluster is marked as used.
+ * @param bitmap The bitmap to allocate from.
+ * @return The claimed cluster index, or 0 if the disk is full.
+ */
+uint32_t alloc_claim(alloc_bitmap_t* bitmap);
+
+/**
+ * @brief Claims a run of contiguous free clusters for a multi-cluster allocation.
+ * Best fit inside the calling thread's group: the smallest free run that holds 'wanted'
+ * clusters is chosen, or the largest run if none is large enough, and the caller asks
+ * again for the rest. Other groups are only used when the thread's group is full.
+ * The clusters are marked as used.
+ * @param bitmap The bitmap to allocate from.
+ * @param wanted Number of clusters the caller still needs (at least 1).
+ * @param run_length Receives the number of clusters claimed from the returned start (<= wanted).
+ * @return The first cluster of the run, or 0 if the disk is full.
+ */
+uint32_t alloc_claim_run(alloc_bitmap_t* bitmap, uint32_t wanted, uint32_t* run_length);
+
+/**
+ * @brief Claims the free clusters from a given one on, stopping at the first used one.
+ * Clusters outside the data area are never claimed.
+ * @param bitmap The bitmap to allocate from.
+ * @param start The first cluster wanted.
+ * @param count Most clusters to claim.
+ * @return The number of clusters claimed from 'start', 0 if 'start' is used.
+ */
+uint32_t alloc_claim_at(alloc_bitmap_t* bitmap, uint32_t start, uint32_t count);
+
+#endif // ALLOC_H
\ No newline at end of file
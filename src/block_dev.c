@@ -0,0 +1,398 @@
+#define _GNU_SOURCE // For preadv/pwritev, fdatasync, nanosleep and fallocate
+#include "block_dev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Most blocks moved by a single vectored system call (kept well below IOV_MAX).
+#define IOV_BATCH 64
+
+// Allocates a device together with its vtable and geometry.
+static block_dev_t* new_device(const block_dev_ops_t* ops, uint32_t block_size, uint32_t block_count, void* context) {
+    block_dev_t* dev = malloc(sizeof(block_dev_t));
+    if (dev == NULL) {
+        fprintf(stderr, "Error: Could not allocate block device.\n");
+        return NULL;
+    }
+    dev->ops = ops;
+    dev->block_size = block_size;
+    dev->block_count = block_count;
+    dev->context = context;
+    return dev;
+}
+
+static uint64_t common_size(block_dev_t* dev) {
+    return (uint64_t)dev->block_size * dev->block_count;
+}
+
+// Opens (and optionally creates and sizes) an image file.
+static int open_image(const char* path, uint64_t size, bool create) {
+    int fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (create && ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// --- File Backend ---
+
+typedef struct {
+    int fd;
+} file_context_t;
+
+static int file_readv(block_dev_t* dev, uint32_t first_block, uint32_t count, void* const* buffers) {
+    int fd = ((file_context_t*)dev->context)->fd;
+    while (count > 0) {
+        uint32_t batch = (count > IOV_BATCH) ? IOV_BATCH : count;
+        struct iovec iov[IOV_BATCH];
+        for (uint32_t i = 0; i < batch; ++i) {
+            iov[i].iov_base = buffers[i];
+            iov[i].iov_len = dev->block_size;
+        }
+
+        off_t offset = (off_t)first_block * dev->block_size;
+        ssize_t bytes_read = preadv(fd, iov, (int)batch, offset);
+        if (bytes_read != (ssize_t)batch * dev->block_size) {
+            // preadv returns fewer bytes than expected at the end of the file
+            fprintf(stderr, "Error reading clusters %u-%u. Bytes read: %zd of %u (%s)\n", first_block, first_block + batch - 1,
+                    bytes_read, batch * dev->block_size, (bytes_read < 0) ? strerror(errno) : "short read");
+            return -1;
+        }
+
+        first_block += batch;
+        count -= batch;
+        buffers += batch;
+    }
+    return 0;
+}
+
+static int file_writev(block_dev_t* dev, uint32_t first_block, uint32_t count, const void* const* buffers) {
+    int fd = ((file_context_t*)dev->context)->fd;
+    while (count > 0) {
+        uint32_t batch = (count > IOV_BATCH) ? IOV_BATCH : count;
+        struct iovec iov[IOV_BATCH];
+        for (uint32_t i = 0; i < batch; ++i) {
+            iov[i].iov_base = (void*)buffers[i];
+            iov[i].iov_len = dev->block_size;
+        }
+
+        off_t offset = (off_t)first_block * dev->block_size;
+        ssize_t bytes_written = pwritev(fd, iov, (int)batch, offset);
+        if (bytes_written != (ssize_t)batch * dev->block_size) {
+            fprintf(stderr, "Error writing to clusters %u-%u. Bytes written: %zd of %u (%s)\n", first_block, first_block + batch - 1,
+                    bytes_written, batch * dev->block_size, (bytes_written < 0) ? strerror(errno) : "short write");
+            return -1;
+        }
+
+        first_block += batch;
+        count -= batch;
+        buffers += batch;
+    }
+    return 0;
+}
+
+static int file_flush(block_dev_t* dev) {
+    if (fdatasync(((file_context_t*)dev->context)->fd) != 0) {
+        fprintf(stderr, "Error flushing partition file: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Punches a run of blocks out of an image file: the host frees their space and they read
+// back as zeros. Discard is advisory, so on a host file system that can't punch holes the
+// bytes simply stay in the file.
+static int punch_hole(block_dev_t* dev, int fd, uint32_t first_block, uint32_t count) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)first_block * dev->block_size,
+                  (off_t)count * dev->block_size) != 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        fprintf(stderr, "Error discarding blocks %u-%u: %s\n", first_block, first_block + count - 1, strerror(errno));
+        return -1;
+    }
+#else
+    (void)dev; (void)fd; (void)first_block; (void)count;
+#endif
+    return 0;
+}
+
+static int file_discard(block_dev_t* dev, uint32_t first_block, uint32_t count) {
+    return punch_hole(dev, ((file_context_t*)dev->context)->fd, first_block, count);
+}
+
+static uint8_t* no_map(block_dev_t* dev) {
+    (void)dev;
+    return NULL;
+}
+
+static void file_close(block_dev_t* dev) {
+    file_context_t* context = dev->context;
+    close(context->fd);
+    free(context);
+    free(dev);
+}
+
+static const block_dev_ops_t file_ops = {
+    file_readv, file_writev, file_flush, file_discard, common_size, no_map, file_close
+};
+
+block_dev_t* bdev_open_file(const char* path, uint32_t block_size, uint32_t block_count, bool create) {
+    file_context_t* context = malloc(sizeof(file_context_t));
+    if (context == NULL) return NULL;
+
+    context->fd = open_image(path, (uint64_t)block_size * block_count, create);
+    if (context->fd < 0) {
+        free(context);
+        return NULL;
+    }
+
+    block_dev_t* dev = new_device(&file_ops, block_size, block_count, context);
+    if (dev == NULL) {
+        close(context->fd);
+        free(context);
+    }
+    return dev;
+}
+
+// --- Memory Backends (mmap and RAM) ---
+// Both keep the whole device at 'base', so reads and writes are plain memcpy.
+
+typedef struct {
+    uint8_t* base;
+    int fd;                    // Backing file for mmap, -1 for RAM
+} memory_context_t;
+
+static int memory_readv(block_dev_t* dev, uint32_t first_block, uint32_t count, void* const* buffers) {
+    const uint8_t* source = ((memory_context_t*)dev->context)->base + (size_t)first_block * dev->block_size;
+    for (uint32_t i = 0; i < count; ++i) {
+        memcpy(buffers[i], source + (size_t)i * dev->block_size, dev->block_size);
+    }
+    return 0;
+}
+
+static int memory_writev(block_dev_t* dev, uint32_t first_block, uint32_t count, const void* const* buffers) {
+    uint8_t* target = ((memory_context_t*)dev->context)->base + (size_t)first_block * dev->block_size;
+    for (uint32_t i = 0; i < count; ++i) {
+        memcpy(target + (size_t)i * dev->block_size, buffers[i], dev->block_size);
+    }
+    return 0;
+}
+
+static uint8_t* memory_map(block_dev_t* dev) {
+    return ((memory_context_t*)dev->context)->base;
+}
+
+static int mmap_flush(block_dev_t* dev) {
+    if (msync(((memory_context_t*)dev->context)->base, common_size(dev), MS_SYNC) != 0) {
+        fprintf(stderr, "Error syncing mapped partition: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void mmap_close(block_dev_t* dev) {
+    memory_context_t* context = dev->context;
+    munmap(context->base, common_size(dev));
+    close(context->fd);
+    free(context);
+    free(dev);
+}
+
+static int ram_flush(block_dev_t* dev) {
+    (void)dev;
+    return 0; // Nothing is more durable than memory here
+}
+
+static int ram_discard(block_dev_t* dev, uint32_t first_block, uint32_t count) {
+    uint8_t* base = ((memory_context_t*)dev->context)->base;
+    memset(base + (size_t)first_block * dev->block_size, 0, (size_t)count * dev->block_size);
+    return 0;
+}
+
+// The mapping is shared, so it sees the hole punched in the file.
+static int mmap_discard(block_dev_t* dev, uint32_t first_block, uint32_t count) {
+    return punch_hole(dev, ((memory_context_t*)dev->context)->fd, first_block, count);
+}
+
+static void ram_close(block_dev_t* dev) {
+    memory_context_t* context = dev->context;
+    free(context->base);
+    free(context);
+    free(dev);
+}
+
+static const block_dev_ops_t mmap_ops = {
+    memory_readv, memory_writev, mmap_flush, mmap_discard, common_size, memory_map, mmap_close
+};
+
+static const block_dev_ops_t ram_ops = {
+    memory_readv, memory_writev, ram_flush, ram_discard, common_size, memory_map, ram_close
+};
+
+block_dev_t* bdev_open_mmap(const char* path, uint32_t block_size, uint32_t block_count, bool create) {
+    uint64_t size = (uint64_t)block_size * block_count;
+    int fd = open_image(path, size, create);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < size) {
+        fprintf(stderr, "Error: '%s' is smaller than %llu bytes and can't be mapped.\n", path, (unsigned long long)size);
+        close(fd);
+        return NULL;
+    }
+
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    memory_context_t* context = malloc(sizeof(memory_context_t));
+    if (base == MAP_FAILED || context == NULL) {
+        fprintf(stderr, "Error mapping '%s': %s\n", path, strerror(errno));
+        if (base != MAP_FAILED) munmap(base, size);
+        free(context);
+        close(fd);
+        return NULL;
+    }
+    context->base = base;
+    context->fd = fd;
+
+    block_dev_t* dev = new_device(&mmap_ops, block_size, block_count, context);
+    if (dev == NULL) {
+        munmap(base, size);
+        free(context);
+        close(fd);
+    }
+    return dev;
+}
+
+block_dev_t* bdev_open_ram(uint32_t block_size, uint32_t block_count) {
+    memory_context_t* context = malloc(sizeof(memory_context_t));
+    uint8_t* base = calloc(block_count, block_size);
+    if (context == NULL || base == NULL) {
+        fprintf(stderr, "Error: Could not allocate a RAM disk of %u blocks.\n", block_count);
+        free(context);
+        free(base);
+        return NULL;
+    }
+    context->base = base;
+    context->fd = -1;
+
+    block_dev_t* dev = new_device(&ram_ops, block_size, block_count, context);
+    if (dev == NULL) {
+        free(base);
+        free(context);
+    }
+    return dev;
+}
+
+// --- Latency-Injecting Wrapper ---
+
+typedef struct {
+    block_dev_t* inner;
+    bdev_latency_t latency;
+} latency_context_t;
+
+static void delay(uint32_t microseconds) {
+    if (microseconds == 0) return;
+    struct timespec ts;
+    ts.tv_sec = microseconds / 1000000;
+    ts.tv_nsec = (long)(microseconds % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+static int latency_readv(block_dev_t* dev, uint32_t first_block, uint32_t count, void* const* buffers) {
+    latency_context_t* context = dev->context;
+    delay(context->latency.read_us);
+    return bdev_readv(context->inner, first_block, count, buffers);
+}
+
+static int latency_writev(block_dev_t* dev, uint32_t first_block, uint32_t count, const void* const* buffers) {
+    latency_context_t* context = dev->context;
+    delay(context->latency.write_us);
+    return bdev_writev(context->inner, first_block, count, buffers);
+}
+
+static int latency_flush(block_dev_t* dev) {
+    latency_context_t* context = dev->context;
+    delay(context->latency.flush_us);
+    return bdev_flush(context->inner);
+}
+
+static int latency_discard(block_dev_t* dev, uint32_t first_block, uint32_t count) {
+    return bdev_discard(((latency_context_t*)dev->context)->inner, first_block, count);
+}
+
+static void latency_close(block_dev_t* dev) {
+    latency_context_t* context = dev->context;
+    bdev_close(context->inner);
+    free(context);
+    free(dev);
+}
+
+// The wrapper never exposes the inner mapping, so every access pays the latency.
+static const block_dev_ops_t latency_ops = {
+    latency_readv, latency_writev, latency_flush, latency_discard, common_size, no_map, latency_close
+};
+
+block_dev_t* bdev_open_latency(block_dev_t* inner, bdev_latency_t latency) {
+    latency_context_t* context = malloc(sizeof(latency_context_t));
+    if (context == NULL) return NULL;
+    context->inner = inner;
+    context->latency = latency;
+
+    block_dev_t* dev = new_device(&latency_ops, inner->block_size, inner->block_count, context);
+    if (dev == NULL) {
+        free(context);
+    }
+    return dev;
+}
+
+// --- Convenience Wrappers ---
+
+int bdev_readv(block_dev_t* dev, uint32_t first_block, uint32_t count, void* const* buffers) {
+    if ((uint64_t)first_block + count > dev->block_count) {
+        fprintf(stderr, "Error: Attempt to read invalid clusters (%u-%u).\n", first_block, first_block + count - 1);
+        return -1;
+    }
+    return dev->ops->readv(dev, first_block, count, buffers);
+}
+
+int bdev_writev(block_dev_t* dev, uint32_t first_block, uint32_t count, const void* const* buffers) {
+    if ((uint64_t)first_block + count > dev->block_count) {
+        fprintf(stderr, "Error: Attempt to write to invalid clusters (%u-%u).\n", first_block, first_block + count - 1);
+        return -1;
+    }
+    return dev->ops->writev(dev, first_block, count, buffers);
+}
+
+int bdev_flush(block_dev_t* dev) {
+    return dev->ops->flush(dev);
+}
+
+int bdev_discard(block_dev_t* dev, uint32_t first_block, uint32_t count) {
+    if ((uint64_t)first_block + count > dev->block_count) {
+        return -1;
+    }
+    return dev->ops->discard(dev, first_block, count);
+}
+
+uint64_t bdev_size(block_dev_t* dev) {
+    return dev->ops->size(dev);
+}
+
+uint8_t* bdev_map(block_dev_t* dev) {
+    return dev->ops->map(dev);
+}
+
+void bdev_close(block_dev_t* dev) {
+    if (dev != NULL) {
+        dev->ops->close(dev);
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef BLOCK_DEV_H
+#define BLOCK_DEV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// --- Data Structures ---
+
+typedef struct block_dev block_dev_t;
+
+// Operations every block device backend implements.
+// Blocks are addressed by index; a "v" operation moves 'count' adjacent blocks
+// to/from 'count' separate buffers of block_size bytes each.
+typedef struct {
+    int (*readv)(block_dev_t* dev, uint32_t first_block, uint32_t count, void* const* buffers);
+    int (*writev)(block_dev_t* dev, uint32_t first_block, uint32_t count, const void* const* buffers);
+    int (*flush)(block_dev_t* dev);                                   // Make all writes durable
+    int (*discard)(block_dev_t* dev, uint32_t first_block, uint32_t count); // Contents no longer needed
+    uint64_t (*size)(block_dev_t* dev);                               // Size in bytes
+    uint8_t* (*map)(block_dev_t* dev);                                // Direct pointer to block 0, or NULL
+    void (*close)(block_dev_t* dev);                                  // Release the device and its memory
+} block_dev_ops_t;
+
+// A block device: a vtable plus the backend's own state.
+struct block_dev {
+    const block_dev_ops_t* ops;
+    uint32_t block_size;       // Bytes per block
+    uint32_t block_count;      // Number of blocks on the device
+    void* context;             // Backend-specific state
+};
+
+// Simulated latencies for bdev_open_latency(), in microseconds per call.
+typedef struct {
+    uint32_t read_us;
+    uint32_t write_us;
+    uint32_t flush_us;
+} bdev_latency_t;
+
+// --- Backends ---
+
+/**
+ * @brief Opens a host file as a block device (preadv/pwritev, fdatasync on flush, holes
+ * punched on discard). A new file is sparse: only blocks written take space on the host.
+ * @param path Path of the image file.
+ * @param block_size Bytes per block.
+ * @param block_count Number of blocks.
+ * @param create If true, the file is created (or truncated) and sized to block_size * block_count.
+ * @return The device, or NULL on error.
+ */
+block_dev_t* bdev_open_file(const char* path, uint32_t block_size, uint32_t block_count, bool create);
+
+/**
+ * @brief Opens a host file as a memory-mapped block device (msync on flush, holes
+ * punched on discard).
+ * Parameters are the same as bdev_open_file(). The whole image is mapped with MAP_SHARED.
+ * @return The device, or NULL on error.
+ */
+block_dev_t* bdev_open_mmap(const char* path, uint32_t block_size, uint32_t block_count, bool create);
+
+/**
+ * @brief Creates a zero-filled block device that lives only in memory.
+ * @param block_size Bytes per block.
+ * @param block_count Number of blocks.
+ * @return The device, or NULL on error.
+ */
+block_dev_t* bdev_open_ram(uint32_t block_size, uint32_t block_count);
+
+/**
+ * @brief Wraps a device so that every operation is delayed, to model a slow disk.
+ * The wrapper takes ownership of 'inner' and closes it when it is closed itself.
+ * @param inner The device to wrap.
+ * @param latency Delay added to each read, write and flush call.
+ * @return The wrapping device, or NULL on error (in which case 'inner' is left open).
+ */
+block_dev_t* bdev_open_latency(block_dev_t* inner, bdev_latency_t latency);
+
+// --- Convenience Wrappers ---
+
+int bdev_readv(block_dev_t* dev, uint32_t first_block, uint32_t count, void* const* buffers);
+int bdev_writev(block_dev_t* dev, uint32_t first_block, uint32_t count, const void* const* buffers);
+int bdev_flush(block_dev_t* dev);
+int bdev_discard(block_dev_t* dev, uint32_t first_block, uint32_t count);
+uint64_t bdev_size(block_dev_t* dev);
+uint8_t* bdev_map(block_dev_t* dev);
+void bdev_close(block_dev_t* dev);
+
+#endif // BLOCK_DEV_H
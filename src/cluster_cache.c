@@ -0,0 +1,103 @@
+#include "cluster_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int cache_init(cluster_cache_t* cache, size_t capacity, size_t cluster_size, uint32_t cluster_count) {
+    memset(cache, 0, sizeof(cluster_cache_t));
+    if (capacity == 0) {
+        capacity = 1; // A cache needs at least one slot to work through
+    }
+
+    cache->slots = calloc(capacity, sizeof(cache_slot_t));
+    cache->memory = malloc(capacity * cluster_size);
+    cache->slot_of = malloc(cluster_count * sizeof(int32_t));
+    if (cache->slots == NULL || cache->memory == NULL || cache->slot_of == NULL) {
+        fprintf(stderr, "Error: Could not allocate a cache of %zu clusters.\n", capacity);
+        cache_destroy(cache);
+        return -1;
+    }
+
+    cache->capacity = capacity;
+    cache->cluster_size = cluster_size;
+    cache->cluster_count = cluster_count;
+    for (size_t i = 0; i < capacity; ++i) {
+        cache->slots[i].data = cache->memory + (i * cluster_size);
+    }
+    for (uint32_t i = 0; i < cluster_count; ++i) {
+        cache->slot_of[i] = CACHE_NO_SLOT;
+    }
+    return 0;
+}
+
+void cache_destroy(cluster_cache_t* cache) {
+    free(cache->slots);
+    free(cache->memory);
+    free(cache->slot_of);
+    memset(cache, 0, sizeof(cluster_cache_t));
+}
+
+cache_slot_t* cache_lookup(cluster_cache_t* cache, uint16_t cluster_index) {
+    int32_t slot_index = cache->slot_of[cluster_index];
+    if (slot_index == CACHE_NO_SLOT) {
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    cache_slot_t* slot = &cache->slots[slot_index];
+    slot->referenced = true;
+    cache->stats.hits++;
+    return slot;
+}
+
+cache_slot_t* cache_peek(cluster_cache_t* cache, uint16_t cluster_index) {
+    int32_t slot_index = cache->slot_of[cluster_index];
+    return (slot_index == CACHE_NO_SLOT) ? NULL : &cache->slots[slot_index];
+}
+
+cache_slot_t* cache_victim(cluster_cache_t* cache) {
+    // CLOCK: sweep the slots, giving every referenced slot a second chance.
+    // Empty slots are taken immediately. The loop ends after at most two sweeps.
+    while (1) {
+        cache_slot_t* slot = &cache->slots[cache->hand];
+        cache->hand = (cache->hand + 1) % cache->capacity;
+
+        if (!slot->valid) {
+            return slot;
+        }
+        if (slot->referenced) {
+            slot->referenced = false;
+            continue;
+        }
+        return slot;
+    }
+}
+
+void cache_install(cluster_cache_t* cache, cache_slot_t* slot, uint16_t cluster_index) {
+    if (slot->valid) {
+        cache->slot_of[slot->cluster] = CACHE_NO_SLOT;
+        cache->stats.evictions++;
+    }
+
+    slot->cluster = cluster_index;
+    slot->valid = true;
+    slot->dirty = false;
+    slot->referenced = true;
+    cache->slot_of[cluster_index] = (int32_t)(slot - cache->slots);
+}
+
+void cache_invalidate_slot(cluster_cache_t* cache, cache_slot_t* slot) {
+    if (slot->valid) {
+        cache->slot_of[slot->cluster] = CACHE_NO_SLOT;
+    }
+    slot->valid = false;
+    slot->dirty = false;
+    slot->referenced = false;
+}
+
+void cache_invalidate_all(cluster_cache_t* cache) {
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        cache_invalidate_slot(cache, &cache->slots[i]);
+    }
+    cache->hand = 0;
+}
@@ -0,0 +1,106 @@
+#ifndef CLUSTER_CACHE_H
+#define CLUSTER_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// --- Cluster Cache Constants ---
+#define CACHE_DEFAULT_CLUSTERS 64 // 64 KB of cached clusters at the default cluster size
+#define CACHE_NO_SLOT (-1)
+
+// --- Data Structures ---
+
+// One cached copy of a cluster.
+typedef struct {
+    uint16_t cluster;          // Cluster index held by this slot
+    bool valid;                // True if the slot holds a cluster
+    bool dirty;                // True if the slot differs from the disk
+    bool referenced;           // CLOCK reference bit, set on every access
+    uint8_t* data;             // Cluster contents (cluster_size bytes)
+} cache_slot_t;
+
+// Counters used to size the cache for a workload.
+typedef struct {
+    uint64_t hits;             // Lookups served from memory
+    uint64_t misses;           // Lookups that had to go to the disk
+    uint64_t evictions;        // Valid slots that were recycled
+    uint64_t writebacks;       // Dirty slots written to the disk
+} cache_stats_t;
+
+// Fixed-size cluster cache with CLOCK replacement.
+// The cache only manages memory; reading and writing the disk is left to the caller.
+typedef struct {
+    cache_slot_t* slots;       // 'capacity' slots
+    uint8_t* memory;           // Backing store for all slot data
+    size_t capacity;           // Number of slots
+    size_t cluster_size;       // Bytes per cached cluster
+    uint32_t cluster_count;    // Number of clusters on the disk
+    size_t hand;               // CLOCK hand (next slot to inspect)
+    int32_t* slot_of;          // Cluster index -> slot index, or CACHE_NO_SLOT
+    cache_stats_t stats;
+} cluster_cache_t;
+
+/**
+ * @brief Allocates an empty cache.
+ * @param cache The cache to initialize.
+ * @param capacity Number of clusters the cache can hold (at least 1).
+ * @param cluster_size Size of one cluster in bytes.
+ * @param cluster_count Number of clusters on the disk being cached.
+ * @return 0 on success, -1 on error.
+ */
+int cache_init(cluster_cache_t* cache, size_t capacity, size_t cluster_size, uint32_t cluster_count);
+
+/**
+ * @brief Releases the memory of a cache. Dirty slots are discarded.
+ * @param cache The cache to destroy.
+ */
+void cache_destroy(cluster_cache_t* cache);
+
+/**
+ * @brief Looks up a cluster and updates the hit/miss counters.
+ * @param cache The cache to search.
+ * @param cluster_index The cluster to look for.
+ * @return The slot holding the cluster, or NULL on a miss.
+ */
+cache_slot_t* cache_lookup(cluster_cache_t* cache, uint16_t cluster_index);
+
+/**
+ * @brief Looks up a cluster without touching the counters or the CLOCK bits.
+ * @param cache The cache to search.
+ * @param cluster_index The cluster to look for.
+ * @return The slot holding the cluster, or NULL if it isn't cached.
+ */
+cache_slot_t* cache_peek(cluster_cache_t* cache, uint16_t cluster_index);
+
+/**
+ * @brief Picks the slot that will be reused for a new cluster (CLOCK).
+ * If the returned slot is valid and dirty, the caller must write it back
+ * before calling cache_install().
+ * @param cache The cache to pick from.
+ * @return The victim slot (never NULL).
+ */
+cache_slot_t* cache_victim(cluster_cache_t* cache);
+
+/**
+ * @brief Assigns a victim slot to a new cluster. The data is left untouched.
+ * @param cache The cache owning the slot.
+ * @param slot A slot returned by cache_victim().
+ * @param cluster_index The cluster that will be stored in the slot.
+ */
+void cache_install(cluster_cache_t* cache, cache_slot_t* slot, uint16_t cluster_index);
+
+/**
+ * @brief Drops a single slot without writing it back.
+ * @param cache The cache owning the slot.
+ * @param slot The slot to drop.
+ */
+void cache_invalidate_slot(cluster_cache_t* cache, cache_slot_t* slot);
+
+/**
+ * @brief Drops every slot without writing anything back.
+ * @param cache The cache to clear.
+ */
+void cache_invalidate_all(cluster_cache_t* cache);
+
+#endif // CLUSTER_CACHE_H
@@ -0,0 +1,134 @@
+#include "dentry_cache.h"
+#include "dir_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t key_hash(uint16_t parent_cluster, const char* name, size_t length) {
+    return dir_index_hash(name, length) ^ ((uint32_t)parent_cluster * 2654435761u);
+}
+
+static pthread_mutex_t* bucket_lock(dentry_cache_t* cache, uint32_t bucket) {
+    return &cache->locks[bucket % DCACHE_LOCK_STRIPES];
+}
+
+// Returns the slot holding (parent_cluster, name) in a bucket, or NULL. Called with the bucket locked.
+static dcache_slot_t* find_slot(dentry_cache_t* cache, uint32_t bucket, uint32_t hash, uint16_t parent_cluster, const char* name, size_t length) {
+    if (length > NAME_MAX_LENGTH) {
+        return NULL; // Never cached
+    }
+    dcache_slot_t* ways = &cache->slots[bucket * DCACHE_WAYS];
+    for (int i = 0; i < DCACHE_WAYS; ++i) {
+        if (ways[i].valid && ways[i].hash == hash && ways[i].parent_cluster == parent_cluster &&
+            memcmp(ways[i].name, name, length) == 0 && ways[i].name[length] == '\0') {
+            return &ways[i];
+        }
+    }
+    return NULL;
+}
+
+int dcache_init(dentry_cache_t* cache, uint32_t capacity) {
+    memset(cache, 0, sizeof(dentry_cache_t));
+    uint32_t bucket_count = 1;
+    while (bucket_count * DCACHE_WAYS < capacity) {
+        bucket_count *= 2;
+    }
+
+    cache->slots = calloc((size_t)bucket_count * DCACHE_WAYS, sizeof(dcache_slot_t));
+    cache->next_victim = calloc(bucket_count, sizeof(uint8_t));
+    if (cache->slots == NULL || cache->next_victim == NULL) {
+        fprintf(stderr, "Error: Could not allocate a dentry cache of %u names.\n", capacity);
+        free(cache->slots);
+        free(cache->next_victim);
+        memset(cache, 0, sizeof(dentry_cache_t));
+        return -1;
+    }
+    cache->bucket_count = bucket_count;
+    for (int i = 0; i < DCACHE_LOCK_STRIPES; ++i) {
+        pthread_mutex_init(&cache->locks[i], NULL);
+    }
+    return 0;
+}
+
+void dcache_destroy(dentry_cache_t* cache) {
+    if (cache->slots == NULL) {
+        return; // Never initialized
+    }
+    for (int i = 0; i < DCACHE_LOCK_STRIPES; ++i) {
+        pthread_mutex_destroy(&cache->locks[i]);
+    }
+    free(cache->slots);
+    free(cache->next_victim);
+    memset(cache, 0, sizeof(dentry_cache_t));
+}
+
+bool dcache_lookup(dentry_cache_t* cache, uint16_t parent_cluster, const char* name, size_t length, dcache_value_t* value) {
+    uint32_t hash = key_hash(parent_cluster, name, length);
+    uint32_t bucket = hash & (cache->bucket_count - 1);
+    pthread_mutex_lock(bucket_lock(cache, bucket));
+    dcache_slot_t* slot = find_slot(cache, bucket, hash, parent_cluster, name, length);
+    if (slot != NULL) {
+        *value = slot->value;
+    }
+    pthread_mutex_unlock(bucket_lock(cache, bucket));
+    return slot != NULL;
+}
+
+void dcache_insert(dentry_cache_t* cache, uint16_t parent_cluster, const char* name, size_t length, const dcache_value_t* value) {
+    if (length > NAME_MAX_LENGTH) {
+        return; // Couldn't be told apart from its truncated directory entry
+    }
+    uint32_t hash = key_hash(parent_cluster, name, length);
+    uint32_t bucket = hash & (cache->bucket_count - 1);
+    pthread_mutex_lock(bucket_lock(cache, bucket));
+
+    dcache_slot_t* slot = find_slot(cache, bucket, hash, parent_cluster, name, length);
+    if (slot == NULL) {
+        // Take a free way if there is one, otherwise recycle the ways in turn
+        dcache_slot_t* ways = &cache->slots[bucket * DCACHE_WAYS];
+        for (int i = 0; i < DCACHE_WAYS && slot == NULL; ++i) {
+            if (!ways[i].valid) slot = &ways[i];
+        }
+        if (slot == NULL) {
+            slot = &ways[cache->next_victim[bucket]];
+            cache->next_victim[bucket] = (uint8_t)((cache->next_victim[bucket] + 1) % DCACHE_WAYS);
+        }
+        slot->valid = true;
+        slot->parent_cluster = parent_cluster;
+        slot->hash = hash;
+        memcpy(slot->name, name, length);
+        slot->name[length] = '\0';
+    }
+    slot->value = *value;
+    pthread_mutex_unlock(bucket_lock(cache, bucket));
+}
+
+void dcache_forget(dentry_cache_t* cache, uint16_t parent_cluster, const char* name, size_t length) {
+    uint32_t hash = key_hash(parent_cluster, name, length);
+    uint32_t bucket = hash & (cache->bucket_count - 1);
+    pthread_mutex_lock(bucket_lock(cache, bucket));
+    dcache_slot_t* slot = find_slot(cache, bucket, hash, parent_cluster, name, length);
+    if (slot != NULL) {
+        slot->valid = false;
+    }
+    pthread_mutex_unlock(bucket_lock(cache, bucket));
+}
+
+void dcache_forget_dir(dentry_cache_t* cache, uint16_t parent_cluster) {
+    for (uint32_t bucket = 0; bucket < cache->bucket_count; ++bucket) {
+        pthread_mutex_lock(bucket_lock(cache, bucket));
+        dcache_slot_t* ways = &cache->slots[bucket * DCACHE_WAYS];
+        for (int i = 0; i < DCACHE_WAYS; ++i) {
+            if (ways[i].parent_cluster == parent_cluster) ways[i].valid = false;
+        }
+        pthread_mutex_unlock(bucket_lock(cache, bucket));
+    }
+}
+
+void dcache_clear(dentry_cache_t* cache) {
+    for (uint32_t bucket = 0; bucket < cache->bucket_count; ++bucket) {
+        pthread_mutex_lock(bucket_lock(cache, bucket));
+        memset(&cache->slots[bucket * DCACHE_WAYS], 0, DCACHE_WAYS * sizeof(dcache_slot_t));
+        pthread_mutex_unlock(bucket_lock(cache, bucket));
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "fat_fs.h"
+
+// --- Dentry Cache Constants ---
+#define DCACHE_DEFAULT_ENTRIES 1024 // Names remembered per volume
+#define DCACHE_WAYS 4               // Entries per bucket
+#define DCACHE_LOCK_STRIPES 64      // Buckets share this many mutexes
+
+// --- Data Structures ---
+
+// What a directory holds under a name: the entry and where it lives, or nothing at all.
+typedef struct {
+    bool found;                // False for a negative entry (the name doesn't exist)
+    uint16_t slot_cluster;     // Directory cluster holding the entry (if found)
+    uint32_t entry_index;      // Entry index within 'slot_cluster' (if found)
+    dir_entry_t entry;         // Copy of the directory entry (if found)
+} dcache_value_t;
+
+// One remembered (directory, name) pair.
+typedef struct {
+    bool valid;                // True if the slot holds a name
+    uint16_t parent_cluster;   // First cluster of the directory searched
+    uint32_t hash;             // Hash of (parent_cluster, name)
+    char name[NAME_MAX_LENGTH + 1]; // The name searched for
+    dcache_value_t value;
+} dcache_slot_t;
+
+// Fixed-size, set-associative cache of directory lookups, keyed on (directory, name).
+// A bucket holds DCACHE_WAYS names and recycles them round-robin. Thread-safe:
+// each bucket is guarded by one of DCACHE_LOCK_STRIPES mutexes. The cache never reads
+// the disk; callers fill it after a lookup and forget names whose entry they change.
+typedef struct {
+    dcache_slot_t* slots;      // bucket_count * DCACHE_WAYS slots
+    uint8_t* next_victim;      // Per bucket: the way recycled next
+    uint32_t bucket_count;     // Number of buckets (a power of two)
+    pthread_mutex_t locks[DCACHE_LOCK_STRIPES];
+} dentry_cache_t;
+
+/**
+ * @brief Allocates an empty cache.
+ * @param cache The cache to initialize.
+ * @param capacity Number of names the cache can hold (rounded up to whole buckets).
+ * @return 0 on success, -1 on error.
+ */
+int dcache_init(dentry_cache_t* cache, uint32_t capacity);
+
+/**
+ * @brief Releases the memory of a cache.
+ * @param cache The cache to destroy.
+ */
+void dcache_destroy(dentry_cache_t* cache);
+
+/**
+ * @brief Looks up a name in a directory.
+ * @param cache The cache to search.
+ * @param parent_cluster First cluster of the directory.
+ * @param name The name to look for; it doesn't have to be NUL-terminated.
+ * @param length Number of characters in 'name'.
+ * @param value Receives what the directory holds under that name on a hit.
+ * @return True on a hit (including negative entries), false if the name isn't cached.
+ */
+bool dcache_lookup(dentry_cache_t* cache, uint16_t parent_cluster, const char* name, size_t length, dcache_value_t* value);
+
+/**
+ * @brief Remembers the outcome of a lookup. Names longer than 17 characters aren't cached.
+ * @param cache The cache to update.
+ * @param parent_cluster First cluster of the directory.
+ * @param name The name that was looked up; it doesn't have to be NUL-terminated.
+ * @param length Number of characters in 'name'.
+ * @param value What the directory holds under that name.
+ */
+void dcache_insert(dentry_cache_t* cache, uint16_t parent_cluster, const char* name, size_t length, const dcache_value_t* value);
+
+/**
+ * @brief Forgets a name, positive or negative. Call it whenever the entry changes.
+ * @param cache The cache to update.
+ * @param parent_cluster First cluster of the directory.
+ * @param name The name to forget; it doesn't have to be NUL-terminated.
+ * @param length Number of characters in 'name'.
+ */
+void dcache_forget(dentry_cache_t* cache, uint16_t parent_cluster, const char* name, size_t length);
+
+/**
+ * @brief Forgets every name of a directory, for a directory that is removed.
+ * @param cache The cache to update.
+ * @param parent_cluster First cluster of the directory.
+ */
+void dcache_forget_dir(dentry_cache_t* cache, uint16_t parent_cluster);
+
+/**
+ * @brief Forgets every name.
+ * @param cache The cache to clear.
+ */
+void dcache_clear(dentry_cache_t* cache);
+
+#endif // DENTRY_CACHE_H
@@ -0,0 +1,115 @@
+#include "dir_index.h"
+#include "fat_fs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint32_t dir_index_hash(const char* name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < NAME_MAX_LENGTH && i < length; ++i) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int dir_index_init(dir_index_t* index, uint32_t expected) {
+    memset(index, 0, sizeof(dir_index_t));
+    uint32_t capacity = DIR_INDEX_MIN_CAPACITY;
+    while (capacity < expected * 2) {
+        capacity *= 2;
+    }
+    index->items = calloc(capacity, sizeof(dir_index_item_t));
+    if (index->items == NULL) {
+        fprintf(stderr, "Error: Could not allocate a directory index.\n");
+        return -1;
+    }
+    index->capacity = capacity;
+    return 0;
+}
+
+void dir_index_destroy(dir_index_t* index) {
+    free(index->items);
+    memset(index, 0, sizeof(dir_index_t));
+}
+
+// Places an item in the first empty slot of its probe sequence. The table must have room.
+static void place(dir_index_item_t* items, uint32_t capacity, dir_index_item_t item) {
+    uint32_t mask = capacity - 1;
+    uint32_t position = item.hash & mask;
+    while (items[position].cluster != 0) {
+        position = (position + 1) & mask;
+    }
+    items[position] = item;
+}
+
+static int grow(dir_index_t* index) {
+    uint32_t capacity = index->capacity * 2;
+    dir_index_item_t* items = calloc(capacity, sizeof(dir_index_item_t));
+    if (items == NULL) {
+        fprintf(stderr, "Error: Could not grow a directory index.\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < index->capacity; ++i) {
+        if (index->items[i].cluster != 0) {
+            place(items, capacity, index->items[i]);
+        }
+    }
+    free(index->items);
+    index->items = items;
+    index->capacity = capacity;
+    return 0;
+}
+
+int dir_index_insert(dir_index_t* index, uint32_t hash, uint16_t cluster, uint16_t slot) {
+    if ((index->count + 1) * 2 > index->capacity && grow(index) != 0) {
+        return -1;
+    }
+    dir_index_item_t item = { hash, cluster, slot };
+    place(index->items, index->capacity, item);
+    index->count++;
+    return 0;
+}
+
+void dir_index_remove(dir_index_t* index, uint32_t hash, uint16_t cluster, uint16_t slot) {
+    uint32_t mask = index->capacity - 1;
+    uint32_t position = hash & mask;
+    while (index->items[position].cluster != 0 &&
+           (index->items[position].cluster != cluster || index->items[position].slot != slot)) {
+        position = (position + 1) & mask;
+    }
+    if (index->items[position].cluster == 0) {
+        return; // Not indexed
+    }
+
+    // Backward-shift deletion: move later items of the run of occupied slots into the hole
+    // whenever it lies between their home position and where they are now.
+    uint32_t hole = position;
+    uint32_t next = (hole + 1) & mask;
+    while (index->items[next].cluster != 0) {
+        uint32_t home = index->items[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            index->items[hole] = index->items[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    index->items[hole].cluster = 0;
+    index->count--;
+}
+
+const dir_index_item_t* dir_index_next(const dir_index_t* index, uint32_t hash, uint32_t* cursor) {
+    uint32_t mask = index->capacity - 1;
+    while (*cursor < index->capacity) {
+        const dir_index_item_t* item = &index->items[(hash + *cursor) & mask];
+        (*cursor)++;
+        if (item->cluster == 0) {
+            *cursor = index->capacity; // End of the probe sequence
+            return NULL;
+        }
+        if (item->hash == hash) {
+            return item;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,84 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// --- Directory Index Constants ---
+#define DIR_INDEX_MIN_CAPACITY 64  // Smallest table (a power of two)
+
+// --- Data Structures ---
+
+// Where one name of a directory lives: the cluster of the directory's chain and the
+// entry inside it. Only the hash of the name is kept, so every hit is confirmed
+// against the entry itself.
+typedef struct {
+    uint32_t hash;             // dir_index_hash() of the name
+    uint16_t cluster;          // Directory cluster holding the entry; 0 marks an empty slot
+    uint16_t slot;             // Entry index within 'cluster'
+} dir_index_item_t;
+
+// In-memory hash index of one directory, rebuilt from the directory when needed and
+// never written to the disk. Open addressing with linear probing; removals shift the
+// following items back instead of leaving tombstones, so lookups never slow down.
+// Not thread-safe: the caller serializes changes with lookups.
+typedef struct {
+    dir_index_item_t* items;   // 'capacity' slots
+    uint32_t capacity;         // Number of slots (a power of two)
+    uint32_t count;            // Slots in use, kept at most half of 'capacity'
+} dir_index_t;
+
+/**
+ * @brief Hashes a file name (FNV-1a, at most 17 characters like the directory entries).
+ * @param name The name to hash; it doesn't have to be NUL-terminated.
+ * @param length Number of characters in 'name'.
+ * @return The hash.
+ */
+uint32_t dir_index_hash(const char* name, size_t length);
+
+/**
+ * @brief Allocates an empty index.
+ * @param index The index to initialize.
+ * @param expected Number of names the index should hold without growing.
+ * @return 0 on success, -1 on error.
+ */
+int dir_index_init(dir_index_t* index, uint32_t expected);
+
+/**
+ * @brief Releases the memory of an index.
+ * @param index The index to destroy.
+ */
+void dir_index_destroy(dir_index_t* index);
+
+/**
+ * @brief Records that the entry at 'cluster'/'slot' holds a name with the given hash.
+ * The table doubles when it becomes half full.
+ * @param index The index to update.
+ * @param hash dir_index_hash() of the name.
+ * @param cluster Directory cluster holding the entry (not 0).
+ * @param slot Entry index within 'cluster'.
+ * @return 0 on success, -1 if the table couldn't grow (the index is left unchanged).
+ */
+int dir_index_insert(dir_index_t* index, uint32_t hash, uint16_t cluster, uint16_t slot);
+
+/**
+ * @brief Forgets the entry at 'cluster'/'slot'. Does nothing if it isn't indexed.
+ * @param index The index to update.
+ * @param hash dir_index_hash() of the entry's name.
+ * @param cluster Directory cluster holding the entry.
+ * @param slot Entry index within 'cluster'.
+ */
+void dir_index_remove(dir_index_t* index, uint32_t hash, uint16_t cluster, uint16_t slot);
+
+/**
+ * @brief Returns the next candidate entry for a hash. Start with '*cursor' set to 0 and
+ * call again until NULL is returned; each candidate still has to be compared by name.
+ * @param index The index to search.
+ * @param hash dir_index_hash() of the name searched for.
+ * @param cursor Probe position, advanced by each call.
+ * @return The next item with that hash, or NULL when there are no more.
+ */
+const dir_index_item_t* dir_index_next(const dir_index_t* index, uint32_t hash, uint32_t* cursor);
+
+#endif // DIR_INDEX_H
@@ -0,0 +1,187 @@
+#include "dir_scan.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIR_SCAN_X86
+#include <immintrin.h>
+#endif
+
+// An implementation scans the entries for 'target', the name padded with zeros to
+// DIR_ENTRY_SIZE bytes. 'length' is between 1 and NAME_MAX_LENGTH.
+typedef int (*scan_fn_t)(const dir_entry_t* entries, int count, const uint8_t* target, size_t length, int* first_free);
+
+// Finds the first free entry when there is no name to look for.
+typedef int (*find_free_fn_t)(const dir_entry_t* entries, int count);
+
+typedef struct {
+    scan_fn_t scan;
+    find_free_fn_t find_free;
+    const char* name;
+} scan_impl_t;
+
+static int find_free_scalar(const dir_entry_t* entries, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (entries[i].filename[0] == 0x00) return i;
+    }
+    return -1;
+}
+
+static int scan_scalar(const dir_entry_t* entries, int count, const uint8_t* target, size_t length, int* first_free) {
+    (void)length;
+    int free_index = -1;
+    for (int i = 0; i < count; ++i) {
+        const uint8_t* filename = entries[i].filename;
+        if (filename[0] == 0x00) {
+            if (free_index < 0) free_index = i;
+            continue;
+        }
+        // 'target' is NUL-terminated by its padding
+        if (strcmp((const char*)filename, (const char*)target) == 0) {
+            *first_free = free_index;
+            return i;
+        }
+    }
+    *first_free = free_index;
+    return -1;
+}
+
+#ifdef DIR_SCAN_X86
+// SSE2 is part of x86-64, so this needs no runtime check there. A vector holds the first
+// 16 bytes of a name; the last two bytes are only compared for names of 16 or 17 characters.
+__attribute__((target("sse2")))
+static int scan_sse2(const dir_entry_t* entries, int count, const uint8_t* target, size_t length, int* first_free) {
+    const __m128i wanted = _mm_loadu_si128((const __m128i*)target);
+    uint32_t need = (length >= 16) ? 0xFFFFu : ((1u << (length + 1)) - 1); // Bytes that must match
+    int free_index = -1;
+    for (int i = 0; i < count; ++i) {
+        const uint8_t* filename = entries[i].filename;
+        uint32_t equal = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)filename), wanted));
+        if (filename[0] == 0x00) {
+            if (free_index < 0) free_index = i;
+            continue;
+        }
+        if ((equal & need) == need &&
+            (length < 16 || (filename[16] == target[16] && (length < 17 || filename[17] == target[17])))) {
+            *first_free = free_index;
+            return i;
+        }
+    }
+    *first_free = free_index;
+    return -1;
+}
+
+// An entry is exactly one 32-byte vector, so a single compare covers the whole name.
+__attribute__((target("avx2")))
+static int scan_avx2(const dir_entry_t* entries, int count, const uint8_t* target, size_t length, int* first_free) {
+    const __m256i wanted = _mm256_loadu_si256((const __m256i*)target);
+    uint32_t need = (1u << (length + 1)) - 1; // Bytes that must match (length <= 17)
+    int free_index = -1;
+    for (int i = 0; i < count; ++i) {
+        uint32_t equal = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&entries[i]), wanted));
+        if (entries[i].filename[0] == 0x00) {
+            if (free_index < 0) free_index = i;
+            continue;
+        }
+        if ((equal & need) == need) {
+            *first_free = free_index;
+            return i;
+        }
+    }
+    *first_free = free_index;
+    return -1;
+}
+
+// Gathers fetch the first byte of 8 entries at a time (as the low byte of a 32-bit word),
+// so the free entries of each run of 32 come out as one bit mask without a branch per entry.
+__attribute__((target("avx2")))
+static int find_free_avx2(const dir_entry_t* entries, int count) {
+    const __m256i offsets = _mm256_setr_epi32(0, 32, 64, 96, 128, 160, 192, 224);
+    const __m256i first_byte = _mm256_set1_epi32(0xFF);
+    const uint8_t* base = (const uint8_t*)entries;
+    for (int start = 0; start < count; start += 32) {
+        int groups = (count - start < 32) ? (count - start) / 8 : 4;
+        uint32_t free_mask = 0;
+        for (int group = 0; group < groups; ++group) {
+            __m256i heads = _mm256_i32gather_epi32((const int*)(base + (start + group * 8) * DIR_ENTRY_SIZE), offsets, 1);
+            __m256i is_free = _mm256_cmpeq_epi32(_mm256_and_si256(heads, first_byte), _mm256_setzero_si256());
+            free_mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(is_free)) << (group * 8);
+        }
+        if (free_mask != 0) return start + __builtin_ctz(free_mask);
+    }
+    return -1;
+}
+#endif
+
+static const scan_impl_t g_scalar = { scan_scalar, find_free_scalar, "scalar" };
+#ifdef DIR_SCAN_X86
+static const scan_impl_t g_sse2 = { scan_sse2, find_free_scalar, "sse2" };
+static const scan_impl_t g_avx2 = { scan_avx2, find_free_avx2, "avx2" };
+#endif
+
+// Chosen on first use; every thread would pick the same one, so a race is harmless.
+static const scan_impl_t* g_impl = NULL;
+
+static const scan_impl_t* find_impl(dir_scan_impl_t impl) {
+    switch (impl) {
+    case DIR_SCAN_SCALAR:
+        return &g_scalar;
+#ifdef DIR_SCAN_X86
+    case DIR_SCAN_SSE2:
+        return __builtin_cpu_supports("sse2") ? &g_sse2 : NULL;
+    case DIR_SCAN_AVX2:
+        return __builtin_cpu_supports("avx2") ? &g_avx2 : NULL;
+    case DIR_SCAN_AUTO:
+        if (__builtin_cpu_supports("avx2")) return &g_avx2;
+        if (__builtin_cpu_supports("sse2")) return &g_sse2;
+        return &g_scalar;
+#else
+    case DIR_SCAN_AUTO:
+        return &g_scalar;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static const scan_impl_t* current_impl(void) {
+    const scan_impl_t* impl = __atomic_load_n(&g_impl, __ATOMIC_ACQUIRE);
+    if (impl == NULL) {
+        impl = find_impl(DIR_SCAN_AUTO);
+        __atomic_store_n(&g_impl, impl, __ATOMIC_RELEASE);
+    }
+    return impl;
+}
+
+int dir_scan(const union data_cluster* cluster, uint32_t entry_count, const char* name, size_t length, int* first_free) {
+    const scan_impl_t* impl = current_impl();
+    if (length == 0 || length > NAME_MAX_LENGTH) {
+        // Nothing can match (a longer name can't be stored in an entry), so only a free
+        // entry is wanted: the first byte of each entry says it all, no compare needed.
+        if (first_free != NULL) {
+            *first_free = impl->find_free(cluster->dir, (int)entry_count);
+        }
+        return -1;
+    }
+
+    uint8_t target[DIR_ENTRY_SIZE] = {0};
+    memcpy(target, name, length);
+    int free_index;
+    int index = impl->scan(cluster->dir, (int)entry_count, target, length, &free_index);
+    if (first_free != NULL) {
+        *first_free = free_index;
+    }
+    return index;
+}
+
+int dir_scan_select(dir_scan_impl_t impl) {
+    const scan_impl_t* selected = find_impl(impl);
+    if (selected == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&g_impl, selected, __ATOMIC_RELEASE);
+    return 0;
+}
+
+const char* dir_scan_impl_name(void) {
+    return current_impl()->name;
+}
@@ -0,0 +1,46 @@
+#ifndef DIR_SCAN_H
+#define DIR_SCAN_H
+
+#include <stddef.h>
+#include "fat_fs.h"
+
+// --- Data Structures ---
+
+// Ways of scanning a directory cluster. All of them return the same results.
+typedef enum {
+    DIR_SCAN_AUTO,           // The fastest one the CPU supports (default)
+    DIR_SCAN_SCALAR,         // One byte comparison loop per entry
+    DIR_SCAN_SSE2,           // 16-byte compare per entry, plus the last two name bytes when needed
+    DIR_SCAN_AVX2            // One 32-byte compare per entry: the whole entry at once
+} dir_scan_impl_t;
+
+/**
+ * @brief Scans the entries of a directory cluster in one pass, looking for a name
+ * and for the first free entry at the same time.
+ * The name is padded with zeros to the width of an entry and compared with each entry
+ * with vector instructions when the CPU has them; an entry matches when its first
+ * 'length' characters equal 'name' and the next one ends the name.
+ * @param cluster The directory cluster.
+ * @param entry_count Number of entries in the cluster (its size / DIR_ENTRY_SIZE), a multiple of 8.
+ * @param name The name to look for; it doesn't have to be NUL-terminated. Names that are
+ * empty or longer than 17 characters never match.
+ * @param length Number of characters in 'name'.
+ * @param first_free If not NULL, receives the index of the first free entry before the match
+ * (or in the whole cluster when there is no match), or -1 if there is none.
+ * @return The index of the matching entry, or -1 if the name isn't in the cluster.
+ */
+int dir_scan(const union data_cluster* cluster, uint32_t entry_count, const char* name, size_t length, int* first_free);
+
+/**
+ * @brief Selects the implementation used by dir_scan(), for benchmarks and testing.
+ * @param impl The implementation to use.
+ * @return 0 on success, -1 if the CPU doesn't support it (the selection is unchanged).
+ */
+int dir_scan_select(dir_scan_impl_t impl);
+
+/**
+ * @brief Name of the implementation dir_scan() currently uses ("scalar", "sse2" or "avx2").
+ */
+const char* dir_scan_impl_name(void);
+
+#endif // DIR_SCAN_H
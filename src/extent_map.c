@@ -0,0 +1,83 @@
+#include "extent_map.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int extent_map_init(extent_map_t* map) {
+    memset(map, 0, sizeof(extent_map_t));
+    map->extents = malloc(EXTENT_MAP_MIN_CAPACITY * sizeof(extent_t));
+    if (map->extents == NULL) {
+        fprintf(stderr, "Error: Could not allocate an extent map.\n");
+        return -1;
+    }
+    map->capacity = EXTENT_MAP_MIN_CAPACITY;
+    return 0;
+}
+
+void extent_map_destroy(extent_map_t* map) {
+    free(map->extents);
+    memset(map, 0, sizeof(extent_map_t));
+}
+
+int extent_map_append(extent_map_t* map, uint16_t cluster) {
+    if (map->count > 0) {
+        extent_t* last = &map->extents[map->count - 1];
+        if ((uint32_t)last->start + last->length == cluster && last->length < UINT16_MAX) {
+            last->length++;
+            map->cluster_count++;
+            return 0;
+        }
+    }
+
+    if (map->count == map->capacity) {
+        uint32_t capacity = map->capacity * 2;
+        extent_t* extents = realloc(map->extents, capacity * sizeof(extent_t));
+        if (extents == NULL) {
+            fprintf(stderr, "Error: Could not grow an extent map.\n");
+            return -1;
+        }
+        map->extents = extents;
+        map->capacity = capacity;
+    }
+    extent_t extent = { map->cluster_count, cluster, 1 };
+    map->extents[map->count++] = extent;
+    map->cluster_count++;
+    return 0;
+}
+
+void extent_map_truncate(extent_map_t* map, uint32_t cluster_count) {
+    while (map->count > 0 && map->cluster_count > cluster_count) {
+        extent_t* last = &map->extents[map->count - 1];
+        uint32_t excess = map->cluster_count - cluster_count;
+        if (excess >= last->length) {
+            map->cluster_count -= last->length;
+            map->count--;
+        } else {
+            last->length = (uint16_t)(last->length - excess);
+            map->cluster_count = cluster_count;
+        }
+    }
+}
+
+bool extent_map_find(const extent_map_t* map, uint32_t number, uint16_t* cluster, uint32_t* run_left) {
+    if (number >= map->cluster_count) {
+        return false;
+    }
+
+    // The last run starting at or before 'number'
+    uint32_t low = 0;
+    uint32_t high = map->count - 1;
+    while (low < high) {
+        uint32_t middle = low + (high - low + 1) / 2;
+        if (map->extents[middle].file_cluster <= number) low = middle;
+        else high = middle - 1;
+    }
+
+    const extent_t* extent = &map->extents[low];
+    uint32_t offset = number - extent->file_cluster;
+    *cluster = (uint16_t)(extent->start + offset);
+    if (run_left != NULL) {
+        *run_left = extent->length - offset;
+    }
+    return true;
+}
@@ -0,0 +1,71 @@
+#ifndef EXTENT_MAP_H
+#define EXTENT_MAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// --- Extent Map Constants ---
+#define EXTENT_MAP_MIN_CAPACITY 8  // Extents allocated up front
+
+// --- Data Structures ---
+
+// A run of clusters that are adjacent both in the file and on the disk.
+typedef struct {
+    uint32_t file_cluster;     // Number within the file of the run's first cluster (0 = the first)
+    uint16_t start;            // First cluster of the run on the disk
+    uint16_t length;           // Clusters in the run
+} extent_t;
+
+// The cluster chain of one file as a sorted list of runs, so that finding the cluster
+// holding a given offset is a binary search instead of a walk along the FAT. Built by
+// appending the clusters of the chain in order; appends to the file extend it and
+// truncation cuts it, without rebuilding. Not thread-safe: the caller serializes changes
+// with lookups.
+typedef struct {
+    extent_t* extents;         // 'count' runs, in file order
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t cluster_count;    // Clusters covered by all the runs
+} extent_map_t;
+
+/**
+ * @brief Allocates an empty map.
+ * @param map The map to initialize.
+ * @return 0 on success, -1 on error.
+ */
+int extent_map_init(extent_map_t* map);
+
+/**
+ * @brief Releases the memory of a map.
+ * @param map The map to destroy.
+ */
+void extent_map_destroy(extent_map_t* map);
+
+/**
+ * @brief Adds the next cluster of the file. It extends the last run when it follows it on
+ * the disk, and starts a new run otherwise.
+ * @param map The map to update.
+ * @param cluster The cluster that now follows the last one mapped.
+ * @return 0 on success, -1 if the list couldn't grow (the map is left unchanged).
+ */
+int extent_map_append(extent_map_t* map, uint16_t cluster);
+
+/**
+ * @brief Keeps only the first 'cluster_count' clusters of the file.
+ * @param map The map to update.
+ * @param cluster_count Number of clusters the file keeps (0 empties the map).
+ */
+void extent_map_truncate(extent_map_t* map, uint32_t cluster_count);
+
+/**
+ * @brief Finds cluster 'number' of the file.
+ * @param map The map to search.
+ * @param number Number of the cluster within the file (0 = the first).
+ * @param cluster Receives the cluster on the disk.
+ * @param run_left If not NULL, receives how many clusters from 'cluster' on are adjacent
+ * on the disk (at least 1).
+ * @return True if the file has that many clusters, false otherwise.
+ */
+bool extent_map_find(const extent_map_t* map, uint32_t number, uint16_t* cluster, uint32_t* run_left);
+
+#endif // EXTENT_MAP_H
@@ -1,665 +1,3490 @@
+#define _DEFAULT_SOURCE // For pthread rwlocks
 #include "fat_fs.h"
+#include "alloc.h"
+#include "dir_index.h"
+#include "dentry_cache.h"
+#include "dir_scan.h"
+#include "extent_map.h"
+#include "journal.h"
+#include <pthread.h>
 #include <string.h> // For strerror
 #include <errno.h>  // For errno
 
-// --- Global Variables ---
-// Definition of the in-memory FAT.
-uint16_t g_fat_table[CLUSTER_COUNT];
+// Most clusters gathered into a single device write.
+#define IO_BATCH_CLUSTERS 64
+
+// Most bytes fs_read fetches with one read_clusters() call; a whole number of clusters of
+// any size.
+#define READ_BATCH_BYTES FS_MAX_CLUSTER_SIZE
+
+// Bytes fs_write_stream() pulls from its source before allocating and writing them.
+#define STREAM_BATCH_BYTES FS_MAX_CLUSTER_SIZE
+
+// Files that can have open handles at the same time, per volume.
+#define MAX_OPEN_FILES 64
+
+// How long the background checkpoint sleeps between looks at the journal. Commits wake
+// it earlier once half of the log is in use.
+#define CHECKPOINT_INTERVAL_MS 1000
+
+// Block size of the host file system: it only gives space back for whole blocks, so
+// discards are widened to block boundaries where the neighbours are free.
+#define DISCARD_ALIGN_BYTES 4096
+
+// Size of the journal fs_format() sets aside, unless that is too little to log the whole
+// FAT or more than an eighth of the partition.
+#define JOURNAL_BYTES (128 * 1024)
+#define JOURNAL_MIN_CLUSTERS 16
+
+// Start of a superblock that records the geometry
+#define SUPERBLOCK_MAGIC "FAT16GEO"
+
+// The first bytes of cluster 0, read before the cluster size is known; the rest of it is
+// filled with 0xBB. Images formatted before the superblock existed are all 0xBB there, and
+// are used with the default geometry and without a journal.
+typedef struct {
+    char magic[8];             // SUPERBLOCK_MAGIC
+    uint16_t journal_start;    // First cluster of the journal (its header)
+    uint16_t journal_clusters; // Clusters in the journal, header included
+    uint32_t cluster_size;
+    uint32_t cluster_count;
+    uint16_t fat_clusters;
+    uint16_t root_dir_cluster;
+} boot_block_t;
+
+// A file with open handles. Every handle on the file points at the same one, which
+// stays in the volume's table until the last of them is closed.
+typedef struct {
+    uint32_t refs;             // Open handles on the file; 0 = the table slot is unused
+    bool unlinked;             // Removed from its directory: the last close frees the clusters
+    bool lost;                 // The image was formatted or reloaded under the handles
+    char name[NAME_MAX_LENGTH + 1]; // Name in the directory, for the dentry cache
+    uint16_t parent_cluster;   // First cluster of the directory; its lock covers the fields below
+    uint16_t slot_cluster;     // Where the directory entry lives
+    uint32_t entry_index;
+    uint16_t first_cluster;    // Copies of the entry's first_block and size
+    uint32_t size;
+    // Runs of the cluster chain, built by the first seek and published with a
+    // compare-and-swap, as readers share the directory lock; after that only changed with
+    // the directory locked exclusively. NULL until then.
+    extent_map_t* extents;
+} open_file_t;
+
+// 64-bit words in a bitmap of all clusters of the largest image, and most FAT clusters
+// an image can have
+#define MAX_CLUSTER_WORDS ((FS_MAX_CLUSTER_COUNT + 63) / 64)
+#define MAX_FAT_CLUSTERS ((FS_MAX_CLUSTER_COUNT * sizeof(uint16_t) + FS_MIN_CLUSTER_SIZE - 1) / FS_MIN_CLUSTER_SIZE)
+
+// The metadata changes of one operation, collected by the thread running it until they are
+// committed to the journal. Directory clusters are staged here instead of in the cache, so
+// that nothing reaches its home location before the record describing it is durable; the
+// thread's own reads see the staged copies. FAT entries are changed in vol->fat as usual and
+// only remembered here. The bitmaps are sized for the largest image; only the volume's
+// cluster_words words of them are used.
+typedef struct transaction {
+    uint64_t fat_touched[MAX_CLUSTER_WORDS];  // FAT entries the operation changed
+    uint64_t staged[MAX_CLUSTER_WORDS];       // Directory clusters with an image below
+    uint64_t revoked[MAX_CLUSTER_WORDS];      // Directory clusters freed by the operation
+    uint32_t revoke_count;                    // Bits set in 'revoked'
+    uint64_t fat_clusters[(MAX_FAT_CLUSTERS + 63) / 64]; // FAT clusters holding the entries in 'fat_touched'
+    uint32_t fat_cluster_count;               // Bits set in 'fat_clusters'
+    uint16_t* image_clusters;                 // Home cluster of each staged image
+    uint8_t* images;                          // 'image_count' clusters
+    uint32_t image_count;
+    uint32_t image_capacity;
+    uint32_t operations;                      // Operations that changed something
+    fat_volume_t* vol;                        // The volume the operation works on
+    bool batch;                               // Spans the operations of an fs_batch_begin() batch
+    bool dirty;                               // The current operation changed something
+    struct transaction* next;                 // In the commit queue
+    bool done;                                // Committed by the group leader
+    int status;                               // Of the commit (0 or -1), once 'done'
+} transaction_t;
+
+// The operation the calling thread is running, or NULL (also for images without a journal).
+static __thread transaction_t* t_current = NULL;
+static __thread transaction_t t_transaction;
+// The volume on which the calling thread has a batch open (and holds state_lock exclusively).
+static __thread fat_volume_t* t_batch = NULL;
+
+// --- Volume ---
+// Everything that used to be process-wide lives here, so one process can work
+// on several images at the same time.
+struct fat_volume {
+    char* path;                          // Image file path, or NULL for an attached device
+
+    // The block device holding the partition. Devices opened from 'path' are owned
+    // (and closed) by the volume; attached devices belong to the caller.
+    block_dev_t* dev;
+    bool dev_owned;
+    fs_backend_t backend;                // Backend used when 'path' is opened
+    fs_durability_t durability;          // When the journal and checkpoints flush the device
+    uint8_t* map;                        // Set when the device can be accessed in place (mmap or RAM);
+                                         // the cluster cache is bypassed then
+
+    // Geometry of the image (see fs_geometry_t), from fs_format() or the superblock. The
+    // arrays sized by it are replaced by set_geometry() with state_lock held exclusively.
+    uint32_t cluster_size;
+    uint32_t cluster_count;
+    uint32_t fat_clusters;
+    uint16_t root_dir;
+    uint16_t data_start;
+    uint32_t journal_start;
+    uint32_t journal_clusters;
+    uint32_t dir_entries;                // Directory entries per cluster
+    uint32_t fat_entries;                // FAT entries per cluster
+    uint32_t cluster_words;              // 64-bit words in a bitmap of all clusters
+    uint32_t discard_align;              // Clusters per host file system block
+
+    uint16_t* fat;                       // The in-memory copy of the File Allocation Table (fat_clusters clusters)
+    bool* fat_dirty;                     // One dirty flag per FAT cluster. Set by fat_set(), cleared by flush_fat()
+    alloc_bitmap_t alloc;                // Free-cluster bitmap (lock-free), kept in sync with 'fat' by fat_set()
+
+    cluster_cache_t cache;               // Write-back cache sitting under read_cluster/write_cluster
+    size_t cache_capacity;
+
+    // Name index of each directory that spans several clusters, by the directory's first
+    // cluster. Built by the first lookup and published with a compare-and-swap; after that
+    // it only changes with the directory locked exclusively.
+    dir_index_t** dir_index;
+    bool dir_index_enabled;
+
+    // Recent lookups by (directory, name), including names that don't exist. Filled while
+    // the directory is locked, and forgotten by whoever changes the entry, who holds the
+    // directory exclusively; so a lookup can't put back an entry that was just changed.
+    dentry_cache_t dcache;
+    bool dcache_enabled;
+
+    // Files opened with fs_open(), and the file each handle refers to (NULL when closed).
+    // The table, the reference counts and 'unlinked' are guarded by files_lock; the rest
+    // of a file is covered by its directory's lock, like the entry it mirrors.
+    // 'open_file_count' lets writers skip the table when no file is open.
+    open_file_t files[MAX_OPEN_FILES];
+    open_file_t* handles[FS_MAX_HANDLES];
+    uint32_t open_file_count;
+
+    // Metadata journal (see the Journal section), present when the boot block describes one.
+    // A single thread at a time owns it ('journal_busy'): the leader of a group commit or
+    // the checkpoint. Transactions wait in the commit queue, guarded by journal_lock.
+    bool journaled;
+    journal_t journal;
+    journal_stats_t journal_stats;       // Updated atomically
+    uint16_t* disk_fat;                  // The FAT as of the last commit, logged and written home from here
+    bool* commit_fat_changed;            // Scratch of the journal owner: FAT clusters a batch changed
+    uint64_t* commit_clusters;           // Scratch of the journal owner: clusters a batch revoked, then freed
+    transaction_t* commit_queue;         // Oldest first
+    transaction_t** commit_queue_end;
+    bool journal_busy;
+    bool journal_failed;                 // A commit failed: changes are refused until the image is read again
+    pthread_t checkpointer;              // Background checkpoint thread
+    bool checkpointer_running;
+    bool checkpointer_stop;
+    transaction_t* batch;                // The open batch's transaction, used only by its thread
+
+    // Locks, always taken in this order: state_lock, directory locks from the root down,
+    // files_lock, journal_lock (and the ownership of the journal), fat_lock, cache_lock. Clusters are claimed in 'alloc' without a lock; fat_lock is
+    // only held to record the claimed clusters in the FAT. A directory lock also covers the contents of the files in it,
+    // so lookups and reads share it and run in parallel, while a writer only excludes
+    // the directory it changes.
+    pthread_rwlock_t state_lock;                  // Exclusive while the device, FAT or cache are replaced
+    pthread_rwlock_t* dir_locks;                  // Indexed by the first cluster of a directory
+    pthread_mutex_t files_lock;                   // Guards the open-file table
+    pthread_mutex_t journal_lock;                 // Guards the commit queue and 'journal_busy'
+    pthread_cond_t journal_cond;                  // Signaled when a group commit or checkpoint ends
+    pthread_cond_t checkpoint_cond;               // Wakes the background checkpoint
+    pthread_mutex_t fat_lock;                     // Guards 'fat' and 'fat_dirty'
+    pthread_mutex_t cache_lock;                   // Guards 'cache' and its write-backs
+};
+
+// --- Volume State ---
+// A thread with a batch open holds state_lock exclusively from fs_batch_begin() until
+// fs_batch_commit(), so the operations it runs in between don't take it again.
+
+static void lock_state(fat_volume_t* vol, bool exclusive) {
+    if (t_batch == vol) return;
+    if (exclusive) pthread_rwlock_wrlock(&vol->state_lock);
+    else pthread_rwlock_rdlock(&vol->state_lock);
+}
 
-// Static global pointer to the partition file.
-// 'static' makes it visible only within this file (fat_fs.c).
-static FILE* g_partition_file = NULL;
+static void unlock_state(fat_volume_t* vol) {
+    if (t_batch == vol) return;
+    pthread_rwlock_unlock(&vol->state_lock);
+}
 
-int init_fs() {
-    // Opens the file in "r+b" mode (read and write in binary mode; file must exist).
-    // The 'init' command will use a different mode to create the file if needed.
-    g_partition_file = fopen(PARTITION_NAME, "r+b");
+// Operations that replace the device, the FAT or the cache can't run in the middle of a batch.
+static bool refuse_in_batch(fat_volume_t* vol, const char* operation) {
+    if (t_batch != vol) return false;
+    fprintf(stderr, "%s: not possible while a batch is open; commit it first\n", operation);
+    return true;
+}
 
-    if (g_partition_file == NULL) {
-        // If it doesn't exist, it's not a fatal error yet,
-        // because the 'init' command will create it.
-        // Print a warning that may help during debugging.
-        printf("Warning: Could not open '%s'. The file will be created with the 'init' command.\n", PARTITION_NAME);
-        return 0; // Return success for now
+// --- Block Device ---
+
+// Opens the volume's image file with the selected backend.
+static block_dev_t* open_partition(fat_volume_t* vol, bool create) {
+    if (vol->path == NULL) {
+        return NULL; // Attached devices can't be reopened
     }
-    return 0;
+    if (vol->backend == FS_BACKEND_MMAP) {
+        return bdev_open_mmap(vol->path, vol->cluster_size, vol->cluster_count, create);
+    }
+    return bdev_open_file(vol->path, vol->cluster_size, vol->cluster_count, create);
 }
 
-void close_fs() {
-    if (g_partition_file != NULL) {
-        fclose(g_partition_file);
-        g_partition_file = NULL;
+static void drop_dir_indexes(fat_volume_t* vol);
+static int ensure_cache(fat_volume_t* vol);
+static void lose_open_files(fat_volume_t* vol);
+static const void* staged_image(fat_volume_t* vol, uint16_t cluster_index);
+static transaction_t* current_transaction(fat_volume_t* vol);
+
+// Makes 'dev' the current device. Clusters cached, directories indexed and names
+// remembered for the previous device are dropped.
+static void use_device(fat_volume_t* vol, block_dev_t* dev, bool owned) {
+    vol->dev = dev;
+    vol->dev_owned = owned;
+    vol->map = (dev != NULL) ? bdev_map(dev) : NULL;
+    vol->journaled = false; // Until the image's boot block is read
+    if (vol->cache.slots != NULL) {
+        cache_invalidate_all(&vol->cache);
     }
+    drop_dir_indexes(vol);
+    dcache_clear(&vol->dcache);
 }
 
-int read_cluster(uint16_t cluster_index, void* buffer) {
-    if (g_partition_file == NULL) {
-        fprintf(stderr, "Error: File system not initialized. Cannot read.\n");
-        return -1;
+// Detaches the current device, closing it if it is ours. Nothing is flushed.
+static void release_device(fat_volume_t* vol) {
+    if (vol->dev != NULL && vol->dev_owned) {
+        bdev_close(vol->dev);
     }
+    use_device(vol, NULL, false);
+}
 
-    if (cluster_index >= CLUSTER_COUNT) {
-        fprintf(stderr, "Error: Attempt to read invalid cluster (%u).\n", cluster_index);
-        return -1;
+// Allocates a buffer of 'count' clusters of the volume's size, freed with free(), or reports
+// the failure and returns NULL. Cluster buffers never go on the stack, as a cluster can be
+// FS_MAX_CLUSTER_SIZE bytes; union data_cluster is only a view of their bytes.
+static union data_cluster* alloc_clusters(const fat_volume_t* vol, uint32_t count) {
+    union data_cluster* buffer = malloc((size_t)count * vol->cluster_size);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Could not allocate a buffer of %u clusters.\n", count);
     }
+    return buffer;
+}
 
-    long offset = (long)cluster_index * CLUSTER_SIZE;
-
-    if (fseek(g_partition_file, offset, SEEK_SET) != 0) {
-        fprintf(stderr, "Error seeking cluster %u: %s\n", cluster_index, strerror(errno));
-        return -1;
+// Returns the cluster's bytes without copying when the device is mapped;
+// otherwise reads 'count' clusters into 'scratch' and returns it.
+static const void* peek_clusters(fat_volume_t* vol, uint16_t start, uint32_t count, void* scratch) {
+    const void* staged = (count == 1) ? staged_image(vol, start) : NULL;
+    if (staged != NULL) {
+        return staged; // A directory cluster the calling thread's operation changed
+    }
+    if (vol->map != NULL) {
+        if ((uint32_t)start + count > vol->cluster_count) {
+            fprintf(stderr, "Error: Attempt to read invalid clusters (%u-%u).\n", start, start + count - 1);
+            return NULL;
+        }
+        return vol->map + ((size_t)start * vol->cluster_size);
     }
+    // Single clusters (directories) go through the cache; longer runs are streamed past it.
+    int status = (count == 1) ? read_cluster(vol, start, scratch) : read_clusters(vol, start, count, scratch);
+    return (status == 0) ? scratch : NULL;
+}
 
-    size_t bytes_read = fread(buffer, 1, CLUSTER_SIZE, g_partition_file);
+// --- Geometry ---
 
-    if (bytes_read != CLUSTER_SIZE) {
-        // fread may return fewer bytes than expected if feof or ferror is set
-        fprintf(stderr, "Error reading cluster %u. Bytes read: %zu of %d\n", cluster_index, bytes_read, CLUSTER_SIZE);
+// Works out where everything goes on an image of 'cluster_count' clusters of 'cluster_size'
+// bytes. Returns -1 (after saying why) if the geometry isn't supported.
+static int plan_geometry(uint32_t cluster_size, uint32_t cluster_count, fs_geometry_t* geometry) {
+    if (cluster_size < FS_MIN_CLUSTER_SIZE || cluster_size > FS_MAX_CLUSTER_SIZE || (cluster_size & (cluster_size - 1)) != 0) {
+        fprintf(stderr, "Error: Unsupported cluster size %u (a power of two from %u to %u bytes).\n",
+                cluster_size, FS_MIN_CLUSTER_SIZE, FS_MAX_CLUSTER_SIZE);
+        return -1;
+    }
+    if (cluster_count < FS_MIN_CLUSTER_COUNT || cluster_count > FS_MAX_CLUSTER_COUNT) {
+        fprintf(stderr, "Error: Unsupported cluster count %u (%u to %u).\n", cluster_count, FS_MIN_CLUSTER_COUNT, FS_MAX_CLUSTER_COUNT);
         return -1;
     }
 
-    return 0; // Success
+    geometry->cluster_size = cluster_size;
+    geometry->cluster_count = cluster_count;
+    geometry->fat_clusters = (cluster_count * (uint32_t)sizeof(uint16_t) + cluster_size - 1) / cluster_size;
+    geometry->root_dir_cluster = FAT_CLUSTER_START + geometry->fat_clusters;
+    geometry->data_cluster_start = geometry->root_dir_cluster + 1;
+
+    // About JOURNAL_BYTES, and room to log the whole FAT twice, but no more than an eighth
+    // of the partition
+    uint32_t journal = JOURNAL_BYTES / cluster_size;
+    if (journal < geometry->fat_clusters * 2) journal = geometry->fat_clusters * 2;
+    if (journal < JOURNAL_MIN_CLUSTERS) journal = JOURNAL_MIN_CLUSTERS;
+    if (journal > cluster_count / 8) journal = cluster_count / 8;
+    geometry->journal_clusters = journal;
+    geometry->journal_start = cluster_count - journal;
+    return 0;
 }
 
-int write_cluster(uint16_t cluster_index, const void* buffer) {
-    if (g_partition_file == NULL) {
-        // Special case for the 'init' command, which may need to create the file
-        g_partition_file = fopen(PARTITION_NAME, "w+b");
-        if (g_partition_file == NULL) {
-            fprintf(stderr, "Critical error: Failed to create or open partition file '%s'.\n", PARTITION_NAME);
-            return -1;
-        }
+// Takes the geometry from the first bytes of cluster 0. Images formatted before the
+// superblock existed have the default geometry and no journal.
+static int parse_superblock(const void* sector, fs_geometry_t* geometry) {
+    boot_block_t boot;
+    memcpy(&boot, sector, sizeof(boot));
+    if (memcmp(boot.magic, SUPERBLOCK_MAGIC, sizeof(boot.magic)) != 0) {
+        plan_geometry(FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT, geometry);
+        geometry->journal_start = geometry->cluster_count;
+        geometry->journal_clusters = 0;
+        return 0;
     }
 
-    if (cluster_index >= CLUSTER_COUNT) {
-        fprintf(stderr, "Error: Attempt to write to invalid cluster (%u).\n", cluster_index);
+    if (plan_geometry(boot.cluster_size, boot.cluster_count, geometry) != 0) {
         return -1;
     }
-
-    long offset = (long)cluster_index * CLUSTER_SIZE;
-
-    if (fseek(g_partition_file, offset, SEEK_SET) != 0) {
-        fprintf(stderr, "Error seeking cluster %u for writing: %s\n", cluster_index, strerror(errno));
+    if (boot.fat_clusters != geometry->fat_clusters || boot.root_dir_cluster != geometry->root_dir_cluster ||
+        boot.journal_start < geometry->data_cluster_start || boot.journal_clusters < 2 ||
+        (uint32_t)boot.journal_start + boot.journal_clusters != geometry->cluster_count) {
+        fprintf(stderr, "Error: The superblock describes an unknown layout.\n");
         return -1;
     }
+    geometry->journal_start = boot.journal_start;
+    geometry->journal_clusters = boot.journal_clusters;
+    return 0;
+}
 
-    size_t bytes_written = fwrite(buffer, 1, CLUSTER_SIZE, g_partition_file);
-    
-    if (bytes_written != CLUSTER_SIZE) {
-        fprintf(stderr, "Error writing to cluster %u. Bytes written: %zu of %d\n", cluster_index, bytes_written, CLUSTER_SIZE);
+// Reads the geometry of the image file at 'path' from its first sector. Returns -1 if the
+// file can't be read.
+static int probe_geometry(const char* path, fs_geometry_t* geometry) {
+    block_dev_t* dev = bdev_open_file(path, SECTOR_SIZE, 1, false);
+    if (dev == NULL) {
         return -1;
     }
-
-    // Ensure data is flushed to disk immediately.
-    // Important for file system consistency.
-    fflush(g_partition_file);
-
-    return 0; // Success
+    uint8_t sector[SECTOR_SIZE];
+    void* buffers[1] = { sector };
+    int status = bdev_readv(dev, 0, 1, buffers);
+    bdev_close(dev);
+    return (status == 0) ? parse_superblock(sector, geometry) : -1;
 }
 
-int fs_format() {
-    // We need to create the file, so we open it in "w+b" mode.
-    // This creates the file if it doesn't exist, or truncates it if it does.
-    if (g_partition_file != NULL) {
-        fclose(g_partition_file);
-    }
-    g_partition_file = fopen(PARTITION_NAME, "w+b");
-    if (g_partition_file == NULL) {
-        perror("Error creating or truncating partition file");
+// Reads the geometry of the image on the current device.
+static int read_superblock(fat_volume_t* vol, fs_geometry_t* geometry) {
+    if (vol->dev == NULL) {
+        fprintf(stderr, "Error: File system not initialized. Cannot read.\n");
         return -1;
     }
-
-    // 1. Prepare an in-memory FAT
-    printf("Formatting file system...\n");
-    //memset is used to fill the FAT table with specific values.
-    // FAT_ENTRY_FREE is 0x0000, meaning the cluster is free.
-    // FAT_ENTRY_BOOT is 0xFFF8, meaning it's the Boot Block.
-    // FAT_ENTRY_RESERVED is 0xFFF0, meaning it's reserved for the FAT itself
-    // FAT_ENTRY_EOF is 0xFFFF, meaning it's the end of a file chain.
-    memset(g_fat_table, FAT_ENTRY_FREE, sizeof(g_fat_table)); // Fill with 0x0000
-
-    g_fat_table[BOOT_BLOCK_CLUSTER] = FAT_ENTRY_BOOT;         // 0 is the Boot Block
-    for (uint16_t i = FAT_CLUSTER_START; i < (FAT_CLUSTER_START + FAT_CLUSTER_COUNT); ++i) {
-        g_fat_table[i] = FAT_ENTRY_RESERVED;                  // 1-8 are reserved for the FAT itself
+    uint8_t* block = malloc(vol->dev->block_size);
+    void* buffers[1] = { block };
+    int status = (block != NULL) ? bdev_readv(vol->dev, BOOT_BLOCK_CLUSTER, 1, buffers) : -1;
+    if (status == 0) {
+        status = parse_superblock(block, geometry);
+    } else {
+        fprintf(stderr, "Error: Could not read the superblock.\n");
     }
-    g_fat_table[ROOT_DIR_CLUSTER] = FAT_ENTRY_EOF;            // 9 is the Root Directory (and it's the end of its chain)
-
-    // 2. Prepare an empty Boot Block buffer
-    uint8_t boot_block_buffer[CLUSTER_SIZE];
-    memset(boot_block_buffer, 0xBB, sizeof(boot_block_buffer));
+    free(block);
+    return status;
+}
 
-    // 3. Prepare an empty Root Directory buffer
-    union data_cluster root_dir_buffer;
-    memset(&root_dir_buffer, 0x00, sizeof(root_dir_buffer));
+// Makes 'geometry' the volume's. The tables sized by it (the FAT copies, the directory
+// locks and indexes, the allocator and the cache) are replaced when the cluster size or
+// count changes. Called with state_lock held exclusively, or on a new volume.
+static int set_geometry(fat_volume_t* vol, const fs_geometry_t* geometry) {
+    if (vol->fat == NULL || geometry->cluster_size != vol->cluster_size || geometry->cluster_count != vol->cluster_count) {
+        size_t fat_bytes = (size_t)geometry->fat_clusters * geometry->cluster_size;
+        uint16_t* fat = calloc(1, fat_bytes);
+        uint16_t* disk_fat = calloc(1, fat_bytes);
+        bool* fat_dirty = calloc(geometry->fat_clusters, sizeof(bool));
+        bool* fat_changed = calloc(geometry->fat_clusters, sizeof(bool));
+        uint64_t* clusters = calloc((geometry->cluster_count + 63) / 64, sizeof(uint64_t));
+        dir_index_t** dir_index = calloc(geometry->cluster_count, sizeof(dir_index_t*));
+        pthread_rwlock_t* dir_locks = malloc(geometry->cluster_count * sizeof(pthread_rwlock_t));
+        if (fat == NULL || disk_fat == NULL || fat_dirty == NULL || fat_changed == NULL || clusters == NULL ||
+            dir_index == NULL || dir_locks == NULL) {
+            fprintf(stderr, "Error: Could not allocate the tables of %u clusters.\n", geometry->cluster_count);
+            free(fat);
+            free(disk_fat);
+            free(fat_dirty);
+            free(fat_changed);
+            free(clusters);
+            free(dir_index);
+            free(dir_locks);
+            return -1;
+        }
 
-    // 4. Write everything to the virtual disk file
-    printf("Writing Boot Block...\n");
-    if (write_cluster(BOOT_BLOCK_CLUSTER, boot_block_buffer) != 0) {
-        fprintf(stderr, "Error writing boot block.\n");
-        return -1;
+        if (vol->fat != NULL) {
+            drop_dir_indexes(vol);
+            for (uint32_t i = 0; i < vol->cluster_count; ++i) {
+                pthread_rwlock_destroy(&vol->dir_locks[i]);
+            }
+            free(vol->fat);
+            free(vol->disk_fat);
+            free(vol->fat_dirty);
+            free(vol->commit_fat_changed);
+            free(vol->commit_clusters);
+            free(vol->dir_index);
+            free(vol->dir_locks);
+        }
+        for (uint32_t i = 0; i < geometry->cluster_count; ++i) {
+            pthread_rwlock_init(&dir_locks[i], NULL);
+        }
+        vol->fat = fat;
+        vol->disk_fat = disk_fat;
+        vol->fat_dirty = fat_dirty;
+        vol->commit_fat_changed = fat_changed;
+        vol->commit_clusters = clusters;
+        vol->dir_index = dir_index;
+        vol->dir_locks = dir_locks;
+        alloc_destroy(&vol->alloc); // Built again for the new layout by rebuild_free_bitmap()
     }
 
-    printf("Writing File Allocation Table (FAT)...\n");
-    // The FAT is 8 clusters long. We write it from our in-memory g_fat_table.
-    // We cast our uint16_t* FAT table to a uint8_t* to treat it as raw bytes.
-    if (write_cluster(FAT_CLUSTER_START, (uint8_t*)g_fat_table) != 0) {
-        // Note: This simplified version writes the whole 8KB FAT starting at cluster 1.
-        // The spec implies the FAT occupies 8 clusters, so we perform a single large write
-        // that spans them. write_cluster is writing CLUSTER_SIZE bytes, so we'd need a loop.
-        // Let's correct this to be precise.
-    }
-    
-    // CORRECTED FAT WRITING LOGIC:
-    // The FAT itself spans 8 clusters. We must write it cluster by cluster.
-    uint8_t* fat_as_bytes = (uint8_t*)g_fat_table;
-    for (uint16_t i = 0; i < FAT_CLUSTER_COUNT; ++i) {
-        if (write_cluster(FAT_CLUSTER_START + i, fat_as_bytes + (i * CLUSTER_SIZE)) != 0) {
-            fprintf(stderr, "Error writing FAT cluster #%u\n", FAT_CLUSTER_START + i);
+    vol->cluster_size = geometry->cluster_size;
+    vol->cluster_count = geometry->cluster_count;
+    vol->fat_clusters = geometry->fat_clusters;
+    vol->root_dir = (uint16_t)geometry->root_dir_cluster;
+    vol->data_start = (uint16_t)geometry->data_cluster_start;
+    vol->journal_start = geometry->journal_start;
+    vol->journal_clusters = geometry->journal_clusters;
+    vol->dir_entries = geometry->cluster_size / DIR_ENTRY_SIZE;
+    vol->fat_entries = geometry->cluster_size / sizeof(uint16_t);
+    vol->cluster_words = (geometry->cluster_count + 63) / 64;
+    vol->discard_align = (geometry->cluster_size < DISCARD_ALIGN_BYTES) ? DISCARD_ALIGN_BYTES / geometry->cluster_size : 1;
+
+    // A cache sized for the old geometry is allocated again, counters included
+    if (vol->cache.slots != NULL && (vol->cache.cluster_size != vol->cluster_size || vol->cache.cluster_count != vol->cluster_count)) {
+        cache_stats_t stats = vol->cache.stats;
+        cache_destroy(&vol->cache);
+        if (ensure_cache(vol) != 0) {
             return -1;
         }
+        vol->cache.stats = stats;
     }
+    return 0;
+}
 
-    printf("Writing Root Directory...\n");
-    if (write_cluster(ROOT_DIR_CLUSTER, &root_dir_buffer) != 0) {
-        fprintf(stderr, "Error writing root directory.\n");
-        return -1;
+void fs_get_geometry(fat_volume_t* vol, fs_geometry_t* geometry) {
+    lock_state(vol, false);
+    geometry->cluster_size = vol->cluster_size;
+    geometry->cluster_count = vol->cluster_count;
+    geometry->fat_clusters = vol->fat_clusters;
+    geometry->root_dir_cluster = vol->root_dir;
+    geometry->data_cluster_start = vol->data_start;
+    geometry->journal_start = vol->journal_start;
+    geometry->journal_clusters = vol->journal_clusters;
+    unlock_state(vol);
+}
+
+// Frees everything a volume without a device owns. Works on a partly built volume too:
+// tables that were never allocated are NULL.
+static void free_volume(fat_volume_t* vol) {
+    cache_destroy(&vol->cache);
+    alloc_destroy(&vol->alloc);
+    dcache_destroy(&vol->dcache);
+
+    pthread_rwlock_destroy(&vol->state_lock);
+    if (vol->dir_locks != NULL) {
+        for (uint32_t i = 0; i < vol->cluster_count; ++i) {
+            pthread_rwlock_destroy(&vol->dir_locks[i]);
+        }
     }
+    pthread_mutex_destroy(&vol->files_lock);
+    pthread_mutex_destroy(&vol->journal_lock);
+    pthread_cond_destroy(&vol->journal_cond);
+    pthread_cond_destroy(&vol->checkpoint_cond);
+    pthread_mutex_destroy(&vol->fat_lock);
+    pthread_mutex_destroy(&vol->cache_lock);
+    free(vol->fat);
+    free(vol->disk_fat);
+    free(vol->fat_dirty);
+    free(vol->commit_fat_changed);
+    free(vol->commit_clusters);
+    free(vol->dir_index);
+    free(vol->dir_locks);
+    free(vol->path);
+    free(vol);
+}
 
-    // We don't need to write the data area, as it's implicitly empty.
-    
-    // Finally, ensure the file is the correct size (4MB)
-    // fseek to the last byte and write a null character.
-    if (fseek(g_partition_file, PARTITION_SIZE - 1, SEEK_SET) != 0) {
-        perror("Error seeking to end of file");
-        return -1;
+// Allocates a volume with no device yet, with the given geometry.
+static fat_volume_t* new_volume(const fs_geometry_t* geometry) {
+    fat_volume_t* vol = calloc(1, sizeof(fat_volume_t));
+    if (vol == NULL) {
+        fprintf(stderr, "Error: Could not allocate volume.\n");
+        return NULL;
     }
-    if (fwrite("\0", 1, 1, g_partition_file) != 1) {
-        perror("Error writing last byte of file");
-        return -1;
+    vol->backend = FS_BACKEND_FILE;
+    vol->durability = FS_DURABILITY_COMMIT;
+    vol->cache_capacity = CACHE_DEFAULT_CLUSTERS;
+    vol->dir_index_enabled = true;
+    vol->dcache_enabled = true;
+
+    pthread_rwlock_init(&vol->state_lock, NULL);
+    pthread_mutex_init(&vol->files_lock, NULL);
+    pthread_mutex_init(&vol->journal_lock, NULL);
+    pthread_cond_init(&vol->journal_cond, NULL);
+    pthread_cond_init(&vol->checkpoint_cond, NULL);
+    vol->commit_queue_end = &vol->commit_queue;
+    pthread_mutex_init(&vol->fat_lock, NULL);
+    pthread_mutex_init(&vol->cache_lock, NULL);
+
+    if (dcache_init(&vol->dcache, DCACHE_DEFAULT_ENTRIES) != 0 || set_geometry(vol, geometry) != 0) {
+        free_volume(vol);
+        return NULL;
     }
+    return vol;
+}
 
-    printf("Format complete. '%s' created with size %d bytes.\n", PARTITION_NAME, PARTITION_SIZE);
-    fflush(g_partition_file);
+fat_volume_t* fs_open_volume(const char* path) {
+    // The partition file is opened with the geometry its superblock records
+    fs_geometry_t geometry;
+    if (probe_geometry(path, &geometry) != 0) {
+        plan_geometry(FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT, &geometry);
+    }
+    fat_volume_t* vol = new_volume(&geometry);
+    if (vol == NULL) return NULL;
+
+    size_t path_length = strlen(path) + 1;
+    vol->path = malloc(path_length);
+    if (vol->path == NULL) {
+        fprintf(stderr, "Error: Could not allocate volume.\n");
+        free_volume(vol);
+        return NULL;
+    }
+    memcpy(vol->path, path, path_length);
 
-    return 0;
-}
+    // Opens the existing partition file for reading and writing.
+    // The 'init' command will create the file if needed.
+    block_dev_t* dev = open_partition(vol, false);
 
+    if (dev == NULL) {
+        // If it doesn't exist, it's not a fatal error yet,
+        // because the 'init' command will create it.
+        // Print a warning that may help during debugging.
+        printf("Warning: Could not open '%s'. The file will be created with the 'init' command.\n", path);
+        return vol; // Return the volume anyway
+    }
+    use_device(vol, dev, true);
+    return vol;
+}
 
-int fs_load_fat() {
-    printf("Loading FAT from disk...\n");
-    
-    // The FAT spans 8 clusters. We must read it cluster by cluster.
-    uint8_t* fat_as_bytes = (uint8_t*)g_fat_table;
-    for (uint16_t i = 0; i < FAT_CLUSTER_COUNT; ++i) {
-        if (read_cluster(FAT_CLUSTER_START + i, fat_as_bytes + (i * CLUSTER_SIZE)) != 0) {
-            fprintf(stderr, "Error loading FAT cluster #%u\n", FAT_CLUSTER_START + i);
-            return -1;
-        }
+// The geometry fs_format() gives an attached device by default: a cluster per block, for
+// as many blocks as the FAT can address.
+static int device_geometry(const block_dev_t* dev, fs_geometry_t* geometry) {
+    uint32_t cluster_count = (dev->block_count < FS_MAX_CLUSTER_COUNT) ? dev->block_count : FS_MAX_CLUSTER_COUNT;
+    if (plan_geometry(dev->block_size, cluster_count, geometry) != 0) {
+        fprintf(stderr, "Error: Device geometry (%u blocks of %u bytes) doesn't fit the file system.\n",
+                dev->block_count, dev->block_size);
+        return -1;
     }
-    
-    printf("FAT loaded successfully.\n");
     return 0;
 }
 
-int find_entry_by_path(const char* path, path_search_result_t* result) {
-    memset(result, 0, sizeof(path_search_result_t));
-    result->parent_cluster = ROOT_DIR_CLUSTER; // Start search at the root
+fat_volume_t* fs_attach_volume(block_dev_t* dev) {
+    fs_geometry_t geometry;
+    if (device_geometry(dev, &geometry) != 0) {
+        return NULL;
+    }
 
-    // strtok modifies the string, so we work on a copy.
-    char path_copy[512];
-    strncpy(path_copy, path, sizeof(path_copy) - 1);
-    path_copy[sizeof(path_copy) - 1] = '\0';
+    fat_volume_t* vol = new_volume(&geometry);
+    if (vol == NULL) return NULL;
+    use_device(vol, dev, false);
+    return vol;
+}
 
-    // Handle the root path "/" as a special case.
-    if (strcmp(path_copy, "/") == 0) {
-        result->found = true;
-        result->entry_cluster = ROOT_DIR_CLUSTER;
-        result->entry.attributes = ATTR_DIRECTORY;
-        strcpy((char*)result->entry.filename, "/");
+static int sync_volume(fat_volume_t* vol);
+static int checkpoint_journal(fat_volume_t* vol);
+static void stop_checkpointer(fat_volume_t* vol);
+
+// Called with state_lock held exclusively.
+static int change_backend(fat_volume_t* vol, fs_backend_t backend) {
+    if (backend == vol->backend) {
         return 0;
     }
+    if (sync_volume(vol) != 0) {
+        fprintf(stderr, "Error: Could not flush before switching backends.\n");
+        return -1;
+    }
 
-    char* token = strtok(path_copy, "/");
-    if (!token) { // Empty or invalid path
-        return 0;
+    vol->backend = backend;
+    if (vol->dev == NULL || !vol->dev_owned) {
+        return 0; // Takes effect the next time the partition file is opened
     }
 
-    union data_cluster cluster_buffer;
-    uint16_t current_cluster = ROOT_DIR_CLUSTER;
+    // Reopen the partition file; neither backend may see clusters cached by the other one.
+    // The journal stays where it was, as the image is the same.
+    bool journaled = vol->journaled;
+    release_device(vol);
+    block_dev_t* dev = open_partition(vol, false);
+    if (dev == NULL) {
+        fprintf(stderr, "Error: Could not reopen '%s'.\n", vol->path);
+        return -1;
+    }
+    use_device(vol, dev, true);
+    vol->journaled = journaled;
+    return 0;
+}
 
-    while (token != NULL) {
-        bool found_token = false;
-        strncpy(result->name, token, sizeof(result->name) - 1); // Store last token name
+int fs_set_backend(fat_volume_t* vol, fs_backend_t backend) {
+    if (refuse_in_batch(vol, "backend")) return -1;
+    lock_state(vol, true);
+    int status = change_backend(vol, backend);
+    unlock_state(vol);
+    return status;
+}
 
-        if (read_cluster(current_cluster, &cluster_buffer) != 0) {
-            fprintf(stderr, "Error: Could not read cluster %u\n", current_cluster);
-            return -1;
-        }
+void fs_close_volume(fat_volume_t* vol) {
+    if (vol == NULL) return;
+    if (t_batch == vol) fs_batch_commit(vol);
+    stop_checkpointer(vol);
+    checkpoint_journal(vol); // Don't lose dirty clusters on the way out, and leave the journal empty
+    release_device(vol);
+    free_volume(vol);
+}
 
-        for (uint32_t i = 0; i < DIR_ENTRIES_PER_CLUSTER; ++i) {
-            dir_entry_t* entry = &cluster_buffer.dir[i];
-            if (entry->filename[0] != 0x00 && strcmp((char*)entry->filename, token) == 0) {
-                // Found the entry for this token
-                result->parent_cluster = current_cluster;
-                result->entry_cluster = entry->first_block;
-                result->entry_index = i;
-                result->entry = *entry; // Copy the entry data
+// --- Entry Names ---
 
-                current_cluster = entry->first_block;
-                found_token = true;
-                break;
-            }
-        }
+// Copies 'name' into a fixed-size name field, cut to 'size' - 1 bytes. The rest of the
+// field is zero-filled, so the name is always terminated.
+static void copy_name(char* field, size_t size, const char* name) {
+    size_t length = strlen(name);
+    if (length > size - 1) length = size - 1;
+    memcpy(field, name, length);
+    memset(field + length, 0, size - length);
+}
 
-        if (!found_token) {
-            result->found = false;
-            return 0; // Component of the path not found
+// --- FAT Modification Tracking ---
+
+// Every change to vol->fat must go through here so that flush_fat() knows what to write.
+// Called with fat_lock held (or during a format, when nothing else runs).
+static void fat_set(fat_volume_t* vol, uint16_t cluster_index, uint16_t value) {
+    vol->fat[cluster_index] = value;
+    transaction_t* tx = current_transaction(vol);
+    if (tx != NULL) {
+        // Logged and written home by the commit. A freed cluster only becomes available
+        // then, so that no other operation can reuse it before its release is durable.
+        tx->fat_touched[cluster_index / 64] |= 1ull << (cluster_index % 64);
+        uint32_t fat_cluster = cluster_index / vol->fat_entries;
+        if ((tx->fat_clusters[fat_cluster / 64] & (1ull << (fat_cluster % 64))) == 0) {
+            tx->fat_clusters[fat_cluster / 64] |= 1ull << (fat_cluster % 64);
+            tx->fat_cluster_count++;
         }
-
-        token = strtok(NULL, "/"); // Get the next part of the path
+        tx->dirty = true;
+        if (value != FAT_ENTRY_FREE) alloc_mark_used(&vol->alloc, cluster_index);
+        return;
     }
+    vol->fat_dirty[cluster_index / vol->fat_entries] = true;
 
-    result->found = true;
-    return 0;
+    if (vol->alloc.words != NULL) {
+        if (value == FAT_ENTRY_FREE) alloc_mark_free(&vol->alloc, cluster_index);
+        else alloc_mark_used(&vol->alloc, cluster_index);
+    }
 }
 
-int fs_ls(const char* path) {
-    path_search_result_t result;
-    if (find_entry_by_path(path, &result) != 0 || !result.found) {
-        fprintf(stderr, "ls: cannot access '%s': No such file or directory\n", path);
+// Builds the free-cluster bitmap from the current in-memory FAT.
+static int rebuild_free_bitmap(fat_volume_t* vol) {
+    if (vol->alloc.words == NULL && alloc_init(&vol->alloc, vol->cluster_count, vol->data_start) != 0) {
         return -1;
     }
+    alloc_rebuild(&vol->alloc, vol->fat);
+    return 0;
+}
 
-    if (result.entry.attributes != ATTR_DIRECTORY) {
-        // If it's a file, just print its name.
-        printf("%s\n", result.entry.filename);
+// Writes only the FAT clusters that changed since the last flush.
+// Adjacent dirty FAT clusters are handed over as one write_clusters() run.
+// Inside a transaction there is nothing to do: the commit logs the changed entries.
+static int flush_fat(fat_volume_t* vol) {
+    if (current_transaction(vol) != NULL) {
         return 0;
     }
+    pthread_mutex_lock(&vol->fat_lock);
+    int status = 0;
+    uint8_t* fat_as_bytes = (uint8_t*)vol->fat;
+    uint32_t i = 0;
+    while (i < vol->fat_clusters && status == 0) {
+        if (!vol->fat_dirty[i]) {
+            i++;
+            continue;
+        }
+        uint32_t run_start = i;
+        while (i < vol->fat_clusters && vol->fat_dirty[i]) {
+            vol->fat_dirty[i++] = false;
+        }
+        if (write_clusters(vol, FAT_CLUSTER_START + run_start, i - run_start, fat_as_bytes + ((size_t)run_start * vol->cluster_size)) != 0) {
+            fprintf(stderr, "Error writing FAT clusters #%u-#%u\n", FAT_CLUSTER_START + run_start, FAT_CLUSTER_START + i - 1);
+            status = -1;
+        }
+    }
+    pthread_mutex_unlock(&vol->fat_lock);
+    return status;
+}
 
-    printf("Listing of '%s':\n", path);
-    printf("Type  Size      Name\n");
-    printf("----  --------  ------------------\n");
+// --- Cluster Cache ---
+// The helpers in this section are called with cache_lock held.
+
+// Makes sure the cache is allocated before its first use.
+static int ensure_cache(fat_volume_t* vol) {
+    if (vol->cache.slots != NULL) {
+        return 0;
+    }
+    return cache_init(&vol->cache, vol->cache_capacity, vol->cluster_size, vol->cluster_count);
+}
 
-    union data_cluster cluster_buffer;
-    uint16_t current_cluster = result.entry_cluster;
+static bool is_cached_dirty(fat_volume_t* vol, uint32_t cluster_index) {
+    if (cluster_index >= vol->cluster_count) return false;
+    cache_slot_t* slot = cache_peek(&vol->cache, (uint16_t)cluster_index);
+    return slot != NULL && slot->dirty;
+}
 
-    // Read the directory cluster
-    if (read_cluster(current_cluster, &cluster_buffer) != 0) {
+// Writes back the dirty slot together with the dirty clusters physically next to it,
+// so a run of dirty clusters reaches the disk in a single pwritev.
+static int writeback_run(fat_volume_t* vol, cache_slot_t* slot) {
+    uint16_t first = slot->cluster;
+    uint16_t last = slot->cluster;
+    while (last - first + 1 < IO_BATCH_CLUSTERS && is_cached_dirty(vol, (uint32_t)first - 1)) first--;
+    while (last - first + 1 < IO_BATCH_CLUSTERS && is_cached_dirty(vol, (uint32_t)last + 1)) last++;
+
+    uint32_t count = (uint32_t)(last - first + 1);
+    const void* buffers[IO_BATCH_CLUSTERS];
+    for (uint32_t i = 0; i < count; ++i) {
+        buffers[i] = cache_peek(&vol->cache, first + i)->data;
+    }
+    if (bdev_writev(vol->dev, first, count, buffers) != 0) {
         return -1;
     }
 
-    for (uint32_t i = 0; i < DIR_ENTRIES_PER_CLUSTER; ++i) {
-        dir_entry_t* entry = &cluster_buffer.dir[i];
-        if (entry->filename[0] != 0x00) { // Check if the entry is in use
-            const char* type = (entry->attributes == ATTR_DIRECTORY) ? "[D]" : "[F]";
-            printf("%-4s  %-8u  %s\n", type, entry->size, entry->filename);
-        }
+    for (uint32_t i = 0; i < count; ++i) {
+        cache_peek(&vol->cache, first + i)->dirty = false;
     }
-
+    vol->cache.stats.writebacks += count;
     return 0;
 }
 
-static uint16_t find_free_cluster() {
-    // Start search after the reserved system area
-    for (uint16_t i = DATA_CLUSTER_START; i < CLUSTER_COUNT; ++i) {
-        if (g_fat_table[i] == FAT_ENTRY_FREE) {
-            return i;
+// Returns a slot that can hold 'cluster_index', writing back the evicted cluster if needed.
+static cache_slot_t* claim_slot(fat_volume_t* vol, uint16_t cluster_index) {
+    cache_slot_t* slot = cache_victim(&vol->cache);
+    if (slot->valid && slot->dirty) {
+        if (writeback_run(vol, slot) != 0) {
+            return NULL;
         }
     }
-    return 0; // Invalid cluster index indicates no space
+    cache_install(&vol->cache, slot, cluster_index);
+    return slot;
 }
 
-static int find_free_dir_entry(uint16_t dir_cluster_index, union data_cluster* dir_cluster) {
-    if (read_cluster(dir_cluster_index, dir_cluster) != 0) {
-        return -1; // Error reading cluster
+// Writes every dirty cached cluster to the device, without flushing it.
+static int write_back_cache(fat_volume_t* vol) {
+    if (vol->dev == NULL) {
+        return 0; // Nothing to write
     }
 
-    for (int i = 0; i < DIR_ENTRIES_PER_CLUSTER; ++i) {
-        if (dir_cluster->dir[i].filename[0] == 0x00) {
-            return i; // Found a free slot
+    int status = 0;
+    pthread_mutex_lock(&vol->cache_lock);
+    if (vol->map == NULL && vol->cache.slots != NULL) {
+        for (size_t i = 0; i < vol->cache.capacity; ++i) {
+            cache_slot_t* slot = &vol->cache.slots[i];
+            if (slot->valid && slot->dirty) {
+                if (writeback_run(vol, slot) != 0) {
+                    status = -1; // Keep going so that as much as possible reaches the disk
+                }
+            }
         }
     }
-    return -2; // Directory is full
+    pthread_mutex_unlock(&vol->cache_lock);
+    return status;
 }
 
-// --- High-Level Implementations ---
-// (Keep find_entry_by_path and fs_ls)
+static int sync_volume(fat_volume_t* vol) {
+    if (vol->dev == NULL) {
+        return 0; // Nothing to flush
+    }
+    int status = write_back_cache(vol);
 
-int fs_mkdir(const char* path) {
-    // 1. Separate parent path and new directory name
-    char path_copy[512];
-    strncpy(path_copy, path, sizeof(path_copy) - 1);
+    // Ensure data is flushed to disk (fdatasync for files, msync for mappings).
+    // Important for file system consistency.
+    if (bdev_flush(vol->dev) != 0) {
+        status = -1;
+    }
+    return status;
+}
 
-    char* new_dir_name = strrchr(path_copy, '/');
-    if (new_dir_name == NULL) {
-        fprintf(stderr, "mkdir: invalid path '%s'\n", path);
-        return -1;
+// Flushes the device, unless the durability level leaves that to the OS.
+static int flush_device(fat_volume_t* vol) {
+    if (vol->durability == FS_DURABILITY_NONE || vol->dev == NULL) {
+        return 0;
     }
-    
-    char parent_path[512];
-    if (new_dir_name == path_copy) { // e.g., "/newdir"
-        strcpy(parent_path, "/");
-        new_dir_name++; // Skip the '/'
-    } else {
-        *new_dir_name = '\0'; // Terminate parent path string
-        strcpy(parent_path, path_copy);
-        new_dir_name++; // Skip the '/'
+    return bdev_flush(vol->dev);
+}
+
+// Tells the device that a run of freed clusters holds nothing worth keeping (the partition
+// file gives their space back to the host) and drops their cached copies, which would
+// otherwise be written back. Called before the clusters are marked free, so that nothing
+// new is written to them in the meantime. Free neighbours up to the next host block
+// boundaries are claimed for the duration and discarded along with the run.
+static void discard_clusters(fat_volume_t* vol, uint16_t start, uint32_t count) {
+    if (vol->dev == NULL || count == 0) {
+        return;
+    }
+    uint32_t before = 0;
+    uint32_t after = 0;
+    if (vol->alloc.words != NULL) {
+        while ((start - before) % vol->discard_align != 0 && alloc_claim_at(&vol->alloc, start - before - 1, 1) == 1) {
+            before++;
+        }
+        uint32_t end = start + count;
+        uint32_t tail = (vol->discard_align - end % vol->discard_align) % vol->discard_align;
+        after = (tail > 0) ? alloc_claim_at(&vol->alloc, end, tail) : 0;
+    }
+    uint32_t first = start - before;
+    count += before + after;
+
+    pthread_mutex_lock(&vol->cache_lock);
+    if (vol->cache.slots != NULL) {
+        for (uint32_t i = 0; i < count; ++i) {
+            cache_slot_t* slot = cache_peek(&vol->cache, (uint16_t)(first + i));
+            if (slot != NULL) cache_invalidate_slot(&vol->cache, slot);
+        }
+    }
+    pthread_mutex_unlock(&vol->cache_lock);
+    if (bdev_discard(vol->dev, first, count) != 0) {
+        fprintf(stderr, "Warning: Could not discard clusters #%u-#%u.\n", first, first + count - 1);
     }
 
-    // 2. Find parent directory
-    path_search_result_t parent_info;
-    if (find_entry_by_path(parent_path, &parent_info) != 0 || !parent_info.found) {
-        fprintf(stderr, "mkdir: cannot create directory '%s': No such file or directory\n", path);
-        return -1;
+    for (uint32_t i = 0; i < before; ++i) {
+        alloc_mark_free(&vol->alloc, first + i);
     }
-    if (parent_info.entry.attributes != ATTR_DIRECTORY) {
-        fprintf(stderr, "mkdir: cannot create directory '%s': Not a directory\n", parent_path);
-        return -1;
+    for (uint32_t i = 0; i < after; ++i) {
+        alloc_mark_free(&vol->alloc, first + count - after + i);
     }
+}
 
-    // 3. Find a free slot in the parent directory
-    union data_cluster parent_cluster_data;
-    int free_entry_index = find_free_dir_entry(parent_info.entry_cluster, &parent_cluster_data);
+void fs_set_durability(fat_volume_t* vol, fs_durability_t level) {
+    lock_state(vol, true);
+    vol->durability = level;
+    unlock_state(vol);
+}
 
-    if (free_entry_index < 0) {
-        fprintf(stderr, "mkdir: cannot create directory '%s': Parent directory is full\n", path);
+int fs_sync(fat_volume_t* vol) {
+    lock_state(vol, false);
+    int status = sync_volume(vol);
+    unlock_state(vol);
+    return status;
+}
+
+// Called with state_lock held exclusively, so the cache can be replaced.
+static int resize_cache(fat_volume_t* vol, size_t cluster_count) {
+    if (sync_volume(vol) != 0) {
+        fprintf(stderr, "Error: Could not flush the cache before resizing it.\n");
         return -1;
     }
 
-    // 4. Find a free cluster for the new directory's contents
-    uint16_t new_cluster_idx = find_free_cluster();
-    if (new_cluster_idx == 0) {
-        fprintf(stderr, "mkdir: cannot create directory '%s': No space left on device\n", path);
+    cache_stats_t stats = vol->cache.stats; // Counters survive a resize
+    cache_destroy(&vol->cache);
+    vol->cache_capacity = (cluster_count == 0) ? 1 : cluster_count;
+    if (ensure_cache(vol) != 0) {
         return -1;
     }
-    
-    // 5. Fill in the new directory entry
-    dir_entry_t* new_entry = &parent_cluster_data.dir[free_entry_index];
-    strncpy((char*)new_entry->filename, new_dir_name, 17);
-    new_entry->filename[17] = '\0';
-    new_entry->attributes = ATTR_DIRECTORY;
-    new_entry->first_block = new_cluster_idx;
-    new_entry->size = 0; // Directories have a size of 0
+    vol->cache.stats = stats;
+    return 0;
+}
 
-    // 6. Update the FAT
-    g_fat_table[new_cluster_idx] = FAT_ENTRY_EOF;
+int fs_set_cache_size(fat_volume_t* vol, size_t cluster_count) {
+    if (refuse_in_batch(vol, "cache")) return -1;
+    lock_state(vol, true);
+    int status = resize_cache(vol, cluster_count);
+    unlock_state(vol);
+    return status;
+}
 
-    // 7. Prepare the new directory's own cluster (it's empty)
-    union data_cluster new_dir_cluster_data;
-    memset(&new_dir_cluster_data, 0, sizeof(new_dir_cluster_data));
+void fs_get_cache_stats(fat_volume_t* vol, cache_stats_t* stats) {
+    pthread_mutex_lock(&vol->cache_lock);
+    *stats = vol->cache.stats;
+    pthread_mutex_unlock(&vol->cache_lock);
+}
 
-    // 8. Write all changes to disk
-    if (write_cluster(parent_info.entry_cluster, &parent_cluster_data) != 0) return -1;
-    if (write_cluster(new_cluster_idx, &new_dir_cluster_data) != 0) return -1;
-    // Persist the entire FAT
-    for (uint16_t i = 0; i < FAT_CLUSTER_COUNT; ++i) {
-        if (write_cluster(FAT_CLUSTER_START + i, (uint8_t*)g_fat_table + (i * CLUSTER_SIZE)) != 0) return -1;
+// Serves a cluster from the cache, loading it on a miss. Called with cache_lock held;
+// a miss keeps the lock during the device read so that the slot is never seen half-filled.
+static int read_cached(fat_volume_t* vol, uint16_t cluster_index, void* buffer) {
+    if (ensure_cache(vol) != 0) return -1;
+
+    cache_slot_t* slot = cache_lookup(&vol->cache, cluster_index);
+    if (slot == NULL) {
+        slot = claim_slot(vol, cluster_index);
+        if (slot == NULL) return -1;
+        void* buffers[1] = { slot->data };
+        if (bdev_readv(vol->dev, cluster_index, 1, buffers) != 0) {
+            cache_invalidate_slot(&vol->cache, slot); // Don't keep a half-read cluster around
+            return -1;
+        }
     }
 
-    printf("Directory '%s' created.\n", path);
-    return 0;
+    memcpy(buffer, slot->data, vol->cluster_size);
+    return 0; // Success
 }
 
-int fs_create(const char* path) {
-    // Logic is nearly identical to mkdir, with a few key differences.
-    // 1. Separate parent path and new file name (same as mkdir)
-    char path_copy[512]; strncpy(path_copy, path, sizeof(path_copy)-1);
-    char* new_file_name = strrchr(path_copy, '/');
-    if(!new_file_name) { fprintf(stderr, "create: invalid path '%s'\n", path); return -1; }
-    char parent_path[512];
-    if (new_file_name == path_copy) { strcpy(parent_path, "/"); new_file_name++; }
-    else { *new_file_name = '\0'; strcpy(parent_path, path_copy); new_file_name++; }
-
-    // 2. Find parent (same as mkdir)
-    path_search_result_t parent_info;
-    if (find_entry_by_path(parent_path, &parent_info) != 0 || !parent_info.found || parent_info.entry.attributes != ATTR_DIRECTORY) {
-        fprintf(stderr, "create: cannot create file '%s': Parent path not found or not a directory\n", path);
-        return -1;
+// Stages a whole cluster in the cache. Called with cache_lock held.
+static int write_cached(fat_volume_t* vol, uint16_t cluster_index, const void* buffer) {
+    if (ensure_cache(vol) != 0) return -1;
+
+    // The whole cluster is replaced, so a miss doesn't need to read the old contents.
+    cache_slot_t* slot = cache_lookup(&vol->cache, cluster_index);
+    if (slot == NULL) {
+        slot = claim_slot(vol, cluster_index);
+        if (slot == NULL) return -1;
     }
 
-    // 3. Find free slot (same as mkdir)
-    union data_cluster parent_cluster_data;
-    int free_entry_index = find_free_dir_entry(parent_info.entry_cluster, &parent_cluster_data);
-    if(free_entry_index < 0) { fprintf(stderr, "create: cannot create file '%s': Directory full\n", path); return -1; }
+    memcpy(slot->data, buffer, vol->cluster_size);
+    slot->dirty = true; // Written back on eviction or at the next fs_sync()
+    return 0; // Success
+}
 
-    // 4. Find free cluster (same as mkdir)
-    uint16_t new_cluster_idx = find_free_cluster();
-    if(new_cluster_idx == 0) { fprintf(stderr, "create: cannot create file '%s': No space left\n", path); return -1; }
+int read_cluster(fat_volume_t* vol, uint16_t cluster_index, void* buffer) {
+    if (vol->dev == NULL) {
+        fprintf(stderr, "Error: File system not initialized. Cannot read.\n");
+        return -1;
+    }
 
-    // 5. Fill entry - **DIFFERENCES ARE HERE**
-    dir_entry_t* new_entry = &parent_cluster_data.dir[free_entry_index];
-    strncpy((char*)new_entry->filename, new_file_name, 17);
-    new_entry->filename[17] = '\0';
-    new_entry->attributes = ATTR_ARCHIVE; // It's a file
-    new_entry->first_block = new_cluster_idx; // A file starts with a cluster...
-    new_entry->size = 0; // ...but its initial size is 0
+    if (cluster_index >= vol->cluster_count) {
+        fprintf(stderr, "Error: Attempt to read invalid cluster (%u).\n", cluster_index);
+        return -1;
+    }
 
-    // 6. Update FAT (same as mkdir)
-    g_fat_table[new_cluster_idx] = FAT_ENTRY_EOF;
+    const void* staged = staged_image(vol, cluster_index);
+    if (staged != NULL) {
+        memcpy(buffer, staged, vol->cluster_size);
+        return 0; // Changed by the calling thread's operation, not committed yet
+    }
 
-    // 7. Write changes - **DIFFERENCE IS HERE**
-    // We only need to write the parent dir and the FAT.
-    // No need to write an empty data cluster for a 0-byte file.
-    if (write_cluster(parent_info.entry_cluster, &parent_cluster_data) != 0) return -1;
-    for (uint16_t i = 0; i < FAT_CLUSTER_COUNT; ++i) {
-        if (write_cluster(FAT_CLUSTER_START + i, (uint8_t*)g_fat_table + (i * CLUSTER_SIZE)) != 0) return -1;
+    if (vol->map != NULL) {
+        memcpy(buffer, vol->map + ((size_t)cluster_index * vol->cluster_size), vol->cluster_size);
+        return 0; // Success
     }
-    
-    printf("File '%s' created.\n", path);
-    return 0;
+
+    pthread_mutex_lock(&vol->cache_lock);
+    int status = read_cached(vol, cluster_index, buffer);
+    pthread_mutex_unlock(&vol->cache_lock);
+    return status;
 }
 
-// Helper to free a chain of clusters in the FAT
-static void free_cluster_chain(uint16_t starting_cluster) {
-    uint16_t current = starting_cluster;
-    while (current != 0 && current < FAT_ENTRY_EOF) {
-        uint16_t next = g_fat_table[current];
-        g_fat_table[current] = FAT_ENTRY_FREE;
-        current = next;
+int write_cluster(fat_volume_t* vol, uint16_t cluster_index, const void* buffer) {
+    if (vol->dev == NULL) {
+        // Special case for the 'init' command, which may need to create the file
+        block_dev_t* dev = open_partition(vol, true);
+        if (dev == NULL) {
+            fprintf(stderr, "Critical error: Failed to create or open partition file '%s'.\n", vol->path);
+            return -1;
+        }
+        use_device(vol, dev, true);
     }
-}
 
-int fs_unlink(const char* path) {
-    path_search_result_t result;
-    if (find_entry_by_path(path, &result) != 0 || !result.found) {
-        fprintf(stderr, "unlink: cannot remove '%s': No such file or directory\n", path);
+    if (cluster_index >= vol->cluster_count) {
+        fprintf(stderr, "Error: Attempt to write to invalid cluster (%u).\n", cluster_index);
         return -1;
     }
 
-    // If it's a directory, check if it's empty
-    if (result.entry.attributes == ATTR_DIRECTORY) {
-        union data_cluster dir_content;
-        if (read_cluster(result.entry_cluster, &dir_content) != 0) return -1;
-        for (int i = 0; i < DIR_ENTRIES_PER_CLUSTER; ++i) {
-            if (dir_content.dir[i].filename[0] != 0x00) {
-                fprintf(stderr, "unlink: failed to remove '%s': Directory not empty\n", path);
-                return -1;
-            }
-        }
+    if (vol->map != NULL) {
+        memcpy(vol->map + ((size_t)cluster_index * vol->cluster_size), buffer, vol->cluster_size);
+        return 0; // Reaches the file at the next fs_sync() (msync) or when the kernel writes it back
     }
 
-    // Free the cluster chain in the FAT
-    free_cluster_chain(result.entry.first_block);
+    pthread_mutex_lock(&vol->cache_lock);
+    int status = write_cached(vol, cluster_index, buffer);
+    pthread_mutex_unlock(&vol->cache_lock);
+    return status;
+}
 
-    // Clear the entry in the parent directory
-    union data_cluster parent_dir_content;
-    if (read_cluster(result.parent_cluster, &parent_dir_content) != 0) return -1;
-    memset(&parent_dir_content.dir[result.entry_index], 0, sizeof(dir_entry_t));
+int read_clusters_v(fat_volume_t* vol, uint16_t start, uint32_t count, void* const* buffers) {
+    if (vol->dev == NULL) {
+        fprintf(stderr, "Error: File system not initialized. Cannot read.\n");
+        return -1;
+    }
 
-    // Write changes to disk
-    if (write_cluster(result.parent_cluster, &parent_dir_content) != 0) return -1;
-    for (uint16_t i = 0; i < FAT_CLUSTER_COUNT; ++i) { // Persist FAT
-        if (write_cluster(FAT_CLUSTER_START + i, (uint8_t*)g_fat_table + (i * CLUSTER_SIZE)) != 0) return -1;
+    if ((uint32_t)start + count > vol->cluster_count) {
+        fprintf(stderr, "Error: Attempt to read invalid clusters (%u-%u).\n", start, start + count - 1);
+        return -1;
     }
 
-    printf("Removed '%s'.\n", path);
-    return 0;
-}
+    if (vol->map != NULL) {
+        for (uint32_t i = 0; i < count; ++i) {
+            memcpy(buffers[i], vol->map + ((size_t)(start + i) * vol->cluster_size), vol->cluster_size);
+        }
+        return 0; // Success
+    }
 
-int fs_read(const char* path) {
-    path_search_result_t result;
-    if (find_entry_by_path(path, &result) != 0 || !result.found) {
-        fprintf(stderr, "read: cannot read '%s': No such file or directory\n", path);
+    pthread_mutex_lock(&vol->cache_lock);
+    if (ensure_cache(vol) != 0) {
+        pthread_mutex_unlock(&vol->cache_lock);
         return -1;
     }
-    if (result.entry.attributes != ATTR_ARCHIVE) {
-        fprintf(stderr, "read: cannot read '%s': Not a file\n", path);
-        return -1;
+
+    // Cached clusters are copied from memory (they may be newer than the disk).
+    // Each uncached stretch in between is read with a single vectored read and is
+    // not installed in the cache, so large sequential reads don't evict hot clusters.
+    // The lock is dropped during those reads: a cluster that isn't cached has no newer
+    // copy, and only a writer holding its directory's lock could create one.
+    int status = 0;
+    uint32_t i = 0;
+    while (i < count && status == 0) {
+        cache_slot_t* slot = cache_lookup(&vol->cache, start + i);
+        if (slot != NULL) {
+            memcpy(buffers[i], slot->data, vol->cluster_size);
+            i++;
+            continue;
+        }
+
+        uint32_t run_start = i++;
+        while (i < count && cache_peek(&vol->cache, start + i) == NULL) {
+            vol->cache.stats.misses++;
+            i++;
+        }
+        pthread_mutex_unlock(&vol->cache_lock);
+        status = bdev_readv(vol->dev, start + run_start, i - run_start, buffers + run_start);
+        pthread_mutex_lock(&vol->cache_lock);
     }
+    pthread_mutex_unlock(&vol->cache_lock);
+    return status;
+}
 
-    uint8_t buffer[CLUSTER_SIZE];
-    uint16_t current_cluster = result.entry.first_block;
-    uint32_t bytes_to_read = result.entry.size;
+int read_clusters(fat_volume_t* vol, uint16_t start, uint32_t count, void* buffer) {
+    uint8_t* bytes = (uint8_t*)buffer;
+    while (count > 0) {
+        uint32_t batch = (count > IO_BATCH_CLUSTERS) ? IO_BATCH_CLUSTERS : count;
+        void* buffers[IO_BATCH_CLUSTERS];
+        for (uint32_t i = 0; i < batch; ++i) {
+            buffers[i] = bytes + ((size_t)i * vol->cluster_size);
+        }
+        if (read_clusters_v(vol, start, batch, buffers) != 0) return -1;
 
-    while (bytes_to_read > 0 && current_cluster < FAT_ENTRY_EOF) {
-        if (read_cluster(current_cluster, buffer) != 0) return -1;
-        uint32_t len = (bytes_to_read > CLUSTER_SIZE) ? CLUSTER_SIZE : bytes_to_read;
-        fwrite(buffer, 1, len, stdout);
-        bytes_to_read -= len;
-        current_cluster = g_fat_table[current_cluster];
+        start += batch;
+        count -= batch;
+        bytes += (size_t)batch * vol->cluster_size;
     }
-    printf("\n");
-    return 0;
+    return 0; // Success
 }
 
-int fs_write(const char* path, const char* content) {
-    path_search_result_t result;
-    if (find_entry_by_path(path, &result) != 0 || !result.found || result.entry.attributes != ATTR_ARCHIVE) {
-        fprintf(stderr, "write: cannot write to '%s': No such file or not a file\n", path);
+int write_clusters_v(fat_volume_t* vol, uint16_t start, uint32_t count, const void* const* buffers) {
+    if ((uint32_t)start + count > vol->cluster_count) {
+        fprintf(stderr, "Error: Attempt to write to invalid clusters (%u-%u).\n", start, start + count - 1);
         return -1;
     }
 
-    // Free existing content
-    free_cluster_chain(result.entry.first_block);
+    // The clusters are staged in the cache; writeback_run() later gathers
+    // the adjacent dirty clusters into a single pwritev.
+    for (uint32_t i = 0; i < count; ++i) {
+        if (write_cluster(vol, start + i, buffers[i]) != 0) return -1;
+    }
+    return 0; // Success
+}
 
-    // Allocate new content
-    uint32_t content_len = strlen(content);
-    uint16_t current_cluster = 0;
-    uint16_t first_cluster = 0;
+int write_clusters(fat_volume_t* vol, uint16_t start, uint32_t count, const void* buffer) {
+    const uint8_t* bytes = (const uint8_t*)buffer;
+    while (count > 0) {
+        uint32_t batch = (count > IO_BATCH_CLUSTERS) ? IO_BATCH_CLUSTERS : count;
+        const void* buffers[IO_BATCH_CLUSTERS];
+        for (uint32_t i = 0; i < batch; ++i) {
+            buffers[i] = bytes + ((size_t)i * vol->cluster_size);
+        }
+        if (write_clusters_v(vol, start, batch, buffers) != 0) return -1;
+
+        start += batch;
+        count -= batch;
+        bytes += (size_t)batch * vol->cluster_size;
+    }
+    return 0; // Success
+}
+
+// --- Journal ---
+// On an image formatted with a journal, the metadata an operation changes (directory
+// clusters and FAT clusters) is logged as one record before any of it is written home, so
+// that after a crash every operation is either done or not. File data isn't logged: it goes
+// through the cache as before, so a crash may leave a file with older data in clusters its
+// entry already covers, but the directory tree and the FAT always agree.
+//
+// Operations that finish at the same time share one record and one flush (group commit):
+// the first of them to find the journal free becomes the leader, writes a record for every
+// transaction queued, installs their clusters in the cache and wakes the others. A background
+// thread later writes the cache home and empties the log (checkpoint).
+
+#define TRANSACTION_MIN_IMAGES 4 // Staged images allocated by the first directory write
+
+static bool test_bit(const uint64_t* bits, uint32_t index) {
+    return (bits[index / 64] & (1ull << (index % 64))) != 0;
+}
+
+static void set_bit(uint64_t* bits, uint32_t index) {
+    bits[index / 64] |= 1ull << (index % 64);
+}
+
+// Returns the calling thread's transaction on 'vol' (its open batch, or the operation it
+// is running), or NULL. An operation that a callback (e.g. the source of fs_write_stream)
+// runs on another volume is written in place.
+static transaction_t* current_transaction(fat_volume_t* vol) {
+    if (t_batch == vol && vol->batch != NULL) {
+        return vol->batch;
+    }
+    transaction_t* tx = t_current;
+    return (tx != NULL && tx->vol == vol) ? tx : NULL;
+}
+
+static const void* staged_image(fat_volume_t* vol, uint16_t cluster_index) {
+    transaction_t* tx = current_transaction(vol);
+    if (tx == NULL || !test_bit(tx->staged, cluster_index)) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < tx->image_count; ++i) {
+        if (tx->image_clusters[i] == cluster_index) {
+            return tx->images + (size_t)i * vol->cluster_size;
+        }
+    }
+    return NULL;
+}
+
+// Writes a directory cluster: into the calling thread's transaction when there is one,
+// otherwise straight to the cache. Called with the directory locked exclusively.
+static int write_meta(fat_volume_t* vol, uint16_t cluster_index, const void* buffer) {
+    transaction_t* tx = current_transaction(vol);
+    if (tx == NULL) {
+        return write_cluster(vol, cluster_index, buffer);
+    }
+
+    uint8_t* image = (uint8_t*)staged_image(vol, cluster_index);
+    if (image == NULL) {
+        if (tx->image_count == tx->image_capacity) {
+            uint32_t capacity = (tx->image_capacity == 0) ? TRANSACTION_MIN_IMAGES : tx->image_capacity * 2;
+            uint16_t* clusters = realloc(tx->image_clusters, capacity * sizeof(uint16_t));
+            if (clusters != NULL) tx->image_clusters = clusters;
+            uint8_t* images = (clusters != NULL) ? realloc(tx->images, (size_t)capacity * vol->cluster_size) : NULL;
+            if (images == NULL) {
+                fprintf(stderr, "Error: Could not stage cluster %u for the journal.\n", cluster_index);
+                return -1;
+            }
+            tx->images = images;
+            tx->image_capacity = capacity;
+        }
+        image = tx->images + (size_t)tx->image_count * vol->cluster_size;
+        tx->image_clusters[tx->image_count++] = cluster_index;
+        set_bit(tx->staged, cluster_index);
+    }
+    memcpy(image, buffer, vol->cluster_size);
+    tx->dirty = true;
+    return 0;
+}
+
+// Marks the clusters of a directory that is being removed: they may hold file data next,
+// and older images of them in the log must not be replayed over it.
+static void revoke_chain(fat_volume_t* vol, uint16_t first_cluster) {
+    transaction_t* tx = current_transaction(vol);
+    if (tx == NULL) return;
+    for (uint16_t cluster = first_cluster; cluster != 0 && cluster < FAT_ENTRY_EOF; cluster = vol->fat[cluster]) {
+        if (!test_bit(tx->revoked, cluster)) {
+            set_bit(tx->revoked, cluster);
+            tx->revoke_count++;
+        }
+    }
+    tx->dirty = true;
+}
+
+static void reset_transaction(transaction_t* tx, fat_volume_t* vol) {
+    size_t bitmap_bytes = vol->cluster_words * sizeof(uint64_t);
+    memset(tx->fat_touched, 0, bitmap_bytes);
+    memset(tx->staged, 0, bitmap_bytes);
+    memset(tx->revoked, 0, bitmap_bytes);
+    memset(tx->fat_clusters, 0, sizeof(tx->fat_clusters));
+    tx->vol = vol;
+    tx->revoke_count = 0;
+    tx->fat_cluster_count = 0;
+    tx->image_count = 0;
+    tx->operations = 0;
+    tx->dirty = false;
+}
+
+static void release_images(transaction_t* tx) {
+    free(tx->images);
+    free(tx->image_clusters);
+    tx->images = NULL;
+    tx->image_clusters = NULL;
+    tx->image_capacity = 0;
+}
+
+// Starts collecting the changes of the calling thread's operation, if the image has a
+// journal and the thread has no batch open on it. Returns -1 (after reporting it) if a
+// commit has failed, as the operation could build on changes that were never committed.
+// Called with state_lock held and the directory to change locked exclusively.
+static int begin_transaction(fat_volume_t* vol) {
+    if (!vol->journaled) {
+        return 0;
+    }
+    if (__atomic_load_n(&vol->journal_failed, __ATOMIC_ACQUIRE)) {
+        fprintf(stderr, "Error: A journal commit failed; load the image again before changing it.\n");
+        return -1;
+    }
+    if (t_current != NULL || current_transaction(vol) != NULL) {
+        return 0;
+    }
+    reset_transaction(&t_transaction, vol);
+    t_transaction.batch = false;
+    t_current = &t_transaction;
+    return 0;
+}
+
+// Called when metadata can't be committed. The operations that changed it are failed, but
+// their changes to the in-memory FAT stay, so from then on every change is refused:
+// fs_load_fat() and fs_format() read the image again and start over. Nothing that wasn't
+// committed reaches the disk meanwhile, as only committed clusters are installed in the cache.
+static void fail_journal(fat_volume_t* vol) {
+    if (!__atomic_exchange_n(&vol->journal_failed, true, __ATOMIC_ACQ_REL)) {
+        fprintf(stderr, "Error: Metadata could not be committed; changes are refused until the image is loaded again.\n");
+    }
+    dcache_clear(&vol->dcache); // It may remember names that were never committed
+}
+
+// Writes every dirty cluster home and flushes, then empties the log, since everything it
+// holds is now at its home location. Called by the owner of the journal, or with
+// state_lock held exclusively.
+static int checkpoint_journal(fat_volume_t* vol) {
+    if (write_back_cache(vol) != 0 || flush_device(vol) != 0) {
+        return -1;
+    }
+    if (!vol->journaled || vol->dev == NULL || vol->journal.used == 0) {
+        return 0;
+    }
+    if (journal_checkpoint(&vol->journal, vol->dev) != 0 || flush_device(vol) != 0) {
+        fprintf(stderr, "Error: Could not empty the journal.\n");
+        return -1;
+    }
+    __atomic_add_fetch(&vol->journal_stats.checkpoints, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Appends a record and flushes it, emptying the log first if it has no room.
+// Returns the number of clusters written, or 0 if the record couldn't be logged.
+// Called by the owner of the journal.
+static uint32_t log_record(fat_volume_t* vol, const uint16_t* homes, const void* const* images, uint32_t image_count,
+                           const uint16_t* revokes, uint32_t revoke_count) {
+    uint32_t clusters = journal_record_clusters(vol->cluster_size, image_count, revoke_count);
+    if (clusters > vol->journal.length) {
+        fprintf(stderr, "Error: %u clusters of metadata don't fit in the journal.\n", clusters);
+        return 0;
+    }
+    if (clusters > vol->journal.length - vol->journal.used && checkpoint_journal(vol) != 0) {
+        return 0;
+    }
+    if (journal_append(&vol->journal, vol->dev, homes, images, image_count, revokes, revoke_count) != 0 ||
+        flush_device(vol) != 0) {
+        fprintf(stderr, "Error: Could not commit to the journal.\n");
+        return 0;
+    }
+    return clusters;
+}
+
+// Discards a run of clusters freed by committed transactions and makes them available.
+static void release_clusters(fat_volume_t* vol, uint32_t start, uint32_t count) {
+    discard_clusters(vol, (uint16_t)start, count);
+    for (uint32_t i = start; i < start + count; ++i) {
+        alloc_mark_free(&vol->alloc, i);
+    }
+}
+
+// Logs the changes of a batch of transactions as one record, then installs them: the
+// directory and FAT clusters go to the cache, and the clusters the batch freed become
+// available. If the record can't be logged (including a record larger than the journal),
+// nothing is installed and the journal is failed. Returns the number of clusters logged,
+// or 0 if the batch failed. Called by the owner of the journal, without journal_lock.
+static uint32_t commit_batch(fat_volume_t* vol, transaction_t* batch) {
+    if (__atomic_load_n(&vol->journal_failed, __ATOMIC_ACQUIRE)) {
+        return 0; // Queued before the failure; it may build on the changes that were lost
+    }
+
+    // The FAT entries the batch changed are copied to the committed FAT, and the FAT clusters
+    // holding them are logged from there: they never carry changes of operations that
+    // haven't committed yet.
+    bool* fat_changed = vol->commit_fat_changed;
+    uint64_t* revoked = vol->commit_clusters;
+    memset(fat_changed, 0, vol->fat_clusters * sizeof(bool));
+    memset(revoked, 0, vol->cluster_words * sizeof(uint64_t));
+    uint32_t max_images = vol->fat_clusters;
+    uint32_t max_revokes = 0;
+    for (transaction_t* tx = batch; tx != NULL; tx = tx->next) {
+        for (uint32_t w = 0; w < vol->cluster_words; ++w) {
+            revoked[w] |= tx->revoked[w];
+            for (uint64_t bits = tx->fat_touched[w]; bits != 0; bits &= bits - 1) {
+                uint32_t i = w * 64 + (uint32_t)__builtin_ctzll(bits);
+                vol->disk_fat[i] = vol->fat[i];
+                fat_changed[i / vol->fat_entries] = true;
+            }
+        }
+        max_images += tx->image_count;
+        max_revokes += tx->revoke_count;
+    }
+
+    // Freed directory clusters are revoked instead of logged
+    uint16_t* homes = malloc(max_images * sizeof(uint16_t));
+    const void** images = malloc(max_images * sizeof(void*));
+    uint16_t* revokes = malloc((max_revokes + 1) * sizeof(uint16_t));
+    uint32_t logged = 0;
+    if (homes != NULL && images != NULL && revokes != NULL) {
+        uint32_t image_count = 0;
+        for (transaction_t* tx = batch; tx != NULL; tx = tx->next) {
+            for (uint32_t i = 0; i < tx->image_count; ++i) {
+                if (!test_bit(revoked, tx->image_clusters[i])) {
+                    homes[image_count] = tx->image_clusters[i];
+                    images[image_count++] = tx->images + (size_t)i * vol->cluster_size;
+                }
+            }
+        }
+        for (uint32_t i = 0; i < vol->fat_clusters; ++i) {
+            if (fat_changed[i]) {
+                homes[image_count] = (uint16_t)(FAT_CLUSTER_START + i);
+                images[image_count++] = (const uint8_t*)vol->disk_fat + (size_t)i * vol->cluster_size;
+            }
+        }
+        uint32_t r = 0;
+        for (uint32_t w = 0; w < vol->cluster_words; ++w) {
+            for (uint64_t bits = revoked[w]; bits != 0; bits &= bits - 1) {
+                revokes[r++] = (uint16_t)(w * 64 + (uint32_t)__builtin_ctzll(bits));
+            }
+        }
+        logged = log_record(vol, homes, images, image_count, revokes, r);
+    } else {
+        fprintf(stderr, "Error: Could not allocate a journal record.\n");
+    }
+    free(homes);
+    free(images);
+    free(revokes);
+    if (logged == 0) {
+        fail_journal(vol);
+        return 0;
+    }
+
+    for (transaction_t* tx = batch; tx != NULL; tx = tx->next) {
+        for (uint32_t i = 0; i < tx->image_count; ++i) {
+            if (!test_bit(revoked, tx->image_clusters[i]) &&
+                write_cluster(vol, tx->image_clusters[i], tx->images + (size_t)i * vol->cluster_size) != 0) {
+                fprintf(stderr, "Error writing directory cluster #%u\n", tx->image_clusters[i]);
+            }
+        }
+    }
+    for (uint32_t i = 0; i < vol->fat_clusters; ++i) {
+        if (fat_changed[i] && write_cluster(vol, (uint16_t)(FAT_CLUSTER_START + i), (const uint8_t*)vol->disk_fat + (size_t)i * vol->cluster_size) != 0) {
+            fprintf(stderr, "Error writing FAT cluster #%u\n", FAT_CLUSTER_START + i);
+        }
+    }
+
+    // The clusters the batch freed are discarded, a run of adjacent ones at a time, and
+    // only then become available. The revoked clusters are no longer needed: their bitmap
+    // is reused.
+    uint64_t* freed = vol->commit_clusters;
+    memset(freed, 0, vol->cluster_words * sizeof(uint64_t));
+    for (transaction_t* tx = batch; tx != NULL; tx = tx->next) {
+        for (uint32_t w = 0; w < vol->cluster_words; ++w) {
+            for (uint64_t bits = tx->fat_touched[w]; bits != 0; bits &= bits - 1) {
+                uint32_t i = w * 64 + (uint32_t)__builtin_ctzll(bits);
+                if (vol->disk_fat[i] == FAT_ENTRY_FREE) set_bit(freed, i);
+            }
+        }
+    }
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    for (uint32_t w = 0; w < vol->cluster_words; ++w) {
+        for (uint64_t bits = freed[w]; bits != 0; bits &= bits - 1) {
+            uint32_t i = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            if (run_length > 0 && i == run_start + run_length) {
+                run_length++;
+                continue;
+            }
+            release_clusters(vol, run_start, run_length);
+            run_start = i;
+            run_length = 1;
+        }
+    }
+    release_clusters(vol, run_start, run_length);
+    return logged;
+}
+
+// Takes the oldest transactions off the commit queue, as many as one record can hold.
+// Called with journal_lock held.
+static transaction_t* take_batch(fat_volume_t* vol) {
+    transaction_t* batch = vol->commit_queue;
+    transaction_t* last = batch;
+    uint32_t fat_images = last->fat_cluster_count; // At most, as transactions may share FAT clusters
+    uint32_t images = last->image_count;
+    uint32_t revokes = last->revoke_count;
+    while (last->next != NULL) {
+        transaction_t* next = last->next;
+        uint32_t next_fat_images = fat_images + next->fat_cluster_count;
+        if (next_fat_images > vol->fat_clusters) next_fat_images = vol->fat_clusters;
+        if (journal_record_clusters(vol->cluster_size, next_fat_images + images + next->image_count, revokes + next->revoke_count) > vol->journal.length) {
+            break;
+        }
+        fat_images = next_fat_images;
+        images += next->image_count;
+        revokes += next->revoke_count;
+        last = next;
+    }
+
+    vol->commit_queue = last->next;
+    if (vol->commit_queue == NULL) {
+        vol->commit_queue_end = &vol->commit_queue;
+    }
+    last->next = NULL;
+    return batch;
+}
+
+// Queues a transaction and returns once it is committed, by the calling thread if the
+// journal is free (taking along everything queued meanwhile) or by another leader.
+// Returns 0, or -1 if the record holding it failed.
+static int group_commit(fat_volume_t* vol, transaction_t* tx) {
+    pthread_mutex_lock(&vol->journal_lock);
+    tx->next = NULL;
+    tx->done = false;
+    *vol->commit_queue_end = tx;
+    vol->commit_queue_end = &tx->next;
+
+    while (!tx->done) {
+        if (vol->journal_busy) {
+            pthread_cond_wait(&vol->journal_cond, &vol->journal_lock);
+            continue;
+        }
+        vol->journal_busy = true;
+        transaction_t* batch = take_batch(vol);
+        pthread_mutex_unlock(&vol->journal_lock);
+        uint32_t logged = commit_batch(vol, batch);
+        pthread_mutex_lock(&vol->journal_lock);
+
+        uint64_t operations = 0;
+        while (batch != NULL) {
+            transaction_t* next = batch->next;
+            operations += batch->operations;
+            batch->status = (logged > 0) ? 0 : -1;
+            batch->done = true; // Its thread reuses it once journal_lock is released
+            batch = next;
+        }
+        if (logged > 0) {
+            __atomic_add_fetch(&vol->journal_stats.operations, operations, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&vol->journal_stats.commits, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&vol->journal_stats.clusters, logged, __ATOMIC_RELAXED);
+        }
+        if (vol->journal.used * 2 >= vol->journal.length) {
+            pthread_cond_signal(&vol->checkpoint_cond);
+        }
+        vol->journal_busy = false;
+        pthread_cond_broadcast(&vol->journal_cond);
+    }
+    int status = tx->status;
+    pthread_mutex_unlock(&vol->journal_lock);
+    return status;
+}
+
+// Commits everything the calling thread's batch collected so far and starts it over.
+// The data it wrote goes home first, so that no committed entry covers clusters whose
+// contents never reached the disk: if that fails, nothing is committed.
+// Returns 0, or -1 if the data or the record failed. Called by the thread with the batch open.
+static int commit_open_batch(fat_volume_t* vol) {
+    int status = (write_back_cache(vol) == 0 && flush_device(vol) == 0) ? 0 : -1;
+    transaction_t* tx = vol->batch;
+    if (tx == NULL) {
+        return status; // No journal: the changes were written in place and are now on disk
+    }
+    if (__atomic_load_n(&vol->journal_failed, __ATOMIC_ACQUIRE)) {
+        status = -1; // An automatic commit of the batch failed, and the rest was refused
+    } else if (tx->operations > 0) {
+        if (status != 0) {
+            fprintf(stderr, "Error: Could not write the batch's data before its metadata.\n");
+            fail_journal(vol);
+        } else {
+            status = group_commit(vol, tx);
+        }
+    }
+    release_images(tx);
+    reset_transaction(tx, vol);
+    return status;
+}
+
+// Ends the calling thread's operation. Its transaction is committed if it changed
+// anything, before the operation releases its locks, so nobody sees the changes before
+// they are logged. In a batch, the changes stay staged until fs_batch_commit(), unless
+// the batch has grown so large that its record might no longer fit in the journal.
+// Returns 0, or -1 if the commit failed: the operation then failed as a whole.
+static int end_transaction(fat_volume_t* vol) {
+    transaction_t* tx = current_transaction(vol);
+    if (tx == NULL) {
+        return 0;
+    }
+    if (tx->dirty) {
+        tx->operations++;
+        tx->dirty = false;
+    }
+    if (tx->batch) {
+        if (journal_record_clusters(vol->cluster_size, tx->fat_cluster_count + tx->image_count, tx->revoke_count) * 2 > vol->journal.length) {
+            return commit_open_batch(vol);
+        }
+        return 0;
+    }
+    t_current = NULL;
+    int status = 0;
+    if (tx->operations > 0) {
+        // In strict mode the file data goes first; metadata covering data that may not be
+        // on the disk is never committed
+        if (vol->durability == FS_DURABILITY_STRICT && sync_volume(vol) != 0) {
+            fprintf(stderr, "Error: Could not write the file data before its metadata.\n");
+            fail_journal(vol);
+            status = -1;
+        } else {
+            status = group_commit(vol, tx);
+        }
+    }
+    release_images(tx);
+    return status;
+}
+
+// Background checkpoint: empties the log when a commit finds it half full, or after
+// CHECKPOINT_INTERVAL_MS if anything was logged, so that commits seldom have to wait for one.
+static void* checkpoint_main(void* arg) {
+    fat_volume_t* vol = (fat_volume_t*)arg;
+    pthread_mutex_lock(&vol->journal_lock);
+    while (!vol->checkpointer_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CHECKPOINT_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (CHECKPOINT_INTERVAL_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&vol->checkpoint_cond, &vol->journal_lock, &deadline);
+        if (vol->checkpointer_stop) break;
+        pthread_mutex_unlock(&vol->journal_lock);
+
+        // state_lock comes first; it keeps the device and the journal in place
+        pthread_rwlock_rdlock(&vol->state_lock);
+        pthread_mutex_lock(&vol->journal_lock);
+        while (vol->journal_busy) {
+            pthread_cond_wait(&vol->journal_cond, &vol->journal_lock);
+        }
+        if (vol->journaled && vol->journal.used > 0) {
+            vol->journal_busy = true;
+            pthread_mutex_unlock(&vol->journal_lock);
+            checkpoint_journal(vol);
+            pthread_mutex_lock(&vol->journal_lock);
+            vol->journal_busy = false;
+            pthread_cond_broadcast(&vol->journal_cond);
+        }
+        pthread_mutex_unlock(&vol->journal_lock);
+        pthread_rwlock_unlock(&vol->state_lock);
+        pthread_mutex_lock(&vol->journal_lock);
+    }
+    pthread_mutex_unlock(&vol->journal_lock);
+    return NULL;
+}
+
+// Called with state_lock held exclusively.
+static void start_checkpointer(fat_volume_t* vol) {
+    if (vol->checkpointer_running) {
+        return;
+    }
+    vol->checkpointer_stop = false;
+    if (pthread_create(&vol->checkpointer, NULL, checkpoint_main, vol) != 0) {
+        fprintf(stderr, "Warning: Could not start the background checkpoint; commits will empty the journal when it fills.\n");
+        return;
+    }
+    vol->checkpointer_running = true;
+}
+
+static void stop_checkpointer(fat_volume_t* vol) {
+    if (!vol->checkpointer_running) {
+        return;
+    }
+    pthread_mutex_lock(&vol->journal_lock);
+    vol->checkpointer_stop = true;
+    pthread_cond_signal(&vol->checkpoint_cond);
+    pthread_mutex_unlock(&vol->journal_lock);
+    pthread_join(vol->checkpointer, NULL);
+    vol->checkpointer_running = false;
+}
+
+// journal_apply_fn_t that writes a replayed cluster through the cache.
+static int replay_cluster(void* context, uint16_t cluster, const void* image) {
+    return write_cluster((fat_volume_t*)context, cluster, image);
+}
+
+// Opens the journal the superblock describes, replays the operations committed to it and
+// empties it. Images formatted without a journal are used as before.
+// Called with state_lock held exclusively.
+static int open_journal(fat_volume_t* vol) {
+    vol->journaled = false;
+    if (vol->journal_clusters == 0) {
+        return 0; // Formatted before the journal existed: metadata is written in place
+    }
+    if (journal_open(&vol->journal, vol->dev, vol->journal_start, vol->journal_clusters) != 0) {
+        fprintf(stderr, "Error: Could not open the journal.\n");
+        return -1;
+    }
+
+    int replayed = journal_replay(&vol->journal, vol->dev, replay_cluster, vol);
+    if (replayed < 0) {
+        fprintf(stderr, "Error: Could not replay the journal.\n");
+        return -1;
+    }
+    if (replayed > 0) {
+        printf("Replayed %d journal records.\n", replayed);
+    }
+    vol->journaled = true;
+    if (checkpoint_journal(vol) != 0) {
+        return -1;
+    }
+    start_checkpointer(vol);
+    return 0;
+}
+
+int fs_batch_begin(fat_volume_t* vol) {
+    if (t_batch != NULL) {
+        fprintf(stderr, "begin: a batch is already open\n");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&vol->state_lock);
+    if (vol->journaled) {
+        vol->batch = calloc(1, sizeof(transaction_t));
+        if (vol->batch == NULL) {
+            pthread_rwlock_unlock(&vol->state_lock);
+            fprintf(stderr, "Error: Could not allocate a batch.\n");
+            return -1;
+        }
+        reset_transaction(vol->batch, vol);
+        vol->batch->batch = true;
+    }
+    t_batch = vol;
+    return 0;
+}
+
+int fs_batch_commit(fat_volume_t* vol) {
+    if (t_batch != vol) {
+        fprintf(stderr, "commit: no batch is open\n");
+        return -1;
+    }
+    int status = commit_open_batch(vol);
+    free(vol->batch);
+    vol->batch = NULL;
+    t_batch = NULL;
+    pthread_rwlock_unlock(&vol->state_lock);
+    return status;
+}
+
+void fs_get_journal_stats(fat_volume_t* vol, journal_stats_t* stats) {
+    stats->operations = __atomic_load_n(&vol->journal_stats.operations, __ATOMIC_RELAXED);
+    stats->commits = __atomic_load_n(&vol->journal_stats.commits, __ATOMIC_RELAXED);
+    stats->clusters = __atomic_load_n(&vol->journal_stats.clusters, __ATOMIC_RELAXED);
+    stats->checkpoints = __atomic_load_n(&vol->journal_stats.checkpoints, __ATOMIC_RELAXED);
+}
+
+// Writes a cluster of 'fill' bytes that starts with the 'header_size' bytes at 'header'.
+static int write_filled_cluster(fat_volume_t* vol, uint16_t cluster_index, uint8_t fill, const void* header, size_t header_size) {
+    union data_cluster* buffer = alloc_clusters(vol, 1);
+    if (buffer == NULL) return -1;
+    memset(buffer, fill, vol->cluster_size);
+    if (header_size > 0) memcpy(buffer, header, header_size);
+    int status = write_cluster(vol, cluster_index, buffer);
+    free(buffer);
+    return status;
+}
+
+// Called with state_lock held exclusively.
+static int format_volume(fat_volume_t* vol, const fs_geometry_t* requested) {
+    // Our own partition file is recreated: this creates the file if it doesn't exist,
+    // or truncates it if it does, and sizes it to cluster_size * cluster_count bytes.
+    // A device attached by the caller is formatted in place instead.
+    bool in_place = (vol->dev != NULL && !vol->dev_owned);
+    fs_geometry_t geometry;
+    int planned;
+    if (requested != NULL) {
+        planned = plan_geometry(requested->cluster_size, requested->cluster_count, &geometry);
+    } else if (in_place) {
+        planned = device_geometry(vol->dev, &geometry);
+    } else {
+        planned = plan_geometry(FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT, &geometry);
+    }
+    if (planned != 0) {
+        return -1;
+    }
+    if (in_place && (vol->dev->block_size != geometry.cluster_size || vol->dev->block_count < geometry.cluster_count)) {
+        fprintf(stderr, "Error: A device of %u blocks of %u bytes can't hold %u clusters of %u bytes.\n",
+                vol->dev->block_count, vol->dev->block_size, geometry.cluster_count, geometry.cluster_size);
+        return -1;
+    }
+
+    lose_open_files(vol); // Their files are about to disappear
+    vol->journaled = false; // Until the new journal is written
+    vol->journal_failed = false;
+    if (in_place) {
+        use_device(vol, vol->dev, false); // Whatever was cached belongs to the old image
+        if (set_geometry(vol, &geometry) != 0) return -1;
+    } else {
+        release_device(vol);
+        if (set_geometry(vol, &geometry) != 0) return -1;
+        block_dev_t* dev = open_partition(vol, true);
+        if (dev == NULL) {
+            fprintf(stderr, "Error creating or truncating partition file '%s': %s\n", vol->path, strerror(errno));
+            return -1;
+        }
+        use_device(vol, dev, true);
+    }
+
+    // 1. Prepare an in-memory FAT
+    printf("Formatting file system...\n");
+    //memset is used to fill the FAT table with specific values.
+    // FAT_ENTRY_FREE is 0x0000, meaning the cluster is free.
+    // FAT_ENTRY_BOOT is 0xFFF8, meaning it's the Boot Block.
+    // FAT_ENTRY_RESERVED is 0xFFF0, meaning it's reserved for the FAT itself
+    // FAT_ENTRY_EOF is 0xFFFF, meaning it's the end of a file chain.
+    size_t fat_bytes = (size_t)vol->fat_clusters * vol->cluster_size;
+    memset(vol->fat, FAT_ENTRY_FREE, fat_bytes); // Fill with 0x0000
+
+    fat_set(vol, BOOT_BLOCK_CLUSTER, FAT_ENTRY_BOOT);         // 0 is the Boot Block
+    for (uint32_t i = FAT_CLUSTER_START; i < vol->root_dir; ++i) {
+        fat_set(vol, (uint16_t)i, FAT_ENTRY_RESERVED);        // Then the clusters reserved for the FAT itself
+    }
+    fat_set(vol, vol->root_dir, FAT_ENTRY_EOF);               // The Root Directory (and it's the end of its chain)
+    for (uint32_t i = vol->journal_start; i < vol->cluster_count; ++i) {
+        fat_set(vol, (uint16_t)i, FAT_ENTRY_RESERVED);        // The journal takes the last clusters
+    }
+    if (rebuild_free_bitmap(vol) != 0) return -1;
+
+    // 2. Prepare the superblock: the geometry, then 0xBB up to the end of the cluster
+    boot_block_t boot;
+    memcpy(boot.magic, SUPERBLOCK_MAGIC, sizeof(boot.magic));
+    boot.journal_start = (uint16_t)vol->journal_start;
+    boot.journal_clusters = (uint16_t)vol->journal_clusters;
+    boot.cluster_size = vol->cluster_size;
+    boot.cluster_count = vol->cluster_count;
+    boot.fat_clusters = (uint16_t)vol->fat_clusters;
+    boot.root_dir_cluster = vol->root_dir;
+
+    // 3. Write everything to the virtual disk file
+    printf("Writing Boot Block...\n");
+    if (write_filled_cluster(vol, BOOT_BLOCK_CLUSTER, 0xBB, &boot, sizeof(boot)) != 0) {
+        fprintf(stderr, "Error writing boot block.\n");
+        return -1;
+    }
+
+    printf("Writing File Allocation Table (FAT)...\n");
+    // The FAT is fat_clusters long. We write it from our in-memory vol->fat.
+    // The memset above touched every entry, so every FAT cluster is dirty.
+    for (uint32_t i = 0; i < vol->fat_clusters; ++i) {
+        vol->fat_dirty[i] = true;
+    }
+    if (flush_fat(vol) != 0) {
+        return -1;
+    }
+
+    printf("Writing Root Directory...\n"); // Empty
+    if (write_filled_cluster(vol, vol->root_dir, 0x00, NULL, 0) != 0) {
+        fprintf(stderr, "Error writing root directory.\n");
+        return -1;
+    }
+
+    // We don't need to write the data area: a new file is implicitly empty,
+    // and an attached device is told that its old contents are no longer needed.
+    if (in_place && bdev_discard(vol->dev, vol->data_start, vol->journal_start - vol->data_start) != 0) {
+        fprintf(stderr, "Error discarding the data area.\n");
+        return -1;
+    }
+
+    printf("Writing Journal...\n");
+    if (journal_format(vol->dev, vol->journal_start, vol->journal_clusters) != 0 ||
+        journal_open(&vol->journal, vol->dev, vol->journal_start, vol->journal_clusters) != 0) {
+        fprintf(stderr, "Error writing the journal.\n");
+        return -1;
+    }
+
+    // The boot block, FAT and root directory are still in the cache.
+    if (sync_volume(vol) != 0) {
+        fprintf(stderr, "Error flushing the new file system to disk.\n");
+        return -1;
+    }
+    memcpy(vol->disk_fat, vol->fat, fat_bytes);
+    vol->journaled = true;
+    start_checkpointer(vol);
+
+    unsigned long long size = (unsigned long long)vol->cluster_size * vol->cluster_count;
+    if (in_place) {
+        printf("Format complete. Device formatted with size %llu bytes.\n", size);
+    } else {
+        printf("Format complete. '%s' created with size %llu bytes.\n", vol->path, size);
+    }
+
+    return 0;
+}
+
+
+int fs_format(fat_volume_t* vol, const fs_geometry_t* geometry) {
+    if (refuse_in_batch(vol, "init")) return -1;
+    lock_state(vol, true);
+    int status = format_volume(vol, geometry);
+    unlock_state(vol);
+    return status;
+}
+
+// Switches to the geometry read from the superblock of the current device. A partition
+// file opened with another one is opened again; an attached device must fit it.
+// Called with state_lock held exclusively, after a checkpoint.
+static int use_geometry(fat_volume_t* vol, const fs_geometry_t* geometry) {
+    if (vol->dev->block_size == geometry->cluster_size && vol->dev->block_count >= geometry->cluster_count) {
+        return set_geometry(vol, geometry);
+    }
+    if (!vol->dev_owned) {
+        fprintf(stderr, "Error: The image has %u clusters of %u bytes, the device %u blocks of %u bytes.\n",
+                geometry->cluster_count, geometry->cluster_size, vol->dev->block_count, vol->dev->block_size);
+        return -1;
+    }
+    lose_open_files(vol);
+    release_device(vol);
+    if (set_geometry(vol, geometry) != 0) {
+        return -1;
+    }
+    block_dev_t* dev = open_partition(vol, false);
+    if (dev == NULL) {
+        fprintf(stderr, "Error: Could not reopen '%s'.\n", vol->path);
+        return -1;
+    }
+    use_device(vol, dev, true);
+    return 0;
+}
+
+// Called with state_lock held exclusively.
+static int load_fat(fat_volume_t* vol) {
+    printf("Loading FAT from disk...\n");
+
+    // Whatever the current journal holds reaches its home first; then the image's own
+    // journal (if any) is replayed, so that the FAT read below is complete.
+    fs_geometry_t geometry;
+    if (checkpoint_journal(vol) != 0 || read_superblock(vol, &geometry) != 0 || use_geometry(vol, &geometry) != 0 ||
+        open_journal(vol) != 0) {
+        return -1;
+    }
+    // The FAT spans adjacent clusters, read with vectored reads.
+    if (read_clusters(vol, FAT_CLUSTER_START, vol->fat_clusters, vol->fat) != 0) {
+        fprintf(stderr, "Error loading FAT clusters #%u-#%u\n", FAT_CLUSTER_START, FAT_CLUSTER_START + vol->fat_clusters - 1);
+        return -1;
+    }
+    memset(vol->fat_dirty, 0, vol->fat_clusters * sizeof(bool)); // The in-memory FAT now matches the disk
+    memcpy(vol->disk_fat, vol->fat, (size_t)vol->fat_clusters * vol->cluster_size);
+    if (rebuild_free_bitmap(vol) != 0) return -1;
+    drop_dir_indexes(vol); // Directories are indexed again from the loaded image
+    dcache_clear(&vol->dcache);
+    lose_open_files(vol);
+    vol->journal_failed = false; // Nothing in memory predates the image just read
+
+    printf("FAT loaded successfully.\n");
+    return 0;
+}
+
+int fs_load_fat(fat_volume_t* vol) {
+    if (refuse_in_batch(vol, "load")) return -1;
+    lock_state(vol, true);
+    int status = load_fat(vol);
+    unlock_state(vol);
+    return status;
+}
+
+// --- Path Components ---
+// Paths are walked in place: a component is a pointer into the caller's string plus a
+// length, so nothing is copied or modified and any number of threads can walk at once.
+
+// One component of a path. Not NUL-terminated.
+typedef struct {
+    const char* name;
+    size_t length;
+} path_component_t;
+
+// Position of a walk over a path's components.
+typedef struct {
+    const char* cursor;
+} path_iter_t;
+
+static void path_iter_init(path_iter_t* iter, const char* path) {
+    iter->cursor = path;
+}
+
+// Moves to the next component, skipping repeated slashes. Returns false at the end of the path.
+static bool path_iter_next(path_iter_t* iter, path_component_t* component) {
+    const char* start = iter->cursor;
+    while (*start == '/') start++;
+    if (*start == '\0') {
+        iter->cursor = start;
+        return false;
+    }
+    const char* end = start;
+    while (*end != '\0' && *end != '/') end++;
+    component->name = start;
+    component->length = (size_t)(end - start);
+    iter->cursor = end;
+    return true;
+}
+
+// True if a directory entry is named exactly 'length' characters at 'name'.
+// Names longer than an entry can hold never match, as with strcmp().
+static bool entry_has_name(const dir_entry_t* entry, const char* name, size_t length) {
+    return length < sizeof(entry->filename) && memcmp(entry->filename, name, length) == 0 &&
+           entry->filename[length] == '\0';
+}
+
+// --- Directory Index ---
+// Directories that span more than one cluster get an in-memory hash index from name to
+// cluster/entry, so a lookup reads a single directory cluster instead of the whole chain.
+// Single-cluster directories are scanned as before: that is one read either way.
+
+static void free_dir_index(dir_index_t* index) {
+    dir_index_destroy(index);
+    free(index);
+}
+
+// Forgets the index of one directory. Called with the directory locked exclusively,
+// or its parent, when the directory is being removed.
+static void drop_dir_index(fat_volume_t* vol, uint16_t dir_cluster) {
+    if (vol->dir_index[dir_cluster] != NULL) {
+        free_dir_index(vol->dir_index[dir_cluster]);
+        vol->dir_index[dir_cluster] = NULL;
+    }
+}
+
+// Forgets every index. Called with state_lock held exclusively.
+static void drop_dir_indexes(fat_volume_t* vol) {
+    for (uint32_t i = 0; i < vol->cluster_count; ++i) {
+        drop_dir_index(vol, (uint16_t)i);
+    }
+}
+
+// Adds every entry of a directory to 'index', reading its clusters through 'cluster_buffer'.
+static int fill_dir_index(fat_volume_t* vol, dir_index_t* index, uint16_t dir_cluster, union data_cluster* cluster_buffer) {
+    uint16_t current_cluster = dir_cluster;
+    while (current_cluster != 0 && current_cluster < FAT_ENTRY_EOF) {
+        const union data_cluster* dir = peek_clusters(vol, current_cluster, 1, cluster_buffer);
+        if (dir == NULL) {
+            return -1;
+        }
+        for (uint16_t i = 0; i < vol->dir_entries; ++i) {
+            if (dir->dir[i].filename[0] != 0x00 &&
+                dir_index_insert(index, dir_index_hash((const char*)dir->dir[i].filename, strlen((const char*)dir->dir[i].filename)), current_cluster, i) != 0) {
+                return -1;
+            }
+        }
+        current_cluster = vol->fat[current_cluster];
+    }
+    return 0;
+}
+
+// Reads every cluster of a directory into a new index. Returns NULL on error.
+static dir_index_t* build_dir_index(fat_volume_t* vol, uint16_t dir_cluster) {
+    dir_index_t* index = malloc(sizeof(dir_index_t));
+    if (index == NULL || dir_index_init(index, 0) != 0) {
+        free(index);
+        return NULL;
+    }
+
+    union data_cluster* cluster_buffer = alloc_clusters(vol, 1);
+    int status = (cluster_buffer != NULL) ? fill_dir_index(vol, index, dir_cluster, cluster_buffer) : -1;
+    free(cluster_buffer);
+    if (status != 0) {
+        free_dir_index(index);
+        return NULL;
+    }
+    return index;
+}
+
+// Returns the index of a directory, building it on first use, or NULL if the directory
+// is scanned instead. Called with the directory locked; a shared lock is enough, since
+// the contents can't change and concurrent builders publish with a compare-and-swap.
+static dir_index_t* get_dir_index(fat_volume_t* vol, uint16_t dir_cluster) {
+    if (!vol->dir_index_enabled || vol->fat[dir_cluster] >= FAT_ENTRY_EOF) {
+        return NULL; // Disabled, or a single-cluster directory
+    }
+    dir_index_t* index = __atomic_load_n(&vol->dir_index[dir_cluster], __ATOMIC_ACQUIRE);
+    if (index != NULL) {
+        return index;
+    }
+
+    index = build_dir_index(vol, dir_cluster);
+    if (index == NULL) {
+        return NULL; // Fall back to scanning
+    }
+    dir_index_t* published = NULL;
+    if (!__atomic_compare_exchange_n(&vol->dir_index[dir_cluster], &published, index,
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free_dir_index(index); // Another reader was faster
+        return published;
+    }
+    return index;
+}
+
+// Keeps an existing index in step with an entry that was just written or cleared.
+// If the index can't grow, it is dropped and the next lookup rebuilds it.
+// Called with the directory locked exclusively.
+static void index_entry_added(fat_volume_t* vol, uint16_t dir_cluster, const char* name, uint16_t slot_cluster, uint32_t entry_index) {
+    dir_index_t* index = vol->dir_index[dir_cluster];
+    if (index != NULL && dir_index_insert(index, dir_index_hash(name, strlen(name)), slot_cluster, (uint16_t)entry_index) != 0) {
+        drop_dir_index(vol, dir_cluster);
+    }
+}
+
+static void index_entry_removed(fat_volume_t* vol, uint16_t dir_cluster, const char* name, uint16_t slot_cluster, uint32_t entry_index) {
+    dir_index_t* index = vol->dir_index[dir_cluster];
+    if (index != NULL) {
+        dir_index_remove(index, dir_index_hash(name, strlen(name)), slot_cluster, (uint16_t)entry_index);
+    }
+}
+
+// Called with state_lock held exclusively.
+static void enable_dir_index(fat_volume_t* vol, bool enabled) {
+    vol->dir_index_enabled = enabled;
+    if (!enabled) {
+        drop_dir_indexes(vol);
+    }
+}
+
+void fs_set_dir_index(fat_volume_t* vol, bool enabled) {
+    lock_state(vol, true);
+    enable_dir_index(vol, enabled);
+    unlock_state(vol);
+}
+
+// --- Dentry Cache ---
+
+// Called with state_lock held exclusively.
+static void enable_dentry_cache(fat_volume_t* vol, bool enabled) {
+    vol->dcache_enabled = enabled;
+    dcache_clear(&vol->dcache);
+}
+
+void fs_set_dentry_cache(fat_volume_t* vol, bool enabled) {
+    lock_state(vol, true);
+    enable_dentry_cache(vol, enabled);
+    unlock_state(vol);
+}
+
+// Forgets what the cache knows about 'name' in a directory. Called with the directory
+// locked exclusively, whenever its entry for 'name' is added, changed or cleared.
+static void forget_name(fat_volume_t* vol, uint16_t dir_cluster, const char* name) {
+    dcache_forget(&vol->dcache, dir_cluster, name, strlen(name));
+}
+
+// --- Open Files ---
+
+static void free_extents(extent_map_t* extents) {
+    if (extents != NULL) {
+        extent_map_destroy(extents);
+        free(extents);
+    }
+}
+
+// Maps the whole chain of an open file. Returns NULL if memory runs out.
+static extent_map_t* build_extents(fat_volume_t* vol, const open_file_t* file) {
+    extent_map_t* extents = malloc(sizeof(extent_map_t));
+    if (extents == NULL || extent_map_init(extents) != 0) {
+        free(extents);
+        return NULL;
+    }
+    uint16_t current_cluster = file->first_cluster;
+    while (current_cluster != 0 && current_cluster < FAT_ENTRY_EOF) {
+        if (extent_map_append(extents, current_cluster) != 0) {
+            free_extents(extents);
+            return NULL;
+        }
+        current_cluster = vol->fat[current_cluster];
+    }
+    return extents;
+}
+
+// Returns the extent map of an open file, building it on first use.
+// Called with the file's directory locked.
+static const extent_map_t* get_extents(fat_volume_t* vol, open_file_t* file) {
+    extent_map_t* extents = __atomic_load_n(&file->extents, __ATOMIC_ACQUIRE);
+    if (extents != NULL) {
+        return extents;
+    }
+
+    // Readers may race to build it; the first one to publish wins
+    extents = build_extents(vol, file);
+    if (extents == NULL) return NULL;
+    extent_map_t* expected = NULL;
+    if (!__atomic_compare_exchange_n(&file->extents, &expected, extents, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free_extents(extents);
+        extents = expected;
+    }
+    return extents;
+}
+
+// Maps the clusters of 'chain', which was just linked after the last cluster of an open
+// file. A file whose map isn't built yet gets it later, from the whole chain.
+// Called with the file's directory locked exclusively.
+static void extend_extents(fat_volume_t* vol, open_file_t* file, uint16_t chain) {
+    extent_map_t* extents = file->extents;
+    if (extents == NULL) return;
+    while (chain != 0 && chain < FAT_ENTRY_EOF) {
+        if (extent_map_append(extents, chain) != 0) {
+            free_extents(extents); // Built again from scratch by the next seek
+            __atomic_store_n(&file->extents, NULL, __ATOMIC_RELEASE);
+            return;
+        }
+        chain = vol->fat[chain];
+    }
+}
+
+// Finds cluster 'number' (0 = the first) of an open file with a binary search of its
+// extent map, and how many clusters from there on are adjacent on the disk. Without a
+// map (out of memory), the chain is walked. Returns false if the chain is shorter.
+// Called with the file's directory locked.
+static bool seek_cluster(fat_volume_t* vol, open_file_t* file, uint32_t number, uint16_t* cluster, uint32_t* run_left) {
+    const extent_map_t* extents = get_extents(vol, file);
+    if (extents != NULL) {
+        return extent_map_find(extents, number, cluster, run_left);
+    }
+
+    uint16_t current_cluster = file->first_cluster;
+    for (uint32_t i = 0; i < number && current_cluster != 0 && current_cluster < FAT_ENTRY_EOF; ++i) {
+        current_cluster = vol->fat[current_cluster];
+    }
+    *cluster = current_cluster;
+    *run_left = 1;
+    return current_cluster != 0 && current_cluster < FAT_ENTRY_EOF;
+}
+
+// Returns the open file whose entry is at (slot_cluster, entry_index), or NULL.
+// Called with files_lock held.
+static open_file_t* find_open_file(fat_volume_t* vol, uint16_t slot_cluster, uint32_t entry_index) {
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        open_file_t* file = &vol->files[i];
+        if (file->refs > 0 && !file->unlinked && !file->lost &&
+            file->slot_cluster == slot_cluster && file->entry_index == entry_index) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+// Brings an open file up to date after a path operation changed its entry: the file now
+// starts at 'first_cluster' and holds 'size' bytes; it kept the first 'kept_clusters' of its
+// old chain (0 for a whole new chain) and continues with 'new_chain' (0 if nothing was linked).
+// Called with the directory locked exclusively.
+static void open_file_changed(fat_volume_t* vol, const path_search_result_t* result, uint16_t first_cluster, uint32_t size,
+                              uint32_t kept_clusters, uint16_t new_chain) {
+    if (__atomic_load_n(&vol->open_file_count, __ATOMIC_ACQUIRE) == 0) {
+        return; // Nothing is open, and opening takes the directory lock we hold
+    }
+    pthread_mutex_lock(&vol->files_lock);
+    open_file_t* file = find_open_file(vol, result->slot_cluster, result->entry_index);
+    if (file != NULL) {
+        file->first_cluster = first_cluster;
+        if (file->extents != NULL) extent_map_truncate(file->extents, kept_clusters);
+        extend_extents(vol, file, new_chain);
+        file->size = size;
+    }
+    pthread_mutex_unlock(&vol->files_lock);
+}
+
+// Tells the open file (if any) that its entry is being removed. Returns true if the file
+// is open: its clusters then stay allocated until the last handle is closed.
+// Called with the directory locked exclusively.
+static bool open_file_unlinked(fat_volume_t* vol, const path_search_result_t* result) {
+    if (__atomic_load_n(&vol->open_file_count, __ATOMIC_ACQUIRE) == 0) {
+        return false;
+    }
+    pthread_mutex_lock(&vol->files_lock);
+    open_file_t* file = find_open_file(vol, result->slot_cluster, result->entry_index);
+    if (file != NULL) {
+        file->unlinked = true;
+    }
+    pthread_mutex_unlock(&vol->files_lock);
+    return file != NULL;
+}
+
+// Cuts every open file off from the image, which is being replaced. Their handles can
+// only be closed after this; the clusters of unlinked files go with the old FAT.
+// Called with state_lock held exclusively.
+static void lose_open_files(fat_volume_t* vol) {
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        vol->files[i].lost = true;
+    }
+}
+
+// --- Directory Locking ---
+
+typedef enum {
+    DIR_SHARED,              // Lookups, reads and listings
+    DIR_EXCLUSIVE            // Anything that changes the directory or one of its files
+} dir_lock_mode_t;
+
+// Outcomes of lock_parent()
+#define WALK_LOCKED 0        // The directory that holds the last component is locked
+#define WALK_ERROR (-1)      // A directory cluster couldn't be read
+#define WALK_NOT_FOUND 1     // A directory on the way (or the entry itself, if required) doesn't exist
+#define WALK_NOT_DIR 2       // A component on the way is a file
+
+static void lock_dir(fat_volume_t* vol, uint16_t dir_cluster, dir_lock_mode_t mode) {
+    if (mode == DIR_EXCLUSIVE) pthread_rwlock_wrlock(&vol->dir_locks[dir_cluster]);
+    else pthread_rwlock_rdlock(&vol->dir_locks[dir_cluster]);
+}
+
+static void unlock_dir(fat_volume_t* vol, uint16_t dir_cluster) {
+    pthread_rwlock_unlock(&vol->dir_locks[dir_cluster]);
+}
+
+// find_in_dir() for an indexed directory: only the clusters holding a name with the
+// same hash are read.
+static int find_in_index(fat_volume_t* vol, const dir_index_t* index, const char* name, size_t length, dir_entry_t* entry, uint16_t* slot_cluster, union data_cluster* cluster_buffer) {
+    uint32_t hash = dir_index_hash(name, length);
+    uint32_t cursor = 0;
+    const dir_index_item_t* item;
+    while ((item = dir_index_next(index, hash, &cursor)) != NULL) {
+        const union data_cluster* dir = peek_clusters(vol, item->cluster, 1, cluster_buffer);
+        if (dir == NULL) {
+            fprintf(stderr, "Error: Could not read cluster %u\n", item->cluster);
+            return -2;
+        }
+        if (entry_has_name(&dir->dir[item->slot], name, length)) {
+            *entry = dir->dir[item->slot];
+            *slot_cluster = item->cluster;
+            return (int)item->slot;
+        }
+    }
+    return -1;
+}
+
+// find_in_dir() for a directory without an index: its cluster chain is scanned.
+static int scan_dir(fat_volume_t* vol, uint16_t dir_cluster, const char* name, size_t length, dir_entry_t* entry, uint16_t* slot_cluster, union data_cluster* cluster_buffer) {
+    uint16_t current_cluster = dir_cluster;
+    while (current_cluster != 0 && current_cluster < FAT_ENTRY_EOF) {
+        const union data_cluster* dir = peek_clusters(vol, current_cluster, 1, cluster_buffer);
+        if (dir == NULL) {
+            fprintf(stderr, "Error: Could not read cluster %u\n", current_cluster);
+            return -2;
+        }
+
+        int i = dir_scan(dir, vol->dir_entries, name, length, NULL);
+        if (i >= 0) {
+            *entry = dir->dir[i];
+            *slot_cluster = current_cluster;
+            return i;
+        }
+        current_cluster = vol->fat[current_cluster];
+    }
+    return -1;
+}
+
+// Looks up the 'length' characters at 'name' in a directory. Returns the entry index,
+// copies the entry to 'entry' and stores the cluster holding it in 'slot_cluster';
+// returns -1 if the name isn't there, or -2 if a cluster can't be read.
+static int find_in_dir(fat_volume_t* vol, uint16_t dir_cluster, const char* name, size_t length, dir_entry_t* entry, uint16_t* slot_cluster) {
+    union data_cluster* cluster_buffer = alloc_clusters(vol, 1);
+    if (cluster_buffer == NULL) {
+        return -2;
+    }
+    const dir_index_t* index = get_dir_index(vol, dir_cluster);
+    int found = (index != NULL) ? find_in_index(vol, index, name, length, entry, slot_cluster, cluster_buffer)
+                                : scan_dir(vol, dir_cluster, name, length, entry, slot_cluster, cluster_buffer);
+    free(cluster_buffer);
+    return found;
+}
+
+// find_in_dir() through the dentry cache; both outcomes of a search are remembered.
+// Called with the directory locked.
+static int lookup_name(fat_volume_t* vol, uint16_t dir_cluster, const char* name, size_t length, dir_entry_t* entry, uint16_t* slot_cluster) {
+    dcache_value_t value;
+    if (vol->dcache_enabled && dcache_lookup(&vol->dcache, dir_cluster, name, length, &value)) {
+        if (!value.found) return -1;
+        *entry = value.entry;
+        *slot_cluster = value.slot_cluster;
+        return (int)value.entry_index;
+    }
+
+    int index = find_in_dir(vol, dir_cluster, name, length, entry, slot_cluster);
+    if (vol->dcache_enabled && index != -2) {
+        memset(&value, 0, sizeof(value));
+        value.found = (index >= 0);
+        if (value.found) {
+            value.entry = *entry;
+            value.slot_cluster = *slot_cluster;
+            value.entry_index = (uint32_t)index;
+        }
+        dcache_insert(&vol->dcache, dir_cluster, name, length, &value);
+    }
+    return index;
+}
+
+// Walks 'path' down to the directory that holds its last component and returns with that
+// directory locked in 'mode' (for "/", the root itself is locked and reported as the entry).
+// The walk uses lock coupling: each directory is locked before its parent is released, so
+// nothing on the way can be removed under us. result->found tells whether the last component
+// exists. Any outcome other than WALK_LOCKED returns with nothing locked.
+static int lock_parent(fat_volume_t* vol, const char* path, dir_lock_mode_t mode, path_search_result_t* result) {
+    memset(result, 0, sizeof(path_search_result_t));
+    result->parent_cluster = vol->root_dir; // Start search at the root
+    result->slot_cluster = vol->root_dir;
+
+    path_iter_t iter;
+    path_component_t component, next;
+    path_iter_init(&iter, path);
+    if (!path_iter_next(&iter, &component)) {
+        if (strcmp(path, "/") != 0) {
+            return WALK_NOT_FOUND; // Empty or invalid path
+        }
+        lock_dir(vol, vol->root_dir, mode);
+        result->found = true;
+        result->entry_cluster = vol->root_dir;
+        result->entry.attributes = ATTR_DIRECTORY;
+        strcpy((char*)result->entry.filename, "/");
+        return WALK_LOCKED;
+    }
+
+    uint16_t current_cluster = vol->root_dir;
+    bool more = path_iter_next(&iter, &next);
+    lock_dir(vol, current_cluster, more ? DIR_SHARED : mode);
+
+    // Every component but the last must be a directory
+    while (more) {
+        dir_entry_t entry;
+        uint16_t slot_cluster;
+        int index = lookup_name(vol, current_cluster, component.name, component.length, &entry, &slot_cluster);
+        if (index < 0 || entry.attributes != ATTR_DIRECTORY) {
+            unlock_dir(vol, current_cluster);
+            if (index == -2) return WALK_ERROR;
+            return (index == -1) ? WALK_NOT_FOUND : WALK_NOT_DIR;
+        }
+
+        component = next;
+        more = path_iter_next(&iter, &next);
+        lock_dir(vol, entry.first_block, more ? DIR_SHARED : mode);
+        unlock_dir(vol, current_cluster);
+        current_cluster = entry.first_block;
+    }
+
+    // Store the last component's name, cut to what a directory entry holds
+    size_t name_length = (component.length < sizeof(result->name)) ? component.length : sizeof(result->name) - 1;
+    memcpy(result->name, component.name, name_length);
+    result->parent_cluster = current_cluster;
+    int index = lookup_name(vol, current_cluster, component.name, component.length, &result->entry, &result->slot_cluster);
+    if (index == -2) {
+        unlock_dir(vol, current_cluster);
+        return WALK_ERROR;
+    }
+    if (index >= 0) {
+        result->found = true;
+        result->entry_cluster = result->entry.first_block;
+        result->entry_index = (uint32_t)index;
+    }
+    return WALK_LOCKED;
+}
+
+// Starts an operation on 'path': takes state_lock (shared) and the lock of the directory
+// holding the last component. With 'must_exist', a missing entry is WALK_NOT_FOUND.
+// On WALK_LOCKED the caller finishes with end_path_op(); otherwise nothing is held.
+static int begin_path_op(fat_volume_t* vol, const char* path, dir_lock_mode_t mode, bool must_exist, path_search_result_t* result) {
+    lock_state(vol, false);
+    int status = lock_parent(vol, path, mode, result);
+    if (status == WALK_LOCKED && must_exist && !result->found) {
+        unlock_dir(vol, result->parent_cluster);
+        status = WALK_NOT_FOUND;
+    }
+    if (status == WALK_LOCKED && mode == DIR_EXCLUSIVE && begin_transaction(vol) != 0) {
+        unlock_dir(vol, result->parent_cluster);
+        status = WALK_ERROR;
+    }
+    if (status != WALK_LOCKED) {
+        unlock_state(vol);
+    }
+    return status;
+}
+
+// Commits what the operation changed (if anything), then releases its locks.
+// Returns 0, or -1 if the commit failed.
+static int end_path_op(fat_volume_t* vol, const path_search_result_t* result) {
+    int status = end_transaction(vol);
+    unlock_dir(vol, result->parent_cluster);
+    unlock_state(vol);
+    return status;
+}
+
+// --- Path Lookup ---
+
+int find_entry_by_path(fat_volume_t* vol, const char* path, path_search_result_t* result) {
+    // The result is a snapshot: the directory is unlocked again before returning.
+    int status = begin_path_op(vol, path, DIR_SHARED, false, result);
+    if (status == WALK_LOCKED) {
+        end_path_op(vol, result);
+    }
+    return (status == WALK_ERROR) ? -1 : 0;
+}
+
+// Prints the entries of a directory. Called with the directory locked.
+static int list_dir(fat_volume_t* vol, uint16_t dir_cluster) {
+    union data_cluster* cluster_buffer = alloc_clusters(vol, 1);
+    if (cluster_buffer == NULL) {
+        return -1;
+    }
+    int status = 0;
+    uint16_t current_cluster = dir_cluster;
+
+    while (current_cluster != 0 && current_cluster < FAT_ENTRY_EOF) {
+        // Read the next cluster of the directory
+        const union data_cluster* dir = peek_clusters(vol, current_cluster, 1, cluster_buffer);
+        if (dir == NULL) {
+            status = -1;
+            break;
+        }
+
+        for (uint32_t i = 0; i < vol->dir_entries; ++i) {
+            const dir_entry_t* entry = &dir->dir[i];
+            if (entry->filename[0] != 0x00) { // Check if the entry is in use
+                const char* type = (entry->attributes == ATTR_DIRECTORY) ? "[D]" : "[F]";
+                printf("%-4s  %-8u  %s\n", type, entry->size, entry->filename);
+            }
+        }
+        current_cluster = vol->fat[current_cluster];
+    }
+    free(cluster_buffer);
+    return status;
+}
+
+int fs_ls(fat_volume_t* vol, const char* path) {
+    path_search_result_t result;
+    if (begin_path_op(vol, path, DIR_SHARED, true, &result) != WALK_LOCKED) {
+        fprintf(stderr, "ls: cannot access '%s': No such file or directory\n", path);
+        return -1;
+    }
+
+    if (result.entry.attributes != ATTR_DIRECTORY) {
+        // If it's a file, just print its name.
+        printf("%s\n", result.entry.filename);
+        end_path_op(vol, &result);
+        return 0;
+    }
+
+    // Hold the listed directory instead of its parent (they are the same for "/")
+    if (result.entry_cluster != result.parent_cluster) {
+        lock_dir(vol, result.entry_cluster, DIR_SHARED);
+        unlock_dir(vol, result.parent_cluster);
+        result.parent_cluster = result.entry_cluster;
+    }
+
+    printf("Listing of '%s':\n", path);
+    printf("Type  Size      Name\n");
+    printf("----  --------  ------------------\n");
+    int status = list_dir(vol, result.entry_cluster);
+    end_path_op(vol, &result);
+    return status;
+}
+
+// Helper to free a chain of clusters in the FAT
+static void free_cluster_chain(fat_volume_t* vol, uint16_t starting_cluster) {
+    // Outside a transaction the clusters become available right away, so their contents
+    // are discarded first, one run of adjacent clusters at a time. A transaction discards
+    // them when it commits.
+    if (current_transaction(vol) == NULL) {
+        uint16_t run_start = 0;
+        uint32_t run_length = 0;
+        for (uint16_t cluster = starting_cluster; cluster != 0 && cluster < FAT_ENTRY_EOF; cluster = vol->fat[cluster]) {
+            if (run_length > 0 && cluster == run_start + run_length) {
+                run_length++;
+                continue;
+            }
+            discard_clusters(vol, run_start, run_length);
+            run_start = cluster;
+            run_length = 1;
+        }
+        discard_clusters(vol, run_start, run_length);
+    }
+
+    pthread_mutex_lock(&vol->fat_lock);
+    uint16_t current = starting_cluster;
+    while (current != 0 && current < FAT_ENTRY_EOF) {
+        uint16_t next = vol->fat[current];
+        fat_set(vol, current, FAT_ENTRY_FREE);
+        current = next;
+    }
+    pthread_mutex_unlock(&vol->fat_lock);
+}
+
+// Takes a single free cluster and marks it as a one-cluster chain. Returns 0 if the disk is full.
+static uint16_t claim_free_cluster(fat_volume_t* vol) {
+    // Next-fit search in this thread's allocation group, claimed without a lock
+    uint16_t cluster = (uint16_t)alloc_claim(&vol->alloc);
+    if (cluster != 0) {
+        pthread_mutex_lock(&vol->fat_lock);
+        fat_set(vol, cluster, FAT_ENTRY_EOF);
+        pthread_mutex_unlock(&vol->fat_lock);
+    }
+    return cluster;
+}
+
+// Allocates 'count' clusters as a linked chain ending in EOF, taking the largest
+// contiguous runs available so that the chain is split into as few pieces as possible.
+// Nothing is allocated if there isn't room for the whole chain.
+static int allocate_chain(fat_volume_t* vol, uint32_t count, uint16_t* first_cluster) {
+    if (count == 0 || alloc_free_clusters(&vol->alloc) < count) {
+        return -1;
+    }
+
+    uint16_t first = 0;
+    uint16_t previous = 0;
+    while (count > 0) {
+        // Each run is claimed without a lock; only linking it into the chain takes fat_lock
+        uint32_t run_length = 0;
+        uint16_t start = (uint16_t)alloc_claim_run(&vol->alloc, count, &run_length);
+        if (start == 0) break; // Other threads took the clusters counted above
+
+        pthread_mutex_lock(&vol->fat_lock);
+        for (uint32_t i = 0; i < run_length; ++i) {
+            uint16_t cluster = start + i;
+            if (first == 0) first = cluster;
+            else fat_set(vol, previous, cluster);
+            fat_set(vol, cluster, FAT_ENTRY_EOF);
+            previous = cluster;
+        }
+        pthread_mutex_unlock(&vol->fat_lock);
+        count -= run_length;
+    }
+
+    if (count > 0) {
+        if (first != 0) free_cluster_chain(vol, first); // Give back the part we got
+        return -1;
+    }
+    *first_cluster = first;
+    return 0;
+}
+
+// Links 'next' after 'cluster' in the FAT.
+static void link_cluster(fat_volume_t* vol, uint16_t cluster, uint16_t next) {
+    pthread_mutex_lock(&vol->fat_lock);
+    fat_set(vol, cluster, next);
+    pthread_mutex_unlock(&vol->fat_lock);
+}
+
+// Finds a free entry in the directory starting at 'dir_cluster_index', growing the directory
+// by one cluster when all of its clusters are full. On success, 'dir_cluster' holds the cluster
+// with the free entry and 'slot_cluster' its index. Called with the directory locked exclusively.
+static int find_free_dir_entry(fat_volume_t* vol, uint16_t dir_cluster_index, union data_cluster* dir_cluster, uint16_t* slot_cluster) {
+    uint16_t current_cluster = dir_cluster_index;
+    while (1) {
+        if (read_cluster(vol, current_cluster, dir_cluster) != 0) {
+            return -1; // Error reading cluster
+        }
+
+        int free_index;
+        dir_scan(dir_cluster, vol->dir_entries, "", 0, &free_index); // No name to match: only looks for a free slot
+        if (free_index >= 0) {
+            *slot_cluster = current_cluster;
+            return free_index; // Found a free slot
+        }
+
+        if (vol->fat[current_cluster] >= FAT_ENTRY_EOF) break;
+        current_cluster = vol->fat[current_cluster];
+    }
+
+    // Every cluster is full: chain an empty one to the end of the directory.
+    // It is written right away so that the chain never points at stale data.
+    uint16_t new_cluster = claim_free_cluster(vol);
+    if (new_cluster == 0) {
+        return -2; // Directory is full and so is the disk
+    }
+    memset(dir_cluster, 0, vol->cluster_size);
+    if (write_meta(vol, new_cluster, dir_cluster) != 0) return -1;
+    link_cluster(vol, current_cluster, new_cluster);
+
+    *slot_cluster = new_cluster;
+    return 0;
+}
+
+// --- High-Level Implementations ---
+// The public functions take the locks and allocate the cluster buffer; the static helpers
+// below them do the work and may return early.
+
+// Steps 3-8 of fs_mkdir, in 'buffer' (one cluster). Called with the parent directory locked exclusively.
+static int add_directory(fat_volume_t* vol, const char* path, uint16_t parent_cluster, const char* new_dir_name, union data_cluster* buffer) {
+    // 3. Find a free slot in the parent directory
+    uint16_t slot_cluster = 0;
+    int free_entry_index = find_free_dir_entry(vol, parent_cluster, buffer, &slot_cluster);
+
+    if (free_entry_index < 0) {
+        fprintf(stderr, "mkdir: cannot create directory '%s': No space left for the new entry\n", path);
+        return -1;
+    }
+
+    // 4. Find a free cluster for the new directory's contents (and mark it as EOF in the FAT)
+    uint16_t new_cluster_idx = claim_free_cluster(vol);
+    if (new_cluster_idx == 0) {
+        fprintf(stderr, "mkdir: cannot create directory '%s': No space left on device\n", path);
+        return -1;
+    }
+    
+    // 5. Fill in the new directory entry
+    dir_entry_t* new_entry = &buffer->dir[free_entry_index];
+    copy_name((char*)new_entry->filename, sizeof(new_entry->filename), new_dir_name);
+    new_entry->attributes = ATTR_DIRECTORY;
+    new_entry->first_block = new_cluster_idx;
+    new_entry->size = 0; // Directories have a size of 0
+
+    // 6. Write the parent directory to disk
+    if (write_meta(vol, slot_cluster, buffer) != 0) return -1;
+    index_entry_added(vol, parent_cluster, (const char*)new_entry->filename, slot_cluster, free_entry_index);
+    forget_name(vol, parent_cluster, (const char*)new_entry->filename);
+
+    // 7. Then the new directory's own cluster (it's empty) and the FAT
+    memset(buffer, 0, vol->cluster_size);
+    if (write_meta(vol, new_cluster_idx, buffer) != 0) return -1;
+    if (flush_fat(vol) != 0) return -1;
+
+    printf("Directory '%s' created.\n", path);
+    return 0;
+}
+
+int fs_mkdir(fat_volume_t* vol, const char* path) {
+    // 1. The new directory's name is the last component of the path. The parent path
+    //    is only needed for messages, so it is printed from 'path' rather than copied.
+    const char* last_slash = strrchr(path, '/');
+    if (last_slash == NULL) {
+        fprintf(stderr, "mkdir: invalid path '%s'\n", path);
+        return -1;
+    }
+    int parent_length = (last_slash == path) ? 1 : (int)(last_slash - path); // "/" for "/newdir"
+
+    // 2. Find and lock the parent directory; the same walk looks the new name up
+    path_search_result_t result;
+    int walk = begin_path_op(vol, path, DIR_EXCLUSIVE, false, &result);
+    if (walk == WALK_NOT_DIR) {
+        fprintf(stderr, "mkdir: cannot create directory '%.*s': Not a directory\n", parent_length, path);
+        return -1;
+    }
+    if (walk != WALK_LOCKED) {
+        fprintf(stderr, "mkdir: cannot create directory '%s': No such file or directory\n", path);
+        return -1;
+    }
+    if (result.found) {
+        fprintf(stderr, "mkdir: cannot create directory '%s': File exists\n", path);
+        end_path_op(vol, &result);
+        return -1;
+    }
 
-    if (content_len > 0) {
-        const char* p = content;
-        while (p < content + content_len) {
-            uint16_t next_cluster = find_free_cluster();
-            if (next_cluster == 0) {
-                fprintf(stderr, "write: No space left on device\n");
-                free_cluster_chain(first_cluster); // Rollback allocations
-                return -1;
-            }
+    union data_cluster* buffer = alloc_clusters(vol, 1);
+    int status = (buffer != NULL) ? add_directory(vol, path, result.parent_cluster, result.name, buffer) : -1;
+    free(buffer);
+    if (end_path_op(vol, &result) != 0) status = -1;
+    return status;
+}
 
-            if (first_cluster == 0) {
-                first_cluster = next_cluster;
-            } else {
-                g_fat_table[current_cluster] = next_cluster;
+// Steps 3-7 of fs_create, in 'buffer' (one cluster). Called with the parent directory locked exclusively.
+static int add_file(fat_volume_t* vol, const char* path, uint16_t parent_cluster, const char* new_file_name, union data_cluster* buffer) {
+    // 3. Find free slot (same as mkdir)
+    uint16_t slot_cluster = 0;
+    int free_entry_index = find_free_dir_entry(vol, parent_cluster, buffer, &slot_cluster);
+    if(free_entry_index < 0) { fprintf(stderr, "create: cannot create file '%s': No space left for the new entry\n", path); return -1; }
+
+    // 4. Find free cluster (same as mkdir)
+    uint16_t new_cluster_idx = claim_free_cluster(vol);
+    if(new_cluster_idx == 0) { fprintf(stderr, "create: cannot create file '%s': No space left\n", path); return -1; }
+
+    // 5. Fill entry - **DIFFERENCES ARE HERE**
+    dir_entry_t* new_entry = &buffer->dir[free_entry_index];
+    copy_name((char*)new_entry->filename, sizeof(new_entry->filename), new_file_name);
+    new_entry->attributes = ATTR_ARCHIVE; // It's a file
+    new_entry->first_block = new_cluster_idx; // A file starts with a cluster...
+    new_entry->size = 0; // ...but its initial size is 0
+
+    // 6. Write changes - **DIFFERENCE IS HERE**
+    // We only need to write the parent dir and the FAT.
+    // No need to write an empty data cluster for a 0-byte file.
+    if (write_meta(vol, slot_cluster, buffer) != 0) return -1;
+    index_entry_added(vol, parent_cluster, (const char*)new_entry->filename, slot_cluster, free_entry_index);
+    forget_name(vol, parent_cluster, (const char*)new_entry->filename);
+    if (flush_fat(vol) != 0) return -1;
+    
+    printf("File '%s' created.\n", path);
+    return 0;
+}
+
+int fs_create(fat_volume_t* vol, const char* path) {
+    // Logic is nearly identical to mkdir, with a few key differences.
+    // 1. The new file's name is the last component of the path (same as mkdir)
+    if (strchr(path, '/') == NULL) { fprintf(stderr, "create: invalid path '%s'\n", path); return -1; }
+
+    // 2. Find and lock parent, looking the new name up in the same walk (same as mkdir)
+    path_search_result_t result;
+    if (begin_path_op(vol, path, DIR_EXCLUSIVE, false, &result) != WALK_LOCKED) {
+        fprintf(stderr, "create: cannot create file '%s': Parent path not found or not a directory\n", path);
+        return -1;
+    }
+    if (result.found) {
+        fprintf(stderr, "create: cannot create file '%s': File exists\n", path);
+        end_path_op(vol, &result);
+        return -1;
+    }
+
+    union data_cluster* buffer = alloc_clusters(vol, 1);
+    int status = (buffer != NULL) ? add_file(vol, path, result.parent_cluster, result.name, buffer) : -1;
+    free(buffer);
+    if (end_path_op(vol, &result) != 0) status = -1;
+    return status;
+}
+
+// Returns 1 if no cluster of the directory holds an entry, 0 if one does, -1 on error.
+// The clusters are read into 'dir_content'.
+static int dir_is_empty(fat_volume_t* vol, uint16_t dir_cluster, union data_cluster* dir_content) {
+    uint16_t current_cluster = dir_cluster;
+    while (current_cluster != 0 && current_cluster < FAT_ENTRY_EOF) {
+        if (read_cluster(vol, current_cluster, dir_content) != 0) return -1;
+        for (uint32_t i = 0; i < vol->dir_entries; ++i) {
+            if (dir_content->dir[i].filename[0] != 0x00) {
+                return 0;
             }
-            current_cluster = next_cluster;
-            g_fat_table[current_cluster] = FAT_ENTRY_EOF;
+        }
+        current_cluster = vol->fat[current_cluster];
+    }
+    return 1;
+}
 
-            uint8_t buffer[CLUSTER_SIZE] = {0};
-            uint32_t len = (content_len - (p - content) > CLUSTER_SIZE) ? CLUSTER_SIZE : content_len - (p - content);
-            memcpy(buffer, p, len);
-            if (write_cluster(current_cluster, buffer) != 0) return -1;
-            p += len;
+// Works in 'buffer' (one cluster). Called with the parent directory locked exclusively.
+static int remove_entry(fat_volume_t* vol, const char* path, const path_search_result_t* result, union data_cluster* buffer) {
+    // If it's a directory, check if it's empty. Its own lock waits for anyone still inside.
+    if (result->entry.attributes == ATTR_DIRECTORY) {
+        lock_dir(vol, result->entry_cluster, DIR_EXCLUSIVE);
+        int status = dir_is_empty(vol, result->entry_cluster, buffer);
+        unlock_dir(vol, result->entry_cluster);
+        if (status < 0) return -1;
+        if (status == 0) {
+            fprintf(stderr, "unlink: failed to remove '%s': Directory not empty\n", path);
+            return -1;
         }
-    } else {
-        first_cluster = find_free_cluster(); // Allocate one cluster even for empty write
-        g_fat_table[first_cluster] = FAT_ENTRY_EOF;
     }
 
-    // Update directory entry
-    union data_cluster parent_dir_content;
-    if (read_cluster(result.parent_cluster, &parent_dir_content) != 0) return -1;
-    parent_dir_content.dir[result.entry_index].first_block = first_cluster;
-    parent_dir_content.dir[result.entry_index].size = content_len;
+    // Free the cluster chain in the FAT, unless the file is still open
+    if (result->entry.attributes == ATTR_DIRECTORY) {
+        revoke_chain(vol, result->entry.first_block);
+    }
+    if (result->entry.attributes == ATTR_DIRECTORY || !open_file_unlinked(vol, result)) {
+        free_cluster_chain(vol, result->entry.first_block);
+    }
+    if (result->entry.attributes == ATTR_DIRECTORY) {
+        drop_dir_index(vol, result->entry_cluster);
+        dcache_forget_dir(&vol->dcache, result->entry_cluster);
+    }
+
+    // Clear the entry in the parent directory
+    if (read_cluster(vol, result->slot_cluster, buffer) != 0) return -1;
+    memset(&buffer->dir[result->entry_index], 0, sizeof(dir_entry_t));
 
     // Write changes to disk
-    if (write_cluster(result.parent_cluster, &parent_dir_content) != 0) return -1;
-    for (uint16_t i = 0; i < FAT_CLUSTER_COUNT; ++i) { // Persist FAT
-        if (write_cluster(FAT_CLUSTER_START + i, (uint8_t*)g_fat_table + (i * CLUSTER_SIZE)) != 0) return -1;
+    if (write_meta(vol, result->slot_cluster, buffer) != 0) return -1;
+    index_entry_removed(vol, result->parent_cluster, (const char*)result->entry.filename, result->slot_cluster, result->entry_index);
+    forget_name(vol, result->parent_cluster, (const char*)result->entry.filename);
+    if (flush_fat(vol) != 0) return -1; // Persist the modified parts of the FAT
+
+    printf("Removed '%s'.\n", path);
+    return 0;
+}
+
+int fs_unlink(fat_volume_t* vol, const char* path) {
+    path_search_result_t result;
+    if (begin_path_op(vol, path, DIR_EXCLUSIVE, true, &result) != WALK_LOCKED) {
+        fprintf(stderr, "unlink: cannot remove '%s': No such file or directory\n", path);
+        return -1;
+    }
+    if (result.entry_cluster == result.parent_cluster) {
+        fprintf(stderr, "unlink: cannot remove '%s': Is the root directory\n", path);
+        end_path_op(vol, &result);
+        return -1;
+    }
+
+    union data_cluster* buffer = alloc_clusters(vol, 1);
+    int status = (buffer != NULL) ? remove_entry(vol, path, &result, buffer) : -1;
+    free(buffer);
+    if (end_path_op(vol, &result) != 0) status = -1;
+    return status;
+}
+
+// stream_range() once the range is within the file. 'buffer' holds READ_BATCH_BYTES, or
+// is NULL with a mapped device.
+static int64_t stream_runs(fat_volume_t* vol, const dir_entry_t* entry, uint32_t offset, uint32_t length, fs_sink_t sink, void* context, uint8_t* buffer) {
+    uint32_t max_run = (vol->map != NULL) ? vol->cluster_count : READ_BATCH_BYTES / vol->cluster_size;
+    uint16_t current_cluster = entry->first_block;
+    for (uint32_t i = offset / vol->cluster_size; i > 0 && current_cluster != 0 && current_cluster < FAT_ENTRY_EOF; --i) {
+        current_cluster = vol->fat[current_cluster];
+    }
+    uint32_t in_cluster = offset % vol->cluster_size;
+    uint32_t done = 0;
+    while (done < length) {
+        if (current_cluster == 0 || current_cluster >= FAT_ENTRY_EOF) {
+            fprintf(stderr, "Error: The clusters of '%s' end before its size.\n", (const char*)entry->filename);
+            return -1;
+        }
+
+        // Follow the chain for as long as it continues with the physically next
+        // cluster, so that each contiguous run is fetched with one read.
+        uint16_t run_start = current_cluster;
+        uint32_t run_length = 1;
+        while (run_length < max_run && run_length * vol->cluster_size - in_cluster < length - done &&
+               vol->fat[current_cluster] == current_cluster + 1) {
+            current_cluster++;
+            run_length++;
+        }
+
+        const uint8_t* data = peek_clusters(vol, run_start, run_length, buffer);
+        if (data == NULL) return -1;
+        uint32_t len = run_length * vol->cluster_size - in_cluster;
+        if (len > length - done) len = length - done;
+        done += len;
+        if (sink(context, data + in_cluster, len) != 0) break;
+        in_cluster = 0;
+        current_cluster = vol->fat[current_cluster];
+    }
+    return done;
+}
+
+// Hands 'length' bytes of a file, from 'offset' on, to 'sink', one contiguous run of
+// clusters at a time. With a mapped device the sink gets pointers into the mapping and
+// a run can be any length; otherwise each run is fetched with one read. Returns the number
+// of bytes delivered (fewer if the sink stopped early), or -1 on error.
+// Called with the file's directory locked.
+static int64_t stream_range(fat_volume_t* vol, const dir_entry_t* entry, uint32_t offset, uint32_t length, fs_sink_t sink, void* context) {
+    if (offset >= entry->size) {
+        return 0;
+    }
+    if (length > entry->size - offset) {
+        length = entry->size - offset;
+    }
+
+    uint8_t* buffer = NULL;
+    if (vol->map == NULL) {
+        buffer = (uint8_t*)alloc_clusters(vol, READ_BATCH_BYTES / vol->cluster_size);
+        if (buffer == NULL) return -1;
+    }
+    int64_t done = stream_runs(vol, entry, offset, length, sink, context, buffer);
+    free(buffer);
+    return done;
+}
+
+static int print_chunk(void* context, const void* data, uint32_t length) {
+    (void)context;
+    fwrite(data, 1, length, stdout);
+    return 0;
+}
+
+// Called with the file's directory locked.
+static int print_file(fat_volume_t* vol, const dir_entry_t* entry) {
+    if (stream_range(vol, entry, 0, entry->size, print_chunk, NULL) < 0) return -1;
+    printf("\n");
+    return 0;
+}
+
+// Starts a read of 'path': returns with the
+// file's directory locked, or -1 after reporting why the file can't be read.
+static int begin_read(fat_volume_t* vol, const char* path, path_search_result_t* result) {
+    if (begin_path_op(vol, path, DIR_SHARED, true, result) != WALK_LOCKED) {
+        fprintf(stderr, "read: cannot read '%s': No such file or directory\n", path);
+        return -1;
+    }
+    if (result->entry.attributes != ATTR_ARCHIVE) {
+        fprintf(stderr, "read: cannot read '%s': Not a file\n", path);
+        end_path_op(vol, result);
+        return -1;
+    }
+    return 0;
+}
+
+int fs_read(fat_volume_t* vol, const char* path) {
+    path_search_result_t result;
+    if (begin_read(vol, path, &result) != 0) return -1;
+    int status = print_file(vol, &result.entry);
+    end_path_op(vol, &result);
+    return status;
+}
+
+int64_t fs_read_stream(fat_volume_t* vol, const char* path, uint32_t offset, uint32_t length, fs_sink_t sink, void* context) {
+    path_search_result_t result;
+    if (begin_read(vol, path, &result) != 0) return -1;
+    int64_t status = stream_range(vol, &result.entry, offset, length, sink, context);
+    end_path_op(vol, &result);
+    return status;
+}
+
+// fs_sink_t that copies each chunk after the previous one; 'context' points at the next byte.
+static int copy_chunk(void* context, const void* data, uint32_t length) {
+    uint8_t** next = (uint8_t**)context;
+    memcpy(*next, data, length);
+    *next += length;
+    return 0;
+}
+
+int64_t fs_read_buf(fat_volume_t* vol, const char* path, uint32_t offset, uint32_t length, void* buffer) {
+    uint8_t* next = buffer;
+    return fs_read_stream(vol, path, offset, length, copy_chunk, &next);
+}
+
+// Works in 'buffer' (one cluster). Called with the file's directory locked exclusively.
+static int overwrite_file(fat_volume_t* vol, const char* path, const path_search_result_t* result, const uint8_t* content, uint32_t content_len, union data_cluster* buffer) {
+    uint32_t cluster_count = (content_len + vol->cluster_size - 1) / vol->cluster_size;
+    if (cluster_count == 0) {
+        cluster_count = 1; // Keep one cluster even for empty write
+    }
+
+    // The existing chain is rewritten in place, as far as the new content goes
+    uint16_t current_cluster = result->entry.first_block;
+    uint16_t last_kept = 0;
+    uint32_t kept = 0;
+    while (kept < cluster_count && current_cluster != 0 && current_cluster < FAT_ENTRY_EOF) {
+        last_kept = current_cluster;
+        current_cluster = vol->fat[current_cluster];
+        kept++;
     }
+
+    uint16_t tail = 0;
+    if (kept < cluster_count) {
+        // Longer than before: the missing clusters are requested at once, so that they
+        // land in as few contiguous runs as possible
+        if (allocate_chain(vol, cluster_count - kept, &tail) != 0) {
+            fprintf(stderr, "write: No space left on device\n");
+            return -1;
+        }
+        if (last_kept != 0) link_cluster(vol, last_kept, tail);
+    } else if (current_cluster != 0 && current_cluster < FAT_ENTRY_EOF) {
+        // Shorter than before: end the chain after the last cluster kept and free the rest
+        link_cluster(vol, last_kept, FAT_ENTRY_EOF);
+        free_cluster_chain(vol, current_cluster);
+    }
+    uint16_t first_cluster = (kept > 0) ? result->entry.first_block : tail;
+
+    const uint8_t* p = content;
+    current_cluster = first_cluster;
+    while (p < content + content_len) {
+        uint32_t len = (content_len - (p - content) > vol->cluster_size) ? vol->cluster_size : content_len - (p - content);
+        memcpy(buffer->data, p, len);
+        memset(buffer->data + len, 0, vol->cluster_size - len);
+        if (write_cluster(vol, current_cluster, buffer) != 0) return -1;
+        p += len;
+        current_cluster = vol->fat[current_cluster];
+    }
+
+    // Update directory entry
+    if (read_cluster(vol, result->slot_cluster, buffer) != 0) return -1;
+    buffer->dir[result->entry_index].first_block = first_cluster;
+    buffer->dir[result->entry_index].size = content_len;
+
+    // Write changes to disk
+    if (write_meta(vol, result->slot_cluster, buffer) != 0) return -1;
+    forget_name(vol, result->parent_cluster, (const char*)result->entry.filename); // New first_block and size
+    open_file_changed(vol, result, first_cluster, content_len, kept, tail);
+    if (flush_fat(vol) != 0) return -1; // Persist the modified parts of the FAT
     
     printf("Wrote %u bytes to '%s'.\n", content_len, path);
     return 0;
 }
 
-// Append is very complex; a simplified version can be built on read+write, but a true append is way more efficient
-int fs_append(const char* path, const char* content) {
+int fs_write_buf(fat_volume_t* vol, const char* path, const void* data, size_t length) {
+    if (length > UINT32_MAX) {
+        fprintf(stderr, "write: cannot write to '%s': File too large\n", path);
+        return -1;
+    }
     path_search_result_t result;
-    if (find_entry_by_path(path, &result) != 0 || !result.found || result.entry.attributes != ATTR_ARCHIVE) {
-        fprintf(stderr, "append: cannot append to '%s': No such file or not a file\n", path);
+    int walk = begin_path_op(vol, path, DIR_EXCLUSIVE, true, &result);
+    if (walk != WALK_LOCKED || result.entry.attributes != ATTR_ARCHIVE) {
+        if (walk == WALK_LOCKED) end_path_op(vol, &result);
+        fprintf(stderr, "write: cannot write to '%s': No such file or not a file\n", path);
         return -1;
     }
 
-    uint32_t content_len = strlen(content);
+    union data_cluster* buffer = alloc_clusters(vol, 1);
+    int status = (buffer != NULL) ? overwrite_file(vol, path, &result, data, (uint32_t)length, buffer) : -1;
+    free(buffer);
+    if (end_path_op(vol, &result) != 0) status = -1;
+    return status;
+}
+
+int fs_write(fat_volume_t* vol, const char* path, const char* content) {
+    return fs_write_buf(vol, path, content, strlen(content));
+}
+
+// Append is very complex; a simplified version can be built on read+write, but a true append is way more efficient
+// Works in 'buffer' (one cluster). Called with the file's directory locked exclusively.
+static int append_file(fat_volume_t* vol, const char* path, const path_search_result_t* result, const uint8_t* content, uint32_t content_len, union data_cluster* buffer) {
     if (content_len == 0) {
         return 0; // Nothing to append
     }
 
-    uint16_t current_cluster = result.entry.first_block;
-    uint32_t original_size = result.entry.size;
+    uint16_t current_cluster = result->entry.first_block;
+    uint32_t original_size = result->entry.size;
 
     // 1. Traverse to the last cluster of the file
     if (original_size > 0) {
-        while (g_fat_table[current_cluster] != FAT_ENTRY_EOF) {
-            current_cluster = g_fat_table[current_cluster];
+        while (vol->fat[current_cluster] != FAT_ENTRY_EOF) {
+            current_cluster = vol->fat[current_cluster];
         }
     }
     // If original_size is 0, current_cluster is the first pre-allocated block.
 
-    // 2. Prepare for writing
-    union data_cluster buffer;
-    uint32_t offset_in_cluster = original_size % CLUSTER_SIZE;
-    
-    // If the last cluster is full, or if the file was empty, the offset is 0 for the *next* cluster.
-    if (offset_in_cluster == 0 && original_size > 0) {
-        uint16_t new_cluster = find_free_cluster();
-        if (new_cluster == 0) { fprintf(stderr, "append: No space left on device\n"); return -1; }
-        g_fat_table[current_cluster] = new_cluster;
-        current_cluster = new_cluster;
-        g_fat_table[current_cluster] = FAT_ENTRY_EOF;
-        memset(&buffer, 0, sizeof(buffer)); // New cluster is empty
+    // 2. Allocate every new cluster the content needs in one request
+    uint32_t offset_in_cluster = original_size % vol->cluster_size;
+    // If the last cluster is full, the content starts in the *next* cluster.
+    // An empty file still owns its pre-allocated first cluster, which is fully available.
+    bool last_cluster_full = (offset_in_cluster == 0 && original_size > 0);
+    uint32_t space_in_last = last_cluster_full ? 0 : vol->cluster_size - offset_in_cluster;
+    uint32_t overflow = (content_len > space_in_last) ? content_len - space_in_last : 0;
+    uint32_t new_cluster_count = (overflow + vol->cluster_size - 1) / vol->cluster_size;
+
+    uint16_t new_first = 0;
+    if (new_cluster_count > 0) {
+        if (allocate_chain(vol, new_cluster_count, &new_first) != 0) {
+            fprintf(stderr, "append: No space left on device\n");
+            return -1;
+        }
+        link_cluster(vol, current_cluster, new_first);
+    }
+
+    if (last_cluster_full) {
+        current_cluster = vol->fat[current_cluster];
+        offset_in_cluster = 0;
+        memset(buffer, 0, vol->cluster_size); // New cluster is empty
     } else {
-        if (read_cluster(current_cluster, &buffer) != 0) return -1;
+        if (read_cluster(vol, current_cluster, buffer) != 0) return -1;
     }
 
-    const char* p = content;
+    const uint8_t* p = content;
     uint32_t remaining_content = content_len;
 
     // 3. Main append loop
     while (remaining_content > 0) {
-        uint32_t space_in_buffer = CLUSTER_SIZE - offset_in_cluster;
+        uint32_t space_in_buffer = vol->cluster_size - offset_in_cluster;
         uint32_t bytes_to_copy = (remaining_content > space_in_buffer) ? space_in_buffer : remaining_content;
 
-        memcpy(buffer.data + offset_in_cluster, p, bytes_to_copy);
+        memcpy(buffer->data + offset_in_cluster, p, bytes_to_copy);
         p += bytes_to_copy;
         remaining_content -= bytes_to_copy;
         
         // Write the modified cluster back
-        if (write_cluster(current_cluster, &buffer) != 0) return -1;
+        if (write_cluster(vol, current_cluster, buffer) != 0) return -1;
 
-        // If we still have content left, allocate a new cluster
+        // If we still have content left, move on to the next (already allocated) cluster
         if (remaining_content > 0) {
-            uint16_t new_cluster = find_free_cluster();
-            if (new_cluster == 0) { fprintf(stderr, "append: No space left on device\n"); return -1; } // Error: disk full
-            g_fat_table[current_cluster] = new_cluster;
-            current_cluster = new_cluster;
-            g_fat_table[current_cluster] = FAT_ENTRY_EOF;
+            current_cluster = vol->fat[current_cluster];
             offset_in_cluster = 0; // The new cluster will be written from the beginning
-            memset(&buffer, 0, sizeof(buffer)); // Clear buffer for the new cluster
+            memset(buffer, 0, vol->cluster_size); // Clear buffer for the new cluster
         }
     }
 
     // 4. Update directory entry with new size
-    union data_cluster parent_dir_content;
-    if (read_cluster(result.parent_cluster, &parent_dir_content) != 0) return -1;
-    parent_dir_content.dir[result.entry_index].size = original_size + content_len;
+    if (read_cluster(vol, result->slot_cluster, buffer) != 0) return -1;
+    buffer->dir[result->entry_index].size = original_size + content_len;
 
     // 5. Write all changes to disk
-    if (write_cluster(result.parent_cluster, &parent_dir_content) != 0) return -1;
-    for (uint16_t i = 0; i < FAT_CLUSTER_COUNT; ++i) { // Persist FAT
-        if (write_cluster(FAT_CLUSTER_START + i, (uint8_t*)g_fat_table + (i * CLUSTER_SIZE)) != 0) return -1;
-    }
+    if (write_meta(vol, result->slot_cluster, buffer) != 0) return -1;
+    forget_name(vol, result->parent_cluster, (const char*)result->entry.filename); // New size
+    open_file_changed(vol, result, result->entry.first_block, original_size + content_len, UINT32_MAX, new_first);
+    if (flush_fat(vol) != 0) return -1; // Persist the modified parts of the FAT
 
     printf("Appended %u bytes to '%s'.\n", content_len, path);
     return 0;
+}
+
+int fs_append_buf(fat_volume_t* vol, const char* path, const void* data, size_t length) {
+    path_search_result_t result;
+    int walk = begin_path_op(vol, path, DIR_EXCLUSIVE, true, &result);
+    if (walk != WALK_LOCKED || result.entry.attributes != ATTR_ARCHIVE) {
+        if (walk == WALK_LOCKED) end_path_op(vol, &result);
+        fprintf(stderr, "append: cannot append to '%s': No such file or not a file\n", path);
+        return -1;
+    }
+
+    int status = -1;
+    if (length > UINT32_MAX - result.entry.size) {
+        fprintf(stderr, "append: cannot append to '%s': File too large\n", path);
+    } else {
+        union data_cluster* buffer = alloc_clusters(vol, 1);
+        if (buffer != NULL) status = append_file(vol, path, &result, data, (uint32_t)length, buffer);
+        free(buffer);
+    }
+    if (end_path_op(vol, &result) != 0) status = -1;
+    return status;
+}
+
+int fs_append(fat_volume_t* vol, const char* path, const char* content) {
+    return fs_append_buf(vol, path, content, strlen(content));
+}
+
+// Fills 'buffer' from the source; only a source that returns 0 has no more data.
+// Returns the number of bytes stored, or -1 if the source failed.
+static int64_t fill_from_source(fs_source_t source, void* context, uint8_t* buffer, uint32_t size, bool* ended) {
+    uint32_t filled = 0;
+    while (filled < size) {
+        int64_t got = source(context, buffer + filled, size - filled);
+        if (got < 0) return -1;
+        if (got == 0) {
+            *ended = true;
+            break;
+        }
+        filled += (uint32_t)got;
+    }
+    return filled;
+}
+
+// Copies everything the source delivers to a new chain, allocating and writing it batch
+// by batch through 'buffer' (STREAM_BATCH_BYTES). On success, 'first_cluster' and 'total'
+// describe the new content; on failure, whatever part of the chain was built is left in
+// 'first_cluster' for the caller to free.
+static int write_new_chain(fat_volume_t* vol, const char* path, fs_source_t source, void* context, uint8_t* buffer, uint16_t* first_cluster, uint32_t* total) {
+    uint16_t last_cluster = 0;
+    bool ended = false;
+    while (!ended) {
+        int64_t filled = fill_from_source(source, context, buffer, STREAM_BATCH_BYTES, &ended);
+        if (filled < 0) {
+            fprintf(stderr, "write: cannot write to '%s': Error reading the source\n", path);
+            return -1;
+        }
+        if (filled == 0 && *first_cluster != 0) break;
+        if ((uint64_t)*total + (uint64_t)filled > UINT32_MAX) {
+            fprintf(stderr, "write: cannot write to '%s': File too large\n", path);
+            return -1;
+        }
+
+        // Each batch is allocated in one request, like overwrite_file() does for the whole file
+        uint32_t cluster_count = ((uint32_t)filled + vol->cluster_size - 1) / vol->cluster_size;
+        if (cluster_count == 0) {
+            cluster_count = 1; // Allocate one cluster even for an empty file
+        }
+        uint16_t chain = 0;
+        if (allocate_chain(vol, cluster_count, &chain) != 0) {
+            fprintf(stderr, "write: No space left on device\n");
+            return -1;
+        }
+        if (*first_cluster == 0) *first_cluster = chain;
+        else link_cluster(vol, last_cluster, chain);
+
+        memset(buffer + filled, 0, cluster_count * vol->cluster_size - (uint32_t)filled);
+        uint16_t current_cluster = chain;
+        for (uint32_t i = 0; i < cluster_count; ++i) {
+            if (write_cluster(vol, current_cluster, buffer + i * vol->cluster_size) != 0) return -1;
+            last_cluster = current_cluster;
+            current_cluster = vol->fat[current_cluster];
+        }
+        *total += (uint32_t)filled;
+    }
+    return 0;
+}
+
+// Writes the new content to a chain of its own, and only then points the entry at it and
+// frees the old chain: a failure leaves the file as it was. Works in 'buffer'
+// (STREAM_BATCH_BYTES). Called with the file's directory locked exclusively.
+static int stream_file(fat_volume_t* vol, const char* path, const path_search_result_t* result, fs_source_t source, void* context, union data_cluster* buffer) {
+    uint16_t first_cluster = 0;
+    uint32_t total = 0;
+    if (write_new_chain(vol, path, source, context, buffer->data, &first_cluster, &total) != 0 ||
+        read_cluster(vol, result->slot_cluster, buffer) != 0) {
+        if (first_cluster != 0) {
+            free_cluster_chain(vol, first_cluster);
+            flush_fat(vol);
+        }
+        return -1;
+    }
+
+    // Switch the entry to the new chain
+    buffer->dir[result->entry_index].first_block = first_cluster;
+    buffer->dir[result->entry_index].size = total;
+    if (write_meta(vol, result->slot_cluster, buffer) != 0) return -1;
+    forget_name(vol, result->parent_cluster, (const char*)result->entry.filename); // New first_block and size
+    open_file_changed(vol, result, first_cluster, total, 0, first_cluster);
+
+    free_cluster_chain(vol, result->entry.first_block);
+    if (flush_fat(vol) != 0) return -1; // Persist the modified parts of the FAT
+
+    printf("Wrote %u bytes to '%s'.\n", total, path);
+    return 0;
+}
+
+int fs_write_stream(fat_volume_t* vol, const char* path, fs_source_t source, void* context) {
+    path_search_result_t result;
+    int walk = begin_path_op(vol, path, DIR_EXCLUSIVE, true, &result);
+    if (walk != WALK_LOCKED || result.entry.attributes != ATTR_ARCHIVE) {
+        if (walk == WALK_LOCKED) end_path_op(vol, &result);
+        fprintf(stderr, "write: cannot write to '%s': No such file or not a file\n", path);
+        return -1;
+    }
+
+    union data_cluster* buffer = alloc_clusters(vol, STREAM_BATCH_BYTES / vol->cluster_size);
+    int status = (buffer != NULL) ? stream_file(vol, path, &result, source, context, buffer) : -1;
+    free(buffer);
+    if (end_path_op(vol, &result) != 0) status = -1;
+    return status;
+}
+
+// fs_source_t over a host file.
+static int64_t read_host_file(void* context, void* buffer, uint32_t size) {
+    FILE* host = (FILE*)context;
+    size_t got = fread(buffer, 1, size, host);
+    if (got == 0 && ferror(host)) {
+        return -1;
+    }
+    return (int64_t)got;
+}
+
+int fs_write_from_host(fat_volume_t* vol, const char* path, FILE* host) {
+    return fs_write_stream(vol, path, read_host_file, host);
+}
+
+// --- File Handles ---
+
+// Returns the file behind an open handle, or NULL after reporting why there is none.
+// Called with state_lock held.
+static open_file_t* get_open_file(fat_volume_t* vol, int handle, const char* operation) {
+    open_file_t* file = NULL;
+    if (handle >= 0 && handle < FS_MAX_HANDLES) {
+        file = __atomic_load_n(&vol->handles[handle], __ATOMIC_ACQUIRE);
+    }
+    if (file == NULL) {
+        fprintf(stderr, "%s: %d: Bad file handle\n", operation, handle);
+        return NULL;
+    }
+    if (file->lost) {
+        fprintf(stderr, "%s: %d: Stale file handle (the image was formatted or reloaded)\n", operation, handle);
+        return NULL;
+    }
+    return file;
+}
+
+// Returns a new handle on the file found by 'result', sharing the open file if it is
+// already open, or -1 if a table is full. Called with files_lock held and the directory locked.
+static int open_handle(fat_volume_t* vol, const path_search_result_t* result) {
+    int handle = 0;
+    while (handle < FS_MAX_HANDLES && vol->handles[handle] != NULL) {
+        handle++;
+    }
+    if (handle == FS_MAX_HANDLES) return -1;
+
+    open_file_t* file = find_open_file(vol, result->slot_cluster, result->entry_index);
+    if (file == NULL) {
+        for (int i = 0; i < MAX_OPEN_FILES && file == NULL; ++i) {
+            if (vol->files[i].refs == 0) file = &vol->files[i];
+        }
+        if (file == NULL) return -1;
+
+        memset(file, 0, sizeof(open_file_t));
+        memcpy(file->name, result->entry.filename, sizeof(file->name));
+        file->name[sizeof(file->name) - 1] = '\0';
+        file->parent_cluster = result->parent_cluster;
+        file->slot_cluster = result->slot_cluster;
+        file->entry_index = result->entry_index;
+        file->first_cluster = result->entry.first_block;
+        file->size = result->entry.size;
+        __atomic_add_fetch(&vol->open_file_count, 1, __ATOMIC_RELEASE);
+    }
+    file->refs++;
+    __atomic_store_n(&vol->handles[handle], file, __ATOMIC_RELEASE);
+    return handle;
+}
+
+int fs_open(fat_volume_t* vol, const char* path) {
+    path_search_result_t result;
+    if (begin_path_op(vol, path, DIR_SHARED, true, &result) != WALK_LOCKED) {
+        fprintf(stderr, "open: cannot open '%s': No such file or directory\n", path);
+        return -1;
+    }
+    if (result.entry.attributes != ATTR_ARCHIVE) {
+        fprintf(stderr, "open: cannot open '%s': Not a file\n", path);
+        end_path_op(vol, &result);
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->files_lock);
+    int handle = open_handle(vol, &result);
+    pthread_mutex_unlock(&vol->files_lock);
+    end_path_op(vol, &result);
+    if (handle < 0) {
+        fprintf(stderr, "open: cannot open '%s': Too many open files\n", path);
+    }
+    return handle;
+}
+
+// read_open_file() once the range is within the file. 'scratch' holds READ_BATCH_BYTES,
+// or is NULL with a mapped device.
+static int64_t copy_runs(fat_volume_t* vol, open_file_t* file, uint8_t* buffer, uint32_t count, uint32_t offset, uint8_t* scratch) {
+    uint32_t number = offset / vol->cluster_size;
+    uint32_t done = 0;
+    while (done < count) {
+        uint16_t run_start;
+        uint32_t run_left;
+        if (!seek_cluster(vol, file, number, &run_start, &run_left)) {
+            fprintf(stderr, "Error: The clusters of '%s' end before its size.\n", file->name);
+            return -1;
+        }
+
+        // Fetch as much of the contiguous run as the read needs with one read, as print_file() does
+        uint32_t in_cluster = (offset + done) % vol->cluster_size;
+        uint32_t run_length = (in_cluster + (count - done) + vol->cluster_size - 1) / vol->cluster_size;
+        if (run_length > run_left) run_length = run_left;
+        if (run_length > READ_BATCH_BYTES / vol->cluster_size) run_length = READ_BATCH_BYTES / vol->cluster_size;
+
+        const uint8_t* data = peek_clusters(vol, run_start, run_length, scratch);
+        if (data == NULL) return -1;
+        uint32_t len = run_length * vol->cluster_size - in_cluster;
+        if (len > count - done) len = count - done;
+        memcpy(buffer + done, data + in_cluster, len);
+        done += len;
+        number += run_length;
+    }
+    return count;
+}
+
+// Called with the file's directory locked.
+static int64_t read_open_file(fat_volume_t* vol, open_file_t* file, uint8_t* buffer, uint32_t count, uint32_t offset) {
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (count > file->size - offset) {
+        count = file->size - offset;
+    }
+
+    uint8_t* scratch = NULL;
+    if (vol->map == NULL) {
+        scratch = (uint8_t*)alloc_clusters(vol, READ_BATCH_BYTES / vol->cluster_size);
+        if (scratch == NULL) return -1;
+    }
+    int64_t status = copy_runs(vol, file, buffer, count, offset, scratch);
+    free(scratch);
+    return status;
+}
+
+int64_t fs_pread(fat_volume_t* vol, int handle, void* buffer, uint32_t count, uint32_t offset) {
+    lock_state(vol, false);
+    open_file_t* file = get_open_file(vol, handle, "pread");
+    int64_t status = -1;
+    if (file != NULL) {
+        lock_dir(vol, file->parent_cluster, DIR_SHARED);
+        status = read_open_file(vol, file, buffer, count, offset);
+        unlock_dir(vol, file->parent_cluster);
+    }
+    unlock_state(vol);
+    return status;
+}
+
+// Works in 'buffer' (one cluster). Called with the file's directory locked exclusively.
+static int64_t write_open_file(fat_volume_t* vol, open_file_t* file, const uint8_t* data, uint32_t count, uint32_t offset, union data_cluster* buffer) {
+    if (count == 0) {
+        return 0;
+    }
+    if (offset > UINT32_MAX - count) {
+        fprintf(stderr, "pwrite: File too large\n");
+        return -1;
+    }
+    uint32_t end = offset + count;
+    uint32_t old_size = file->size;
+
+    // Every file owns at least one cluster, even when empty
+    uint32_t have = (uint32_t)(((uint64_t)old_size + vol->cluster_size - 1) / vol->cluster_size);
+    if (have == 0) have = 1;
+    uint32_t need = (uint32_t)(((uint64_t)end + vol->cluster_size - 1) / vol->cluster_size);
+    bool grown = false;
+    if (need > have) {
+        // All the new clusters in one request, chained after the current last one
+        uint16_t last_cluster;
+        uint32_t run_left;
+        if (!seek_cluster(vol, file, have - 1, &last_cluster, &run_left)) {
+            fprintf(stderr, "Error: The clusters of '%s' end before its size.\n", file->name);
+            return -1;
+        }
+        uint16_t new_first = 0;
+        if (allocate_chain(vol, need - have, &new_first) != 0) {
+            fprintf(stderr, "pwrite: No space left on device\n");
+            return -1;
+        }
+        link_cluster(vol, last_cluster, new_first);
+        extend_extents(vol, file, new_first);
+        grown = true;
+    }
+
+    // Writing starts at the old end of the file when 'offset' is past it, so that the
+    // bytes in between are zeroed
+    uint32_t position = (offset > old_size) ? old_size : offset;
+    uint32_t number = position / vol->cluster_size;
+    uint16_t current_cluster = 0;
+    uint32_t run_left = 0;
+    while (position < end) {
+        if (run_left > 0) {
+            current_cluster++; // Still inside the same run
+        } else if (!seek_cluster(vol, file, number, &current_cluster, &run_left)) {
+            fprintf(stderr, "Error: The clusters of '%s' end before its size.\n", file->name);
+            return -1;
+        }
+        run_left--;
+
+        uint32_t in_cluster = position % vol->cluster_size;
+        uint32_t len = vol->cluster_size - in_cluster;
+        if (len > end - position) len = end - position;
+
+        // Only clusters that are partly kept have to be read; new ones start out empty
+        if (len < vol->cluster_size && number < have) {
+            if (read_cluster(vol, current_cluster, buffer) != 0) return -1;
+        } else {
+            memset(buffer, 0, vol->cluster_size);
+        }
+        uint32_t gap = 0;
+        if (position < offset) {
+            gap = (offset - position < len) ? offset - position : len;
+            memset(buffer->data + in_cluster, 0, gap);
+        }
+        if (len > gap) {
+            memcpy(buffer->data + in_cluster + gap, data + (position + gap - offset), len - gap);
+        }
+        if (write_cluster(vol, current_cluster, buffer) != 0) return -1;
+
+        position += len;
+        number++;
+    }
+
+    if (end > old_size) {
+        file->size = end;
+        // An unlinked file has no entry left; its slot may already belong to another file
+        if (!file->unlinked) {
+            if (read_cluster(vol, file->slot_cluster, buffer) != 0) return -1;
+            buffer->dir[file->entry_index].size = end;
+            if (write_meta(vol, file->slot_cluster, buffer) != 0) return -1;
+            forget_name(vol, file->parent_cluster, file->name); // New size
+        }
+    }
+    if (grown && flush_fat(vol) != 0) return -1; // Persist the modified parts of the FAT
+    return count;
+}
+
+int64_t fs_pwrite(fat_volume_t* vol, int handle, const void* buffer, uint32_t count, uint32_t offset) {
+    lock_state(vol, false);
+    open_file_t* file = get_open_file(vol, handle, "pwrite");
+    int64_t status = -1;
+    if (file != NULL) {
+        union data_cluster* cluster_buffer = alloc_clusters(vol, 1);
+        lock_dir(vol, file->parent_cluster, DIR_EXCLUSIVE);
+        if (cluster_buffer != NULL && begin_transaction(vol) == 0) {
+            status = write_open_file(vol, file, buffer, count, offset, cluster_buffer);
+            if (end_transaction(vol) != 0) status = -1;
+        }
+        unlock_dir(vol, file->parent_cluster);
+        free(cluster_buffer);
+    }
+    unlock_state(vol);
+    return status;
+}
+
+int fs_close(fat_volume_t* vol, int handle) {
+    lock_state(vol, false);
+    pthread_mutex_lock(&vol->files_lock);
+    open_file_t* file = (handle >= 0 && handle < FS_MAX_HANDLES) ? vol->handles[handle] : NULL;
+    if (file == NULL) {
+        pthread_mutex_unlock(&vol->files_lock);
+        unlock_state(vol);
+        fprintf(stderr, "close: %d: Bad file handle\n", handle);
+        return -1;
+    }
+
+    int status = 0;
+    __atomic_store_n(&vol->handles[handle], NULL, __ATOMIC_RELEASE);
+    if (--file->refs == 0) {
+        // The last handle of an unlinked file: nothing else can reach its clusters now
+        if (file->unlinked && !file->lost) {
+            if (begin_transaction(vol) == 0) {
+                free_cluster_chain(vol, file->first_cluster);
+                status = flush_fat(vol);
+                if (end_transaction(vol) != 0) status = -1;
+            } else {
+                status = -1; // After a failed commit the clusters are left allocated
+            }
+        }
+        free_extents(file->extents);
+        file->extents = NULL;
+        __atomic_sub_fetch(&vol->open_file_count, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&vol->files_lock);
+    unlock_state(vol);
+    return status;
 }
\ No newline at end of file
@@ -5,21 +5,29 @@
 #include <stdio.h>  // For FILE*
 #include <stdlib.h> // For malloc, free, exit
 #include <stdbool.h>
+#include "cluster_cache.h"
+#include "block_dev.h"
+#include "journal.h"
 
 // --- File System Constants ---
 #define PARTITION_NAME "fat.part"
 
-#define SECTOR_SIZE 512
-#define CLUSTER_SIZE 1024
-#define CLUSTER_COUNT 4096
-#define PARTITION_SIZE (CLUSTER_SIZE * CLUSTER_COUNT) // 4MB
+#define SECTOR_SIZE 512 // The superblock fits in the first sector, whatever the cluster size
 
-// Partition layout (in clusters)
+// Geometry limits. fs_format() picks the geometry of an image within them and records it
+// in the superblock; the default one is a 4 MB image of 1 KB clusters.
+#define FS_MIN_CLUSTER_SIZE SECTOR_SIZE
+#define FS_MAX_CLUSTER_SIZE 65536
+#define FS_MIN_CLUSTER_COUNT 64
+#define FS_MAX_CLUSTER_COUNT 0xFFF0 // Cluster numbers stay below the special FAT entries
+#define FS_DEFAULT_CLUSTER_SIZE 1024
+#define FS_DEFAULT_CLUSTER_COUNT 4096
+
+// Partition layout (in clusters): the superblock, the FAT right after it, then the root
+// directory and the data area; the metadata journal fills the end of the partition.
+// Where each of them starts depends on the geometry (see fs_geometry_t).
 #define BOOT_BLOCK_CLUSTER 0
 #define FAT_CLUSTER_START 1
-#define FAT_CLUSTER_COUNT 8
-#define ROOT_DIR_CLUSTER 9
-#define DATA_CLUSTER_START 10
 
 // --- FAT Constants ---
 #define FAT_ENTRY_FREE 0x0000
@@ -29,17 +37,32 @@
 
 // --- Directory Constants ---
 #define DIR_ENTRY_SIZE 32
-#define DIR_ENTRIES_PER_CLUSTER (CLUSTER_SIZE / DIR_ENTRY_SIZE)
 #define ATTR_ARCHIVE 0
 #define ATTR_DIRECTORY 1
 
-// --- Global FAT Table ---
-// The in-memory copy of the File Allocation Table.
-// 'extern' means it's defined in a .c file.
-extern uint16_t g_fat_table[CLUSTER_COUNT];
+// --- File Handle Constants ---
+#define FS_MAX_HANDLES 256 // Handles open at the same time, per volume
 
 // --- Data Structures ---
 
+// An open FAT16 image: its block device, in-memory FAT, allocator and cluster cache.
+// Every fs_* function works on the volume passed as its first argument.
+typedef struct fat_volume fat_volume_t;
+
+// How the partition file is accessed.
+typedef enum {
+    FS_BACKEND_FILE,         // preadv/pwritev through the cluster cache (default)
+    FS_BACKEND_MMAP          // The whole partition is mmap'ed; clusters are read in place
+} fs_backend_t;
+
+// When the device is flushed (fdatasync for files, msync for mappings). Only images with
+// a journal honor it; fs_sync() always flushes.
+typedef enum {
+    FS_DURABILITY_NONE,      // Never: changes survive a crash of the program, not of the OS
+    FS_DURABILITY_COMMIT,    // Once per commit: an operation's metadata is durable when it returns (default)
+    FS_DURABILITY_STRICT     // Also before each commit, so the file data an operation wrote is durable with it
+} fs_durability_t;
+
 // Directory entry (32 bytes)
 typedef struct {
     uint8_t filename[18];    // File or directory name
@@ -49,124 +72,447 @@ typedef struct {
     uint32_t size;           // File size in bytes
 } dir_entry_t;
 
-// Cluster used for data or directories (1024 bytes)
+// Longest name a directory entry holds: the last byte of 'filename' is its terminator
+#define NAME_MAX_LENGTH (sizeof(((dir_entry_t*)0)->filename) - 1)
+
+// Cluster used for data or directories. Sized for the largest clusters; only the first
+// cluster_size bytes of it belong to the cluster (cluster_size / DIR_ENTRY_SIZE entries).
 union data_cluster {
-    dir_entry_t dir[DIR_ENTRIES_PER_CLUSTER]; // As directory
-    uint8_t data[CLUSTER_SIZE];               // As raw data
+    dir_entry_t dir[FS_MAX_CLUSTER_SIZE / DIR_ENTRY_SIZE]; // As directory
+    uint8_t data[FS_MAX_CLUSTER_SIZE];                     // As raw data
 };
 
+// Geometry of an image. fs_format() takes the cluster size and count and works out the
+// rest; fs_get_geometry() reports all of it for the loaded image.
+typedef struct {
+    uint32_t cluster_size;       // Bytes per cluster: a power of two, FS_MIN_CLUSTER_SIZE to FS_MAX_CLUSTER_SIZE
+    uint32_t cluster_count;      // Clusters in the partition, FS_MIN_CLUSTER_COUNT to FS_MAX_CLUSTER_COUNT
+    uint32_t fat_clusters;       // Clusters of the FAT, from FAT_CLUSTER_START on
+    uint32_t root_dir_cluster;   // First cluster of the root directory
+    uint32_t data_cluster_start; // First cluster files and directories can get
+    uint32_t journal_start;      // First cluster of the journal (its header)
+    uint32_t journal_clusters;   // Clusters in the journal; 0 on images formatted without one
+} fs_geometry_t;
+
+// Supplies the data of fs_write_stream(): stores up to 'size' bytes in 'buffer' and returns
+// how many it stored, 0 once there is no more data, or -1 on error. It may return fewer
+// bytes than asked for without being at the end.
+typedef int64_t (*fs_source_t)(void* context, void* buffer, uint32_t size);
+
+// Receives the data of fs_read_stream(), one chunk at a time and in file order. 'data'
+// is only valid during the call. Returns 0 to get the next chunk, or anything else to stop.
+typedef int (*fs_sink_t)(void* context, const void* data, uint32_t length);
+
 // --- Helper Structures ---
 
 // Holds the result of a search operation for a file/directory.
 typedef struct {
-    char name[18];             // The last component of the path searched for
+    char name[NAME_MAX_LENGTH + 1]; // The last component of the path searched for
     bool found;                // True if the entry was found
-    uint16_t parent_cluster;   // Cluster number of the parent directory
+    uint16_t parent_cluster;   // First cluster of the parent directory
+    uint16_t slot_cluster;     // The cluster of the parent directory's chain that holds the entry
     uint16_t entry_cluster;    // The first cluster of the found entry itself
-    uint32_t entry_index;      // The index (0-31) of the entry within the parent directory
+    uint32_t entry_index;      // The index of the entry within slot_cluster
     dir_entry_t entry;         // A copy of the directory entry
 } path_search_result_t;
 
 // --- Prototypes for High-Level FS Operations ---
 /**
  * @brief Deletes a file or an empty directory.
+ * @param vol The volume to operate on.
  * @param path The absolute path to the file or directory to delete.
  * @return 0 on success, -1 on error.
  */
-int fs_unlink(const char* path);
+int fs_unlink(fat_volume_t* vol, const char* path);
 
 /**
  * @brief Reads the content of a file and prints it to the console.
+ * @param vol The volume to operate on.
  * @param path The absolute path of the file to read.
  * @return 0 on success, -1 on error.
  */
-int fs_read(const char* path);
+int fs_read(fat_volume_t* vol, const char* path);
+
+/**
+ * @brief Copies part of a file into a buffer.
+ * @param vol The volume to operate on.
+ * @param path The absolute path of the file to read.
+ * @param offset Position in the file of the first byte to read.
+ * @param length Number of bytes to read; reads stop at the end of the file.
+ * @param buffer Receives the bytes read (at least 'length' bytes).
+ * @return The number of bytes read (0 at or past the end of the file), or -1 on error.
+ */
+int64_t fs_read_buf(fat_volume_t* vol, const char* path, uint32_t offset, uint32_t length, void* buffer);
+
+/**
+ * @brief Hands part of a file to a callback, one run of contiguous clusters at a time.
+ * With the mmap and RAM backends, the chunks point straight into the device's memory
+ * and nothing is copied; otherwise each run is fetched with a single read. The file's
+ * directory stays locked (shared) while the callback runs, so it must not change
+ * that directory.
+ * @param vol The volume to operate on.
+ * @param path The absolute path of the file to read.
+ * @param offset Position in the file of the first byte to deliver.
+ * @param length Number of bytes to deliver; delivery stops at the end of the file.
+ * @param sink Called with each chunk.
+ * @param context Passed to 'sink'.
+ * @return The number of bytes delivered (fewer if 'sink' stopped early), or -1 on error.
+ */
+int64_t fs_read_stream(fat_volume_t* vol, const char* path, uint32_t offset, uint32_t length, fs_sink_t sink, void* context);
 
 /**
  * @brief Writes a string to a file, overwriting any existing content.
+ * @param vol The volume to operate on.
  * @param path The absolute path of the file to write to.
  * @param content The string content to write.
  * @return 0 on success, -1 on error.
  */
-int fs_write(const char* path, const char* content);
+int fs_write(fat_volume_t* vol, const char* path, const char* content);
 
 /**
  * @brief Appends a string to the end of a file.
+ * @param vol The volume to operate on.
  * @param path The absolute path of the file to append to.
  * @param content The string content to append.
  * @return 0 on success, -1 on error.
  */
-int fs_append(const char* path, const char* content);
+int fs_append(fat_volume_t* vol, const char* path, const char* content);
+
+/**
+ * @brief Writes 'length' bytes to a file, overwriting any existing content. Unlike fs_write(),
+ * the data may hold any bytes, including zeros.
+ * @param vol The volume to operate on.
+ * @param path The absolute path of the file to write to.
+ * @param data The bytes to write.
+ * @param length Number of bytes to write.
+ * @return 0 on success, -1 on error.
+ */
+int fs_write_buf(fat_volume_t* vol, const char* path, const void* data, size_t length);
+
+/**
+ * @brief Appends 'length' bytes to the end of a file. Unlike fs_append(), the data may
+ * hold any bytes, including zeros.
+ * @param vol The volume to operate on.
+ * @param path The absolute path of the file to append to.
+ * @param data The bytes to append.
+ * @param length Number of bytes to append.
+ * @return 0 on success, -1 on error.
+ */
+int fs_append_buf(fat_volume_t* vol, const char* path, const void* data, size_t length);
+
+/**
+ * @brief Replaces the content of a file with everything a source delivers, pulled in
+ * batches of a few clusters so that the data never has to be in memory at once.
+ * The new content goes to new clusters and the old ones are only freed at the end:
+ * if the source fails or the disk fills up, the file keeps its old content.
+ * The file's directory stays locked while the source runs, so the source must not
+ * use that directory.
+ * @param vol The volume to operate on.
+ * @param path The absolute path of the file to write to.
+ * @param source Called for the data until it returns 0.
+ * @param context Passed to 'source'.
+ * @return 0 on success, -1 on error.
+ */
+int fs_write_stream(fat_volume_t* vol, const char* path, fs_source_t source, void* context);
+
+/**
+ * @brief fs_write_stream() from a host file, read from its current position to its end.
+ * @param vol The volume to operate on.
+ * @param path The absolute path of the file to write to.
+ * @param host The host file to copy, opened for reading.
+ * @return 0 on success, -1 on error.
+ */
+int fs_write_from_host(fat_volume_t* vol, const char* path, FILE* host);
 /**
  * @brief Creates a new directory.
+ * @param vol The volume to operate on.
  * @param path The absolute path of the new directory to create.
  * @return 0 on success, -1 on error.
  */
-int fs_mkdir(const char* path);
+int fs_mkdir(fat_volume_t* vol, const char* path);
 
 /**
  * @brief Creates a new, empty file.
+ * @param vol The volume to operate on.
  * @param path The absolute path of the new file to create.
  * @return 0 on success, -1 on error.
  */
-int fs_create(const char* path);
+int fs_create(fat_volume_t* vol, const char* path);
+
+/**
+ * @brief Opens a file and returns a handle for fs_pread() and fs_pwrite().
+ * The path is resolved once; the handle remembers where the directory entry lives, the
+ * file's first cluster and size, and (from the first access on) the runs of contiguous
+ * clusters in its chain, so reads and writes through it neither walk the path nor the FAT:
+ * the cluster holding any offset is found with a binary search. All handles on a file share
+ * that state, and they keep the file alive: after fs_unlink() its name is gone, but its
+ * clusters are only freed when the last handle is closed.
+ * @param vol The volume to operate on.
+ * @param path The absolute path of the file to open.
+ * @return The handle (0 to FS_MAX_HANDLES - 1), or -1 on error.
+ */
+int fs_open(fat_volume_t* vol, const char* path);
+
+/**
+ * @brief Reads up to 'count' bytes of an open file, starting at 'offset'.
+ * @param vol The volume to operate on.
+ * @param handle A handle returned by fs_open().
+ * @param buffer Receives the bytes read.
+ * @param count Number of bytes to read.
+ * @param offset Position in the file of the first byte to read.
+ * @return The number of bytes read (0 at or past the end of the file), or -1 on error.
+ */
+int64_t fs_pread(fat_volume_t* vol, int handle, void* buffer, uint32_t count, uint32_t offset);
+
+/**
+ * @brief Writes 'count' bytes to an open file at 'offset', in place. The file grows as
+ * needed; if 'offset' is past its end, the bytes in between read back as zeros.
+ * @param vol The volume to operate on.
+ * @param handle A handle returned by fs_open().
+ * @param buffer The bytes to write.
+ * @param count Number of bytes to write.
+ * @param offset Position in the file of the first byte to write.
+ * @return The number of bytes written, or -1 on error.
+ */
+int64_t fs_pwrite(fat_volume_t* vol, int handle, const void* buffer, uint32_t count, uint32_t offset);
+
+/**
+ * @brief Closes a handle. Closing the last handle of an unlinked file frees its clusters.
+ * Handles opened before fs_format() or fs_load_fat() can only be closed.
+ * @param vol The volume to operate on.
+ * @param handle A handle returned by fs_open().
+ * @return 0 on success, -1 if the handle isn't open.
+ */
+int fs_close(fat_volume_t* vol, int handle);
 
 /**
  * @brief Finds a file or directory by its absolute path.
  *
+ * @param vol The volume to operate on.
  * @param path The absolute path to the entry (e.g., "/dir1/file.txt").
  * @param result A pointer to a struct that will be filled with search results.
  * @return 0 on success (even if not found), -1 on critical error.
  */
-int find_entry_by_path(const char* path, path_search_result_t* result);
+int find_entry_by_path(fat_volume_t* vol, const char* path, path_search_result_t* result);
 
 /**
  * @brief Lists the contents of a directory.
+ * @param vol The volume to operate on.
  * @param path The absolute path to the directory.
  * @return 0 on success, -1 on error (e.g., path not found or not a directory).
  */
-int fs_ls(const char* path);
+int fs_ls(fat_volume_t* vol, const char* path);
 
 /**
- * @brief Formats the virtual disk. Creates fat.part, writes the boot block,
- * initializes and writes the FAT, and creates an empty root directory.
- * @return 0 on success, -1 on error.
+ * @brief Formats the virtual disk. Creates the image file (or reuses an attached device), writes
+ * the superblock with the geometry, initializes and writes the FAT, creates an empty root
+ * directory and an empty metadata journal at the end of the partition.
+ * @param vol The volume to operate on.
+ * @param geometry The cluster size and count to use (the other fields are ignored), or NULL
+ * for the default geometry; on an attached device, NULL takes the device's block size and
+ * as many of its blocks as the FAT can address. An attached device must have blocks of
+ * the cluster size and at least as many of them as the image has clusters.
+ * @return 0 on success, -1 on error (including an unsupported geometry).
  */
-int fs_format();
+int fs_format(fat_volume_t* vol, const fs_geometry_t* geometry);
 
 /**
- * @brief Loads the FAT from the virtual disk into the g_fat_table array.
+ * @brief Loads the FAT from the virtual disk into the volume's in-memory FAT, after taking the
+ * geometry from the superblock (images formatted before it existed have the default one). If the image has
+ * a journal, the operations committed to it first reach their home locations (so an image
+ * that went down in the middle of operations comes back with each of them either done or
+ * not); images formatted without one are used as before.
+ * @param vol The volume to operate on.
  * @return 0 on success, -1 on error.
  */
-int fs_load_fat();
+int fs_load_fat(fat_volume_t* vol);
 
 // --- Low-Level Function Prototypes (Phase 1) ---
 
 /**
- * @brief Opens the virtual partition file and keeps it globally accessible.
- * @return 0 on success, -1 on failure.
+ * @brief Opens a volume backed by an image file, with the geometry its superblock records.
+ * A missing file is not an error: the volume is returned without a device and fs_format()
+ * will create the file.
+ * @param path Path of the image file (e.g. PARTITION_NAME).
+ * @return The volume, or NULL on failure.
+ */
+fat_volume_t* fs_open_volume(const char* path);
+
+/**
+ * @brief Opens a volume on a caller-provided block device (e.g. a RAM disk or a latency wrapper).
+ * The device is not closed by fs_close_volume(); it still belongs to the caller.
+ * @param dev Device whose block size is a supported cluster size, with at least
+ * FS_MIN_CLUSTER_COUNT blocks.
+ * @return The volume, or NULL on failure.
+ */
+fat_volume_t* fs_attach_volume(block_dev_t* dev);
+
+/**
+ * @brief Flushes the cluster cache, empties the journal, closes the image file and frees the volume.
+ * @param vol The volume to close (may be NULL).
+ */
+void fs_close_volume(fat_volume_t* vol);
+
+/**
+ * @brief Selects how the partition file is accessed. Pending changes are flushed first.
+ * With FS_BACKEND_MMAP, lookups and reads use the mapping directly and fs_sync() calls msync.
+ * @param vol The volume to operate on.
+ * @param backend The backend to use from now on.
+ * @return 0 on success, -1 on error.
  */
-int init_fs();
+int fs_set_backend(fat_volume_t* vol, fs_backend_t backend);
 
 /**
- * @brief Closes the virtual partition file.
+ * @brief Writes every dirty cached cluster to the virtual disk and flushes the file.
+ * Changes made through write_cluster() are only guaranteed to be on disk after this call.
+ * @param vol The volume to operate on.
+ * @return 0 on success, -1 on error.
  */
-void close_fs();
+int fs_sync(fat_volume_t* vol);
 
 /**
- * @brief Reads a cluster from the virtual disk.
+ * @brief Sets when the device is flushed. With FS_DURABILITY_NONE nothing is flushed, not
+ * even the journal. FS_DURABILITY_COMMIT flushes once per journal record, shared by the
+ * operations that commit together, and once per checkpoint. A crash then loses no
+ * operation that returned, though a file may hold older data. FS_DURABILITY_STRICT also
+ * writes the cache home and flushes before every record, so a file's data is on disk
+ * before the entry that covers it.
+ * @param vol The volume to operate on.
+ * @param level The new durability level.
+ */
+void fs_set_durability(fat_volume_t* vol, fs_durability_t level);
+
+/**
+ * @brief Opens a batch: the operations the calling thread runs on the volume until
+ * fs_batch_commit() are committed together. Each directory and FAT cluster they change is
+ * logged once, however many of them change it, instead of once per operation. Other
+ * threads wait until the batch is committed. A batch too large for one journal record is
+ * committed in several parts. On an image without a journal the operations are written
+ * as usual and only flushed at the end.
+ * @param vol The volume to operate on.
+ * @return 0 on success, -1 if the thread already has a batch open or on error.
+ */
+int fs_batch_begin(fat_volume_t* vol);
+
+/**
+ * @brief Commits the calling thread's batch: the file data it wrote is written and
+ * flushed first, then its metadata is logged as one record with a single flush (neither
+ * is flushed with FS_DURABILITY_NONE). Formatting, loading, switching backends and
+ * resizing the cache are refused while a batch is open; fs_close_volume() commits it.
+ * @param vol The volume with the open batch.
+ * @return 0 on success, -1 if no batch is open or on error.
+ */
+int fs_batch_commit(fat_volume_t* vol);
+
+/**
+ * @brief Resizes the cluster cache. Dirty clusters are flushed first.
+ * @param vol The volume to operate on.
+ * @param cluster_count Number of clusters the cache can hold (minimum 1).
+ * @return 0 on success, -1 on error.
+ */
+int fs_set_cache_size(fat_volume_t* vol, size_t cluster_count);
+
+/**
+ * @brief Copies the cluster cache counters (hits, misses, evictions, writebacks).
+ * @param vol The volume to operate on.
+ * @param stats Struct that receives the counters.
+ */
+void fs_get_cache_stats(fat_volume_t* vol, cache_stats_t* stats);
+
+/**
+ * @brief Copies the journal counters (operations, commits, clusters logged, checkpoints).
+ * They stay at 0 for an image without a journal.
+ * @param vol The volume to operate on.
+ * @param stats Struct that receives the counters.
+ */
+void fs_get_journal_stats(fat_volume_t* vol, journal_stats_t* stats);
+
+/**
+ * @brief Copies the geometry of the image: the one fs_format() chose or the superblock
+ * recorded, or for a volume that has neither yet, the one fs_format(vol, NULL) would use.
+ * @param vol The volume to operate on.
+ * @param geometry Struct that receives the geometry.
+ */
+void fs_get_geometry(fat_volume_t* vol, fs_geometry_t* geometry);
+
+/**
+ * @brief Turns the in-memory hash index of large directories on or off (on by default).
+ * Indexed directories are looked up by reading a single cluster; turning the index off
+ * frees all indexes and goes back to scanning every cluster of a directory.
+ * @param vol The volume to operate on.
+ * @param enabled True to index directories that span more than one cluster.
+ */
+void fs_set_dir_index(fat_volume_t* vol, bool enabled);
+
+/**
+ * @brief Turns the dentry cache on or off (on by default). The cache remembers recent
+ * lookups by (directory, name), including names that don't exist, so that resolving a
+ * path it has seen before takes a few hash probes instead of reading each directory.
+ * @param vol The volume to operate on.
+ * @param enabled True to cache lookups.
+ */
+void fs_set_dentry_cache(fat_volume_t* vol, bool enabled);
+
+/**
+ * @brief Reads a cluster from the virtual disk (served from the cache when possible).
+ * @param vol The volume to operate on.
  * @param cluster_index Index of the cluster to read.
- * @param buffer Preallocated buffer (size = CLUSTER_SIZE) to store the data.
+ * @param buffer Preallocated buffer (size = the cluster size) to store the data.
  * @return 0 on success, -1 on failure.
  */
-int read_cluster(uint16_t cluster_index, void* buffer);
+int read_cluster(fat_volume_t* vol, uint16_t cluster_index, void* buffer);
 
 /**
  * @brief Writes the contents of a buffer to a cluster on the virtual disk.
+ * The write lands in the cache and reaches the disk on eviction or at fs_sync().
+ * @param vol The volume to operate on.
  * @param cluster_index Index of the cluster to write.
- * @param buffer Buffer (size = CLUSTER_SIZE) containing the data to write.
+ * @param buffer Buffer (size = the cluster size) containing the data to write.
+ * @return 0 on success, -1 on failure.
+ */
+int write_cluster(fat_volume_t* vol, uint16_t cluster_index, const void* buffer);
+
+/**
+ * @brief Reads 'count' adjacent clusters into a contiguous buffer.
+ * Cached clusters are copied from memory; each uncached stretch costs a single preadv.
+ * @param vol The volume to operate on.
+ * @param start Index of the first cluster to read.
+ * @param count Number of clusters to read.
+ * @param buffer Preallocated buffer (size = count * cluster_size).
+ * @return 0 on success, -1 on failure.
+ */
+int read_clusters(fat_volume_t* vol, uint16_t start, uint32_t count, void* buffer);
+
+/**
+ * @brief Scatter variant of read_clusters(): cluster start + i is stored in buffers[i].
+ * @param vol The volume to operate on.
+ * @param start Index of the first cluster to read.
+ * @param count Number of clusters to read.
+ * @param buffers 'count' preallocated buffers of cluster_size bytes each.
+ * @return 0 on success, -1 on failure.
+ */
+int read_clusters_v(fat_volume_t* vol, uint16_t start, uint32_t count, void* const* buffers);
+
+/**
+ * @brief Writes 'count' adjacent clusters from a contiguous buffer.
+ * Like write_cluster(), the data is staged in the cache; adjacent dirty clusters
+ * are written back together with a single pwritev.
+ * @param vol The volume to operate on.
+ * @param start Index of the first cluster to write.
+ * @param count Number of clusters to write.
+ * @param buffer Buffer (size = count * cluster_size) containing the data to write.
+ * @return 0 on success, -1 on failure.
+ */
+int write_clusters(fat_volume_t* vol, uint16_t start, uint32_t count, const void* buffer);
+
+/**
+ * @brief Gather variant of write_clusters(): buffers[i] is written to cluster start + i.
+ * @param vol The volume to operate on.
+ * @param start Index of the first cluster to write.
+ * @param count Number of clusters to write.
+ * @param buffers 'count' buffers of cluster_size bytes each.
  * @return 0 on success, -1 on failure.
  */
-int write_cluster(uint16_t cluster_index, const void* buffer);
+int write_clusters_v(fat_volume_t* vol, uint16_t start, uint32_t count, const void* const* buffers);
 
 #endif // FAT_FS_H
\ No newline at end of file
@@ -0,0 +1,314 @@
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The header cluster starts with this; the rest of it is zero.
+typedef struct {
+    uint32_t magic;            // JOURNAL_MAGIC
+    uint32_t tail;             // Offset in the log of the oldest record still needed
+    uint32_t tail_sequence;    // Sequence number of that record
+} journal_header_t;
+
+// The first cluster of a record starts with this, followed by the home cluster of every
+// image and then by the revoked clusters (uint16_t each). The descriptor takes as many
+// clusters as that needs, and the images follow it.
+typedef struct {
+    uint32_t magic;            // JOURNAL_RECORD_MAGIC
+    uint32_t sequence;         // One more than the previous record's
+    uint32_t checksum;         // Of the whole record, computed with this field set to 0
+    uint16_t descriptor_clusters;
+    uint16_t image_count;
+    uint16_t revoke_count;
+    uint16_t reserved;
+} record_header_t;
+
+// FNV-1a over 64-bit words. A record is a whole number of clusters, so the length is
+// always a multiple of 8.
+static uint64_t checksum_update(uint64_t hash, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+static uint32_t checksum_final(uint64_t hash) {
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+#define CHECKSUM_SEED 0xCBF29CE484222325ull
+
+// Device cluster of an offset in the log; offsets past the end wrap around.
+static uint32_t log_cluster(const journal_t* journal, uint32_t offset) {
+    return journal->start + 1 + (offset % journal->length);
+}
+
+// Reads or writes 'count' clusters of the log from 'offset' on, as two runs when they
+// wrap around the end.
+static int read_log(const journal_t* journal, block_dev_t* dev, uint32_t offset, uint32_t count, void* const* buffers) {
+    offset %= journal->length;
+    uint32_t first = (count < journal->length - offset) ? count : journal->length - offset;
+    if (bdev_readv(dev, log_cluster(journal, offset), first, buffers) != 0) return -1;
+    if (first < count && bdev_readv(dev, log_cluster(journal, 0), count - first, buffers + first) != 0) return -1;
+    return 0;
+}
+
+static int write_log(const journal_t* journal, block_dev_t* dev, uint32_t offset, uint32_t count, const void* const* buffers) {
+    offset %= journal->length;
+    uint32_t first = (count < journal->length - offset) ? count : journal->length - offset;
+    if (bdev_writev(dev, log_cluster(journal, offset), first, buffers) != 0) return -1;
+    if (first < count && bdev_writev(dev, log_cluster(journal, 0), count - first, buffers + first) != 0) return -1;
+    return 0;
+}
+
+static int write_header(block_dev_t* dev, uint32_t start, uint32_t tail, uint32_t tail_sequence) {
+    uint8_t* cluster = calloc(1, dev->block_size);
+    if (cluster == NULL) {
+        fprintf(stderr, "Error: Could not allocate the journal header.\n");
+        return -1;
+    }
+    journal_header_t header = { JOURNAL_MAGIC, tail, tail_sequence };
+    memcpy(cluster, &header, sizeof(header));
+    const void* buffers[1] = { cluster };
+    int status = bdev_writev(dev, start, 1, buffers);
+    free(cluster);
+    return status;
+}
+
+static int read_header(block_dev_t* dev, uint32_t start, journal_header_t* header) {
+    uint8_t* cluster = malloc(dev->block_size);
+    if (cluster == NULL) {
+        fprintf(stderr, "Error: Could not allocate the journal header.\n");
+        return -1;
+    }
+    void* buffers[1] = { cluster };
+    int status = bdev_readv(dev, start, 1, buffers);
+    if (status == 0) memcpy(header, cluster, sizeof(*header));
+    free(cluster);
+    return status;
+}
+
+int journal_format(block_dev_t* dev, uint32_t start, uint32_t clusters) {
+    if (clusters < 2 || start + clusters > dev->block_count) {
+        fprintf(stderr, "Error: Invalid journal area (%u clusters at %u).\n", clusters, start);
+        return -1;
+    }
+
+    // A record left in the area by an earlier journal must never pass for a new one. Its
+    // sequence number is below the old tail's plus the size of the log, so the new
+    // journal starts above that.
+    journal_header_t old;
+    uint32_t sequence = 1;
+    if (read_header(dev, start, &old) == 0 && old.magic == JOURNAL_MAGIC) {
+        sequence = old.tail_sequence + clusters;
+    }
+    return write_header(dev, start, 0, sequence);
+}
+
+int journal_open(journal_t* journal, block_dev_t* dev, uint32_t start, uint32_t clusters) {
+    journal_header_t header;
+    if (clusters < 2 || start + clusters > dev->block_count || read_header(dev, start, &header) != 0) {
+        return -1;
+    }
+    if (header.magic != JOURNAL_MAGIC || header.tail >= clusters - 1) {
+        fprintf(stderr, "Error: The journal header is damaged.\n");
+        return -1;
+    }
+
+    memset(journal, 0, sizeof(journal_t));
+    journal->start = start;
+    journal->length = clusters - 1;
+    journal->tail = header.tail;
+    journal->head = header.tail;
+    journal->tail_sequence = header.tail_sequence;
+    journal->head_sequence = header.tail_sequence;
+    return 0;
+}
+
+uint32_t journal_record_clusters(uint32_t block_size, uint32_t image_count, uint32_t revoke_count) {
+    size_t descriptor_bytes = sizeof(record_header_t) + (image_count + revoke_count) * sizeof(uint16_t);
+    return (uint32_t)((descriptor_bytes + block_size - 1) / block_size) + image_count;
+}
+
+// Reads the record at 'offset' into a new buffer, if there is a complete one with the
+// expected sequence number that fits in 'room' clusters. Returns 1 with the record in
+// 'record' (freed by the caller), 0 where the log ends, or -1 on error.
+static int read_record(const journal_t* journal, block_dev_t* dev, uint32_t offset, uint32_t sequence, uint32_t room,
+                       uint8_t** record, uint32_t* clusters) {
+    uint32_t block = dev->block_size;
+    if (room == 0) return 0;
+    uint8_t* first = malloc(block);
+    if (first == NULL) {
+        fprintf(stderr, "Error: Could not allocate a journal record.\n");
+        return -1;
+    }
+    void* first_buffer[1] = { first };
+    if (read_log(journal, dev, offset, 1, first_buffer) != 0) {
+        free(first);
+        return -1;
+    }
+
+    record_header_t header;
+    memcpy(&header, first, sizeof(header));
+    free(first);
+    uint32_t total = header.descriptor_clusters + (uint32_t)header.image_count;
+    if (header.magic != JOURNAL_RECORD_MAGIC || header.sequence != sequence || total > room ||
+        header.descriptor_clusters != journal_record_clusters(block, header.image_count, header.revoke_count) - header.image_count) {
+        return 0;
+    }
+
+    uint8_t* bytes = malloc((size_t)total * block);
+    void** buffers = malloc(total * sizeof(void*));
+    if (bytes == NULL || buffers == NULL) {
+        free(bytes);
+        free(buffers);
+        fprintf(stderr, "Error: Could not allocate a journal record.\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < total; ++i) {
+        buffers[i] = bytes + (size_t)i * block;
+    }
+    int status = read_log(journal, dev, offset, total, buffers);
+    free(buffers);
+    if (status != 0) {
+        free(bytes);
+        return -1;
+    }
+
+    // A crash during the write leaves some clusters of the record old: the checksum won't match
+    uint32_t checksum = header.checksum;
+    header.checksum = 0;
+    memcpy(bytes, &header, sizeof(header));
+    if (checksum_final(checksum_update(CHECKSUM_SEED, bytes, (size_t)total * block)) != checksum) {
+        free(bytes);
+        return 0;
+    }
+    *record = bytes;
+    *clusters = total;
+    return 1;
+}
+
+// Walks the complete records from the tail on. Without 'apply', notes in 'revoked' the
+// last record revoking each cluster; with it, hands over every image not revoked by the
+// same or a later record. Leaves the head after the last record and returns their number.
+static int scan_log(journal_t* journal, block_dev_t* dev, uint32_t* revoked, journal_apply_fn_t apply, void* context) {
+    uint32_t offset = journal->tail;
+    uint32_t used = 0;
+    uint32_t sequence = journal->tail_sequence;
+    int count = 0;
+    while (1) {
+        uint8_t* record;
+        uint32_t clusters;
+        int status = read_record(journal, dev, offset, sequence, journal->length - used, &record, &clusters);
+        if (status < 0) return -1;
+        if (status == 0) break;
+
+        record_header_t header;
+        memcpy(&header, record, sizeof(header));
+        const uint8_t* homes = record + sizeof(header);
+        const uint8_t* revokes = homes + header.image_count * sizeof(uint16_t);
+        const uint8_t* images = record + (size_t)header.descriptor_clusters * dev->block_size;
+        for (uint32_t i = 0; apply == NULL && i < header.revoke_count; ++i) {
+            uint16_t cluster;
+            memcpy(&cluster, revokes + i * sizeof(uint16_t), sizeof(cluster));
+            if (cluster < dev->block_count) revoked[cluster] = sequence;
+        }
+        for (uint32_t i = 0; apply != NULL && i < header.image_count && status == 1; ++i) {
+            uint16_t cluster;
+            memcpy(&cluster, homes + i * sizeof(uint16_t), sizeof(cluster));
+            if (cluster < dev->block_count && revoked[cluster] < sequence &&
+                apply(context, cluster, images + (size_t)i * dev->block_size) != 0) {
+                status = -1;
+            }
+        }
+        free(record);
+        if (status < 0) return -1;
+
+        offset = (offset + clusters) % journal->length;
+        used += clusters;
+        sequence++;
+        count++;
+    }
+
+    journal->head = offset;
+    journal->used = used;
+    journal->head_sequence = sequence;
+    return count;
+}
+
+int journal_replay(journal_t* journal, block_dev_t* dev, journal_apply_fn_t apply, void* context) {
+    // Sequence numbers start above 0, so 0 means "never revoked"
+    uint32_t* revoked = calloc(dev->block_count, sizeof(uint32_t));
+    if (revoked == NULL) {
+        fprintf(stderr, "Error: Could not allocate the journal replay table.\n");
+        return -1;
+    }
+    int count = scan_log(journal, dev, revoked, NULL, NULL);
+    if (count > 0) {
+        count = scan_log(journal, dev, revoked, apply, context);
+    }
+    free(revoked);
+    return count;
+}
+
+int journal_append(journal_t* journal, block_dev_t* dev, const uint16_t* homes, const void* const* images, uint32_t image_count,
+                   const uint16_t* revokes, uint32_t revoke_count) {
+    uint32_t block = dev->block_size;
+    uint32_t total = journal_record_clusters(block, image_count, revoke_count);
+    if (total > journal->length - journal->used) {
+        fprintf(stderr, "Error: No room in the journal for a record of %u clusters.\n", total);
+        return -1;
+    }
+
+    uint32_t descriptor_clusters = total - image_count;
+    uint8_t* descriptor = calloc(descriptor_clusters, block);
+    const void** buffers = malloc(total * sizeof(void*));
+    if (descriptor == NULL || buffers == NULL) {
+        free(descriptor);
+        free(buffers);
+        fprintf(stderr, "Error: Could not allocate a journal record.\n");
+        return -1;
+    }
+
+    record_header_t header = { JOURNAL_RECORD_MAGIC, journal->head_sequence, 0, (uint16_t)descriptor_clusters,
+                               (uint16_t)image_count, (uint16_t)revoke_count, 0 };
+    memcpy(descriptor, &header, sizeof(header));
+    memcpy(descriptor + sizeof(header), homes, image_count * sizeof(uint16_t));
+    memcpy(descriptor + sizeof(header) + image_count * sizeof(uint16_t), revokes, revoke_count * sizeof(uint16_t));
+
+    uint64_t hash = checksum_update(CHECKSUM_SEED, descriptor, (size_t)descriptor_clusters * block);
+    for (uint32_t i = 0; i < image_count; ++i) {
+        hash = checksum_update(hash, images[i], block);
+    }
+    header.checksum = checksum_final(hash);
+    memcpy(descriptor, &header, sizeof(header));
+
+    for (uint32_t i = 0; i < descriptor_clusters; ++i) {
+        buffers[i] = descriptor + (size_t)i * block;
+    }
+    memcpy(buffers + descriptor_clusters, images, image_count * sizeof(void*));
+    int status = write_log(journal, dev, journal->head, total, buffers);
+    free(descriptor);
+    free(buffers);
+    if (status != 0) {
+        return -1;
+    }
+
+    journal->head = (journal->head + total) % journal->length;
+    journal->used += total;
+    journal->head_sequence++;
+    return 0;
+}
+
+int journal_checkpoint(journal_t* journal, block_dev_t* dev) {
+    if (write_header(dev, journal->start, journal->head, journal->head_sequence) != 0) {
+        return -1;
+    }
+    journal->tail = journal->head;
+    journal->tail_sequence = journal->head_sequence;
+    journal->used = 0;
+    return 0;
+}
@@ -0,0 +1,109 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block_dev.h"
+
+// --- Journal Constants ---
+#define JOURNAL_MAGIC 0x4C4E524Au        // "JRNL", first word of the header cluster
+#define JOURNAL_RECORD_MAGIC 0x4443524Au // "JRCD", first word of every record
+
+// --- Data Structures ---
+
+// A write-ahead log of metadata clusters in a reserved area of the device. The first
+// cluster of the area is a header saying where the oldest record still needed starts; the
+// rest is a circular log of records. A record holds the new images of some clusters
+// (logged before they are written to their home location) and the clusters whose older
+// images must no longer be replayed ("revoked", e.g. directory clusters that were freed
+// and may now hold file data). A checksum over the whole record tells a complete record
+// from one torn by a crash, so a record needs a single write and one flush.
+//
+// The module only reads and writes the log; when to commit, when to write the clusters
+// home and when to advance the tail are up to the caller, who also serializes every call.
+typedef struct {
+    uint32_t start;            // Cluster of the header; the log follows it
+    uint32_t length;           // Clusters in the log (the area minus the header)
+    uint32_t tail;             // Offset in the log of the oldest record still needed
+    uint32_t head;             // Offset where the next record goes
+    uint32_t used;             // Clusters from 'tail' to 'head'
+    uint32_t tail_sequence;    // Sequence number of the record at 'tail'
+    uint32_t head_sequence;    // Sequence number the next record gets
+} journal_t;
+
+// Counters kept by the journal's user.
+typedef struct {
+    uint64_t operations;       // Operations that logged something
+    uint64_t commits;          // Records written (each with one flush)
+    uint64_t clusters;         // Clusters written to the log, descriptors included
+    uint64_t checkpoints;      // Times the log was emptied after writing its clusters home
+} journal_stats_t;
+
+// Called by journal_replay() for every image to put back at its home location.
+typedef int (*journal_apply_fn_t)(void* context, uint16_t cluster, const void* image);
+
+/**
+ * @brief Writes an empty journal to an area of the device.
+ * @param dev The device.
+ * @param start First cluster of the area (the header).
+ * @param clusters Clusters in the area, header included (at least 2).
+ * @return 0 on success, -1 on error.
+ */
+int journal_format(block_dev_t* dev, uint32_t start, uint32_t clusters);
+
+/**
+ * @brief Reads the header of a journal written by journal_format().
+ * @param journal Receives the position of the log. Nothing is replayed yet.
+ * @param dev The device.
+ * @param start First cluster of the area (the header).
+ * @param clusters Clusters in the area, header included.
+ * @return 0 on success, -1 if the header can't be read or isn't a journal header.
+ */
+int journal_open(journal_t* journal, block_dev_t* dev, uint32_t start, uint32_t clusters);
+
+/**
+ * @brief Finds the complete records from the tail on and hands their images to 'apply',
+ * oldest first, skipping images revoked by the same or a later record. Afterwards new records go after
+ * the last complete one; the tail stays put until journal_checkpoint().
+ * @param journal An opened journal.
+ * @param dev The device.
+ * @param apply Called for every image to write home.
+ * @param context Passed to 'apply'.
+ * @return The number of records replayed, or -1 on error.
+ */
+int journal_replay(journal_t* journal, block_dev_t* dev, journal_apply_fn_t apply, void* context);
+
+/**
+ * @brief Size in the log of a record, descriptor included.
+ * @param block_size Bytes per cluster.
+ * @param image_count Clusters logged.
+ * @param revoke_count Clusters revoked.
+ * @return The number of clusters.
+ */
+uint32_t journal_record_clusters(uint32_t block_size, uint32_t image_count, uint32_t revoke_count);
+
+/**
+ * @brief Appends one record after the head with a single write (two when it wraps around
+ * the end of the log). The record is not durable until the device is flushed.
+ * @param journal An opened (and replayed) journal with room for the record.
+ * @param dev The device.
+ * @param homes Home cluster of each image.
+ * @param images 'image_count' cluster images.
+ * @param image_count Number of images.
+ * @param revokes Clusters whose images in earlier records must not be replayed.
+ * @param revoke_count Number of revoked clusters.
+ * @return 0 on success, -1 on error (the log is left as it was).
+ */
+int journal_append(journal_t* journal, block_dev_t* dev, const uint16_t* homes, const void* const* images, uint32_t image_count,
+                   const uint16_t* revokes, uint32_t revoke_count);
+
+/**
+ * @brief Empties the log by moving the tail to the head. Only call it once every logged
+ * cluster has reached its home location durably; the header is written but not flushed.
+ * @param journal An opened journal.
+ * @param dev The device.
+ * @return 0 on success, -1 on error.
+ */
+int journal_checkpoint(journal_t* journal, block_dev_t* dev);
+
+#endif // JOURNAL_H
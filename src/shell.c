@@ -5,12 +5,14 @@
 
 #define CMD_BUFFER_SIZE 4096 // when using append, we need a larger buffer
 
-int main() {
+int main(int argc, char* argv[]) {
     char cmd_line[CMD_BUFFER_SIZE];
     bool fs_loaded = false;
 
     // Try to open the partition file, but don't fail if it doesn't exist yet
-    init_fs();
+    const char* image_path = (argc > 1) ? argv[1] : PARTITION_NAME;
+    fat_volume_t* vol = fs_open_volume(image_path);
+    if (vol == NULL) return 1;
 
     printf("FAT16 File System Simulator. Type 'exit' to quit.\n");
 
@@ -41,7 +43,13 @@ int main() {
         if (strcmp(command, "exit") == 0) break;
 
         if (strcmp(command, "init") == 0) {
-            if (fs_format() == 0) {
+            // init [cluster_size [cluster_count]]: the default geometry for what is left out
+            fs_geometry_t geometry = { FS_DEFAULT_CLUSTER_SIZE, FS_DEFAULT_CLUSTER_COUNT, 0, 0, 0, 0, 0 };
+            char* arg1 = strtok(NULL, " ");
+            char* arg2 = strtok(NULL, " ");
+            if (arg1) geometry.cluster_size = (uint32_t)strtoul(arg1, NULL, 10);
+            if (arg2) geometry.cluster_count = (uint32_t)strtoul(arg2, NULL, 10);
+            if (fs_format(vol, arg1 ? &geometry : NULL) == 0) {
                 printf("File system formatted. Run 'load' to use it.\n");
                 fs_loaded = false;
             } else {
@@ -49,7 +57,7 @@ int main() {
             }
         }
         else if (strcmp(command, "load") == 0) {
-            if (fs_load_fat() == 0) {
+            if (fs_load_fat(vol) == 0) {
                 fs_loaded = true;
                 printf("File system loaded and ready.\n");
             } else {
@@ -60,33 +68,33 @@ int main() {
         else if (fs_loaded) { // --- Commands requiring a loaded FS ---
             if (strcmp(command, "ls") == 0) {
                 char* arg1 = strtok(NULL, " ");
-                fs_ls((arg1 != NULL) ? arg1 : "/");
+                fs_ls(vol, (arg1 != NULL) ? arg1 : "/");
             }
             else if (strcmp(command, "mkdir") == 0) {
                 char* arg1 = strtok(NULL, " ");
-                if (arg1) fs_mkdir(arg1);
+                if (arg1) fs_mkdir(vol, arg1);
                 else fprintf(stderr, "mkdir: missing operand\n");
             }
             else if (strcmp(command, "create") == 0) {
                 char* arg1 = strtok(NULL, " ");
-                if (arg1) fs_create(arg1);
+                if (arg1) fs_create(vol, arg1);
                 else fprintf(stderr, "create: missing operand\n");
             }
             else if (strcmp(command, "unlink") == 0) {
                 char* arg1 = strtok(NULL, " ");
-                if (arg1) fs_unlink(arg1);
+                if (arg1) fs_unlink(vol, arg1);
                 else fprintf(stderr, "unlink: missing operand\n");
             }
             else if (strcmp(command, "read") == 0) {
                 char* arg1 = strtok(NULL, " ");
-                if (arg1) fs_read(arg1);
+                if (arg1) fs_read(vol, arg1);
                 else fprintf(stderr, "read: missing operand\n");
             }
             else if (strcmp(command, "write") == 0) {
                 char* arg_str = strtok(NULL, "\"");
                 char* arg_path = strtok(NULL, " ");
                 if (arg_str && arg_path) {
-                    fs_write(arg_path, arg_str);
+                    fs_write(vol, arg_path, arg_str);
                 } else {
                     fprintf(stderr, "Usage: write \"content\" /path/to/file\n");
                 }
@@ -95,11 +103,120 @@ int main() {
                 char* arg_str = strtok(NULL, "\"");
                 char* arg_path = strtok(NULL, " ");
                 if (arg_str && arg_path) {
-                    fs_append(arg_path, arg_str);
+                    fs_append(vol, arg_path, arg_str);
                 } else {
                     fprintf(stderr, "Usage: append \"content\" /path/to/file\n");
                 }
             }
+            else if (strcmp(command, "import") == 0) {
+                char* arg_host = strtok(NULL, " ");
+                char* arg_path = strtok(NULL, " ");
+                if (arg_host && arg_path) {
+                    FILE* host = fopen(arg_host, "rb");
+                    if (host != NULL) {
+                        fs_write_from_host(vol, arg_path, host);
+                        fclose(host);
+                    } else {
+                        perror("import");
+                    }
+                } else {
+                    fprintf(stderr, "Usage: import host_file /path/to/file\n");
+                }
+            }
+            else if (strcmp(command, "open") == 0) {
+                char* arg1 = strtok(NULL, " ");
+                if (arg1) {
+                    int handle = fs_open(vol, arg1);
+                    if (handle >= 0) printf("Opened '%s' as handle %d.\n", arg1, handle);
+                } else {
+                    fprintf(stderr, "open: missing operand\n");
+                }
+            }
+            else if (strcmp(command, "close") == 0) {
+                char* arg1 = strtok(NULL, " ");
+                if (arg1) fs_close(vol, (int)strtol(arg1, NULL, 10));
+                else fprintf(stderr, "close: missing operand\n");
+            }
+            else if (strcmp(command, "pread") == 0) {
+                char* arg_handle = strtok(NULL, " ");
+                char* arg_offset = strtok(NULL, " ");
+                char* arg_count = strtok(NULL, " ");
+                long count = arg_count ? strtol(arg_count, NULL, 10) : 0;
+                if (arg_handle && arg_offset && count > 0 && count < CMD_BUFFER_SIZE) {
+                    char data[CMD_BUFFER_SIZE];
+                    int64_t bytes = fs_pread(vol, (int)strtol(arg_handle, NULL, 10), data, (uint32_t)count,
+                                             (uint32_t)strtoul(arg_offset, NULL, 10));
+                    if (bytes >= 0) {
+                        fwrite(data, 1, (size_t)bytes, stdout);
+                        printf("\n");
+                    }
+                } else {
+                    fprintf(stderr, "Usage: pread <handle> <offset> <count> (count below %d)\n", CMD_BUFFER_SIZE);
+                }
+            }
+            else if (strcmp(command, "pwrite") == 0) {
+                char* arg_handle = strtok(NULL, " ");
+                char* arg_offset = strtok(NULL, " ");
+                char* arg_str = strtok(NULL, "\"");
+                if (arg_handle && arg_offset && arg_str) {
+                    uint32_t offset = (uint32_t)strtoul(arg_offset, NULL, 10);
+                    int64_t bytes = fs_pwrite(vol, (int)strtol(arg_handle, NULL, 10), arg_str, (uint32_t)strlen(arg_str), offset);
+                    if (bytes >= 0) printf("Wrote %lld bytes at offset %u.\n", (long long)bytes, offset);
+                } else {
+                    fprintf(stderr, "Usage: pwrite <handle> <offset> \"content\"\n");
+                }
+            }
+            else if (strcmp(command, "begin") == 0) {
+                if (fs_batch_begin(vol) == 0) printf("Batch open. Run 'commit' to persist it.\n");
+            }
+            else if (strcmp(command, "commit") == 0) {
+                if (fs_batch_commit(vol) == 0) printf("Batch committed.\n");
+            }
+            else if (strcmp(command, "sync") == 0) {
+                if (fs_sync(vol) != 0) fprintf(stderr, "sync: failed to flush cached clusters\n");
+            }
+            else if (strcmp(command, "cache") == 0) {
+                char* arg1 = strtok(NULL, " ");
+                long slots = arg1 ? strtol(arg1, NULL, 10) : 0;
+                if (slots > 0) {
+                    if (fs_set_cache_size(vol, (size_t)slots) == 0) printf("Cache resized to %ld clusters.\n", slots);
+                } else {
+                    fprintf(stderr, "Usage: cache <number of clusters>\n");
+                }
+            }
+            else if (strcmp(command, "backend") == 0) {
+                char* arg1 = strtok(NULL, " ");
+                if (arg1 && strcmp(arg1, "file") == 0) fs_set_backend(vol, FS_BACKEND_FILE);
+                else if (arg1 && strcmp(arg1, "mmap") == 0) fs_set_backend(vol, FS_BACKEND_MMAP);
+                else fprintf(stderr, "Usage: backend file|mmap\n");
+            }
+            else if (strcmp(command, "durability") == 0) {
+                char* arg1 = strtok(NULL, " ");
+                if (arg1 && strcmp(arg1, "none") == 0) fs_set_durability(vol, FS_DURABILITY_NONE);
+                else if (arg1 && strcmp(arg1, "commit") == 0) fs_set_durability(vol, FS_DURABILITY_COMMIT);
+                else if (arg1 && strcmp(arg1, "strict") == 0) fs_set_durability(vol, FS_DURABILITY_STRICT);
+                else fprintf(stderr, "Usage: durability none|commit|strict\n");
+            }
+            else if (strcmp(command, "index") == 0) {
+                char* arg1 = strtok(NULL, " ");
+                if (arg1 && strcmp(arg1, "on") == 0) fs_set_dir_index(vol, true);
+                else if (arg1 && strcmp(arg1, "off") == 0) fs_set_dir_index(vol, false);
+                else fprintf(stderr, "Usage: index on|off\n");
+            }
+            else if (strcmp(command, "stats") == 0) {
+                cache_stats_t stats;
+                fs_get_cache_stats(vol, &stats);
+                printf("Cache hits:       %llu\n", (unsigned long long)stats.hits);
+                printf("Cache misses:     %llu\n", (unsigned long long)stats.misses);
+                printf("Cache evictions:  %llu\n", (unsigned long long)stats.evictions);
+                printf("Cache writebacks: %llu\n", (unsigned long long)stats.writebacks);
+                journal_stats_t journal;
+                fs_get_journal_stats(vol, &journal);
+                printf("Journal operations:  %llu\n", (unsigned long long)journal.operations);
+                printf("Journal commits:     %llu\n", (unsigned long long)journal.commits);
+                printf("Journal clusters:    %llu\n", (unsigned long long)journal.clusters);
+                printf("Journal checkpoints: %llu\n", (unsigned long long)journal.checkpoints);
+            }
             else {
                 printf("Command '%s' not implemented or invalid.\n", command);
             }
@@ -111,7 +228,7 @@ int main() {
     }
 
     printf("Shutting down simulator.\n");
-    close_fs();
+    fs_close_volume(vol);
 
     return 0;
 }
\ No newline at end of file